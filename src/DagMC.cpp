@@ -1,4 +1,6 @@
 #include "DagMC.hpp"
+#include "ray_capture.hpp"
+#include "morton.hpp"
 #include "MBTagConventions.hpp"
 #include "moab/CartVect.hpp"
 #include "moab/Range.hpp"
@@ -30,6 +32,9 @@
 #include <stdio.h>
 
 #include <math.h>
+#include <mutex>
+#include <thread>
+#include <random>
 #ifndef M_PI  /* windows */
 # define M_PI 3.14159265358979323846
 #endif
@@ -72,9 +77,17 @@ namespace moab {
 
   const bool debug    = false; /* controls print statements */
   const bool counting = false; /* controls counts of ray casts and pt_in_vols */
+  const double edge_tol = 1e-5; /* barycentric distance at which a hit is on a facet edge */
+  const double instance_tol = 1e-6; /* distance within which an instanced volume's vertices match its prototype's */
 
 DagMC *DagMC::instance_ = NULL;
 
+// the variant each thread's queries fire at in each DagMC, by its serial
+// number, set by use_variant (none for the base); serial numbers are never
+// reused, so a deleted DagMC's entries cannot match a new one
+static thread_local std::map<unsigned long, rtc*> thread_variants;
+static std::atomic<unsigned long> next_serial_number( 0 );
+
 // Empty synonym map for DagMC::parse_metadata()
 const std::map<std::string, std::string> DagMC::no_synonyms;
 
@@ -111,14 +124,32 @@ unsigned int DagMC::interface_revision()
   defaultFacetingTolerance = .001;
   numericalPrecision = .001;
   useCAD = false;
+  volGridResolution = 0;
+  meshReleased = false;
+  motionStart = 0.0;
+  motionEnd = 1.0;
+  volGridMaxBytes = 64*1024*1024;
+  instancing = true;
+  serialNumber = ++next_serial_number;
+  impl_compl_handle = 0;
 
   RTC = new rtc;
+  em_surf_offset = 0;
+  em_tri_offset = 0;
+  em_winding_trees = NULL;
+  em_num_winding_trees = 0;
   
   memset( implComplName, 0, NAME_TAG_SIZE );
   strcpy( implComplName , "impl_complement" );
 
 }
 
+DagMC::~DagMC()
+{
+  reset_winding_trees( 0 );
+  free_safety_grids();
+}
+
 
 
 
@@ -128,6 +159,26 @@ unsigned int DagMC::interface_revision()
 ErrorCode DagMC::load_file(const char* cfile,
                            const double facet_tolerance)
 {
+  return load_file_subset( cfile, facet_tolerance, NULL );
+}
+
+// loads only the given volumes, their surfaces and those surfaces' contents
+ErrorCode DagMC::load_volumes(const char* cfile,
+                              const std::vector<int>& vol_ids,
+                              const double facet_tolerance)
+{
+  if (vol_ids.empty()) {
+    std::cerr << "DagMC: no volumes requested from " << cfile << std::endl;
+    return MB_ENTITY_NOT_FOUND;
+  }
+  return load_file_subset( cfile, facet_tolerance, &vol_ids );
+}
+
+ErrorCode DagMC::load_file_subset(const char* cfile,
+                                  const double facet_tolerance,
+                                  const std::vector<int>* vol_ids)
+{
+  PhaseScope phase( profiler, "load_file" );
   ErrorCode rval;
 
   std::cout << "Requested faceting tolerance: " << facet_tolerance << std::endl;
@@ -146,15 +197,24 @@ ErrorCode DagMC::load_file(const char* cfile,
 
   sprintf(facetTolStr,"%g",facetingTolerance);
 
-  char options[120] = "CGM_ATTRIBS=yes;FACET_DISTANCE_TOLERANCE=";
+  char options[160] = "CGM_ATTRIBS=yes;FACET_DISTANCE_TOLERANCE=";
   strcat(options,facetTolStr);
+  // a subset is read as the volume sets with the requested IDs, their child
+  // surfaces (and curves) with the triangles and vertices they contain, but
+  // not the sets the volumes contain
+  if (vol_ids)
+    strcat(options,";CHILDREN=CONTENTS;SETS=NONE");
 
   EntityHandle file_set;
   rval = MBI->create_meshset( MESHSET_SET, file_set );
   if (MB_SUCCESS != rval)
     return rval;
 
-  rval = MBI->load_file(cfile, &file_set, options, NULL, 0, 0);
+  if (vol_ids)
+    rval = MBI->load_file(cfile, &file_set, options, GLOBAL_ID_TAG_NAME,
+                          &(*vol_ids)[0], vol_ids->size());
+  else
+    rval = MBI->load_file(cfile, &file_set, options, NULL, 0, 0);
 
   if( MB_UNHANDLED_OPTION == rval ){
     // Some options were unhandled; this is common for loading h5m files.
@@ -180,10 +240,195 @@ ErrorCode DagMC::load_file(const char* cfile,
   }
 #endif
 
+  if (vol_ids) {
+    rval = prune_partial_load( *vol_ids );
+    if (MB_SUCCESS != rval)
+      return rval;
+  }
+
   return finish_loading();
 
 }
 
+// the partial read also picks up surfaces, curves and groups whose IDs match a
+// requested volume's; this deletes them and the entities only they contain
+ErrorCode DagMC::prune_partial_load(const std::vector<int>& vol_ids)
+{
+  ErrorCode rval;
+  Tag id_tag, dim_tag;
+  rval = MBI->tag_get_handle( GLOBAL_ID_TAG_NAME, 1, MB_TYPE_INTEGER, id_tag );
+  if (MB_SUCCESS != rval)
+    return rval;
+  rval = MBI->tag_get_handle( GEOM_DIMENSION_TAG_NAME, 1, MB_TYPE_INTEGER, dim_tag );
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  Range id_sets;
+  rval = MBI->get_entities_by_type_and_tag( 0, MBENTITYSET, &id_tag, NULL, 1, id_sets );
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  // the requested volumes and everything below them
+  std::set<int> wanted( vol_ids.begin(), vol_ids.end() );
+  Range keep, stray;
+  for (Range::iterator i = id_sets.begin(); i != id_sets.end(); ++i) {
+    int id, dim = -1;
+    rval = MBI->tag_get_data( id_tag, &*i, 1, &id );
+    if (MB_SUCCESS != rval)
+      return rval;
+    if (!wanted.count( id ))
+      continue;
+    MBI->tag_get_data( dim_tag, &*i, 1, &dim );
+    if (3 == dim) {
+      keep.insert( *i );
+      rval = MBI->get_child_meshsets( *i, keep, 0 );
+      if (MB_SUCCESS != rval)
+        return rval;
+    }
+    else {
+      stray.insert( *i );
+      rval = MBI->get_child_meshsets( *i, stray, 0 );
+      if (MB_SUCCESS != rval)
+        return rval;
+    }
+  }
+  stray = subtract( stray, keep );
+  if (stray.empty())
+    return MB_SUCCESS;
+
+  // entities and vertices used only by the stray sets; a set they contain
+  // (e.g. a kept volume in a group with its ID) goes only if it is stray too
+  Range keep_ents, stray_ents, keep_verts, stray_verts;
+  for (Range::iterator i = keep.begin(); i != keep.end(); ++i) {
+    rval = MBI->get_entities_by_handle( *i, keep_ents );
+    if (MB_SUCCESS != rval)
+      return rval;
+  }
+  for (Range::iterator i = stray.begin(); i != stray.end(); ++i) {
+    rval = MBI->get_entities_by_handle( *i, stray_ents );
+    if (MB_SUCCESS != rval)
+      return rval;
+  }
+  stray_ents = subtract( stray_ents, keep_ents );
+  stray_ents = subtract( stray_ents, stray_ents.subset_by_type( MBENTITYSET ) );
+  rval = MBI->get_connectivity( keep_ents, keep_verts );
+  if (MB_SUCCESS != rval)
+    return rval;
+  keep_verts.merge( keep_ents.subset_by_type( MBVERTEX ) );
+  rval = MBI->get_connectivity( stray_ents, stray_verts );
+  if (MB_SUCCESS != rval)
+    return rval;
+  stray_verts.merge( stray_ents.subset_by_type( MBVERTEX ) );
+  stray_verts = subtract( stray_verts, keep_verts );
+
+  rval = MBI->delete_entities( stray );
+  if (MB_SUCCESS != rval)
+    return rval;
+  rval = MBI->delete_entities( subtract( stray_ents, stray_ents.subset_by_type( MBVERTEX ) ) );
+  if (MB_SUCCESS != rval)
+    return rval;
+  return MBI->delete_entities( stray_verts );
+}
+
+// triangle count and bounding box of every volume in a file
+ErrorCode DagMC::volume_costs(const char* cfile, std::vector<VolumeCost>& costs)
+{
+  Core mb;
+  ErrorCode rval = mb.load_file( cfile );
+  if (MB_SUCCESS != rval && MB_UNHANDLED_OPTION != rval)
+    return rval;
+
+  Tag id_tag, dim_tag;
+  rval = mb.tag_get_handle( GLOBAL_ID_TAG_NAME, 1, MB_TYPE_INTEGER, id_tag );
+  if (MB_SUCCESS != rval)
+    return rval;
+  rval = mb.tag_get_handle( GEOM_DIMENSION_TAG_NAME, 1, MB_TYPE_INTEGER, dim_tag );
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  Range vols;
+  const int three = 3;
+  const void* const three_val[] = {&three};
+  rval = mb.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, three_val, 1, vols );
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  costs.clear();
+  std::vector<double> coords;
+  for (Range::iterator i = vols.begin(); i != vols.end(); ++i) {
+    Range surfs, tris, verts;
+    rval = mb.get_child_meshsets( *i, surfs );
+    if (MB_SUCCESS != rval)
+      return rval;
+    for (Range::iterator j = surfs.begin(); j != surfs.end(); ++j) {
+      rval = mb.get_entities_by_type( *j, MBTRI, tris );
+      if (MB_SUCCESS != rval)
+        return rval;
+    }
+    rval = mb.get_connectivity( tris, verts );
+    if (MB_SUCCESS != rval)
+      return rval;
+    if (verts.empty())
+      continue;
+    coords.resize( 3*verts.size() );
+    rval = mb.get_coords( verts, &coords[0] );
+    if (MB_SUCCESS != rval)
+      return rval;
+
+    VolumeCost cost;
+    rval = mb.tag_get_data( id_tag, &*i, 1, &cost.id );
+    if (MB_SUCCESS != rval)
+      return rval;
+    cost.cost = tris.size();
+    std::copy( coords.begin(), coords.begin()+3, cost.lo );
+    std::copy( coords.begin(), coords.begin()+3, cost.hi );
+    for (size_t k = 3; k < coords.size(); ++k) {
+      cost.lo[k%3] = std::min( cost.lo[k%3], coords[k] );
+      cost.hi[k%3] = std::max( cost.hi[k%3], coords[k] );
+    }
+    costs.push_back( cost );
+  }
+
+  return MB_SUCCESS;
+}
+
+// IDs of the volumes whose bounding boxes overlap the box [lo, hi]
+ErrorCode DagMC::volumes_in_region(const char* cfile, const double lo[3], const double hi[3],
+                                   std::vector<int>& vol_ids)
+{
+  std::vector<VolumeCost> costs;
+  ErrorCode rval = volume_costs( cfile, costs );
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  vol_ids.clear();
+  for (unsigned i = 0; i < costs.size(); ++i) {
+    const VolumeCost& vol = costs[i];
+    if (vol.lo[0] > hi[0] || vol.lo[1] > hi[1] || vol.lo[2] > hi[2] ||
+        vol.hi[0] < lo[0] || vol.hi[1] < lo[1] || vol.hi[2] < lo[2])
+      continue;
+    vol_ids.push_back( vol.id );
+  }
+
+  return MB_SUCCESS;
+}
+
+void DagMC::set_volume_owners(const std::vector<int>& vol_ids, const std::vector<int>& owners)
+{
+  volOwners.clear();
+  for (unsigned i = 0; i < vol_ids.size() && i < owners.size(); ++i)
+    volOwners[vol_ids[i]] = owners[i];
+}
+
+int DagMC::owner_of(EntityHandle volume)
+{
+  if (volOwners.empty())
+    return -1;
+  int id = get_entity_id( volume );
+  std::map<int,int>::const_iterator it = volOwners.find( id );
+  return ( volOwners.end() == it ) ? -1 : it->second;
+}
+
 // helper function to load the existing contents of a MOAB instance into DAGMC
 ErrorCode DagMC::load_existing_contents( ){
 
@@ -193,6 +438,7 @@ ErrorCode DagMC::load_existing_contents( ){
 // helper function to finish setting up required tags.
 ErrorCode DagMC::finish_loading()
 {
+  PhaseScope phase( profiler, "finish_loading" );
 
   ErrorCode rval;
 
@@ -245,6 +491,7 @@ ErrorCode DagMC::finish_loading()
 // setup the implicit compliment
 ErrorCode DagMC::setup_impl_compl()
 {
+  PhaseScope phase( profiler, "setup_impl_compl" );
   // If it doesn't already exist, create implicit complement
   // Create data structures for implicit complement
   ErrorCode rval = get_impl_compl();
@@ -281,6 +528,7 @@ ErrorCode DagMC::setup_geometry(Range &surfs, Range &vols)
 // sets up the obb tree for the problem
 ErrorCode DagMC::setup_obbs()
 {
+  PhaseScope phase( profiler, "setup_obbs" );
   ErrorCode rval;
   Range surfs,vols;
   rval = setup_geometry(surfs,vols);
@@ -301,6 +549,7 @@ ErrorCode DagMC::setup_obbs()
 // setups of the indices for the problem, builds a list of
 ErrorCode DagMC::setup_indices()
 {
+  PhaseScope phase( profiler, "setup_indices" );
   Range surfs, vols;
   ErrorCode rval = setup_geometry(surfs,vols);
 
@@ -322,8 +571,13 @@ ErrorCode DagMC::setup_indices()
 // initialise the obb tree
 ErrorCode DagMC::init_OBBTree()
 {
+  PhaseScope phase( profiler, "init_OBBTree" );
   ErrorCode rval;
 
+  // a mesh loaded after release_mesh is complete again
+  meshReleased = false;
+  // copies of the scenes of an earlier mesh
+  set_numa_replication( false );
 
   // implicit compliment
   rval = setup_impl_compl();MB_CHK_SET_ERR(rval, "Failed to setup the implicit compliment");
@@ -349,64 +603,495 @@ ErrorCode DagMC::init_OBBTree()
   rval = MBI->get_entities_by_type_and_tag(0, MBENTITYSET, &geom_tag, &dim_three, 1, vols);
   MB_CHK_SET_ERR(rval, "Failed to get the Volumes.");
 
+  {
+    PhaseScope senses_phase( profiler, "build_surface_senses" );
+    rval = build_surface_senses();
+    MB_CHK_SET_ERR(rval, "Failed to cache the surface senses.");
+  }
+
+  {
+    PhaseScope normals_phase( profiler, "build_facet_normals" );
+    rval = build_facet_normals();
+    MB_CHK_SET_ERR(rval, "Failed to store the facet normals.");
+  }
+
   //start new embree raytracingcore instance
   RTC->init();
 
+  Range::iterator vit;
+  RTC->set_offset(vols);
+  em_scene_arr_offset = *vols.begin();
+  em_scene_arr.resize(vols.back()-em_scene_arr_offset+1);
+  em_scene_tris.resize(vols.back()-em_scene_arr_offset+1);
+  em_scene_senses.resize(vols.back()-em_scene_arr_offset+1);
+  em_scene_geoms.assign(vols.back()-em_scene_arr_offset+1, std::map<EntityHandle,int>());
+  reset_winding_trees(vols.back()-em_scene_arr_offset+1);
+  // an earlier mesh's safety grids do not bound this one
+  free_safety_grids();
+  em_prototypes.assign(vols.back()-em_scene_arr_offset+1, 0);
+  em_scene_sweeps.assign(vols.back()-em_scene_arr_offset+1, 0.0);
+
+  // surfaces of the moving volumes, with their displacement over the motion
+  // interval; a surface bounding two moving volumes must move with both
+  surfMotions.clear();
+  for( std::map<int, CartVect>::iterator m = volMotions.begin(); m != volMotions.end(); ++m )
+    {
+      EntityHandle vol = entity_by_id(3, m->first);
+      if( 0 == vol )
+	MB_SET_ERR(MB_ENTITY_NOT_FOUND, "No volume " << m->first << " to move.");
+      Range surfaces;
+      rval = MBI->get_child_meshsets( vol, surfaces );
+      MB_CHK_SET_ERR(rval, "Failed to get the surfaces of a moving volume.");
+      for( Range::iterator it = surfaces.begin(); it != surfaces.end(); ++it )
+	{
+	  std::map<EntityHandle, CartVect>::iterator sm = surfMotions.find(*it);
+	  if( sm != surfMotions.end() && (sm->second - m->second).length() > 0.0 )
+	    MB_SET_ERR(MB_FAILURE, "Surface " << get_entity_id(*it) << " is moved by two volumes.");
+	  surfMotions[*it] = m->second;
+	}
+    }
+
+  // the surfaces of each volume and, for a copy of an earlier volume, that
+  // volume and the translation; found before the vertices are transferred so
+  // that the vertices of copies stay out of the vertex buffer
+  std::vector< std::vector<const double*> > scene_motions(vols.back()-em_scene_arr_offset+1);
+  std::vector<double> instance_offsets(3*(vols.back()-em_scene_arr_offset+1), 0.0);
+  PrototypeIndex prototypes;
+  int num_instances = 0;
+  {
+    PhaseScope prototype_phase( profiler, "find_prototypes" );
+    for( vit = vols.begin(); vit != vols.end(); ++vit)
+      {
+	Range surfaces;
+	// get the entities tagged with dimension & type 
+	surfaces.clear();
+	rval = MBI->get_child_meshsets( *vit, surfaces );
+	MB_CHK_SET_ERR(rval, "Failed to get the surfaces.");
+
+
+	//add triangles to the ray tracing scene
+	Range::iterator it;
+	std::vector<EntityHandle> these_surfs;
+	std::vector<Range> these_tris;
+	std::vector<int> these_senses;
+	std::vector<const double*> these_motions;
+	bool moving = false;
+	these_surfs.clear();
+	for( it = surfaces.begin(); it != surfaces.end(); ++it)
+	  {
+	    std::map<EntityHandle, CartVect>::iterator sm = surfMotions.find(*it);
+	    these_motions.push_back( sm == surfMotions.end() ? NULL : sm->second.array() );
+	    moving = moving || sm != surfMotions.end();
+	    if( sm != surfMotions.end() )
+	      em_scene_sweeps[*vit-em_scene_arr_offset] =
+		std::max( em_scene_sweeps[*vit-em_scene_arr_offset], sm->second.length() );
+
+	    Range tris;
+	    these_surfs.push_back(*it);
+
+	    int sense;
+	    rval = surface_sense( *vit, 1, &(*it), &sense);
+
+	    rval = MBI->get_entities_by_type(*it, MBTRI, tris);
+
+	    these_tris.push_back(tris);
+	    these_senses.push_back(sense);
+	  }
+
+	//a copy of an earlier volume shares that volume's scene through an
+	//instance; moving volumes have scenes of their own
+	size_t index = *vit-em_scene_arr_offset;
+	if( instancing && *vit != impl_compl_handle && !moving )
+	  {
+	    rval = find_prototype( *vit, these_tris, these_senses, prototypes,
+				   em_prototypes[index], &instance_offsets[3*index] );
+	    MB_CHK_SET_ERR(rval, "Failed to compare the volume with earlier volumes.");
+	    if( em_prototypes[index] )
+	      num_instances++;
+	  }
+
+	em_scene_map[*vit] = these_surfs;
+	em_scene_arr[index] = these_surfs;
+	for( unsigned int i = 0; i < these_surfs.size(); i++ )
+	  em_scene_geoms[index][these_surfs[i]] = i;
+	em_scene_tris[index].swap(these_tris);
+	em_scene_senses[index].swap(these_senses);
+	scene_motions[index].swap(these_motions);
+      }
+  }
+
   //clear out old vector of surfaces if they exist
   std::cout << "Transferring vertcies to the Embree instance...";
-  RTC->create_vertex_map(MBI);
+  {
+    PhaseScope vertex_phase( profiler, "create_vertex_map" );
+    if( num_instances )
+      {
+	// only the volumes with scenes of their own use the vertex buffer
+	Range scene_tris, scene_verts;
+	for( vit = vols.begin(); vit != vols.end(); ++vit)
+	  {
+	    if( em_prototypes[*vit-em_scene_arr_offset] )
+	      continue;
+	    const std::vector<Range>& tris = em_scene_tris[*vit-em_scene_arr_offset];
+	    for( unsigned int i = 0; i < tris.size(); i++ )
+	      scene_tris.merge(tris[i]);
+	  }
+	rval = MBI->get_connectivity(scene_tris, scene_verts);
+	MB_CHK_SET_ERR(rval, "Failed to get the vertices of the scenes.");
+	RTC->create_vertex_map(MBI, &scene_verts);
+      }
+    else
+      RTC->create_vertex_map(MBI);
+  }
   std::cout << "done." << std::endl;
 
   std::cout << "Transferring triangles to the Embree instance...";
-  Range::iterator vit;
-  RTC->set_offset(vols);
-  em_scene_arr_offset = *vols.begin();
-  em_scene_arr.resize(vols.back()-em_scene_arr_offset+1);
   for( vit = vols.begin(); vit != vols.end(); ++vit)
     {
-      //create a new scene for this volume
-      RTC->create_scene(*vit);
-
-      Range surfaces;
-      // get the entities tagged with dimension & type 
-      surfaces.clear();
-      rval = MBI->get_child_meshsets( *vit, surfaces );
-      MB_CHK_SET_ERR(rval, "Failed to get the surfaces.");
+      size_t index = *vit-em_scene_arr_offset;
 
+      // volume IDs label the per-volume phases
+      int vol_id = -1;
+      if( profiler.is_enabled() )
+	MBI->tag_get_data( idTag, &(*vit), 1, &vol_id );
 
-      //add triangles to the ray tracing scene
-      Range::iterator it;
-      std::vector<EntityHandle> these_surfs;
-      these_surfs.clear();
-      for( it = surfaces.begin(); it != surfaces.end(); ++it)
+      if( em_prototypes[index] )
+	{
+	  PhaseScope instance_phase( profiler, "create_instance", vol_id );
+	  RTC->create_instance(*vit, em_prototypes[index], &instance_offsets[3*index]);
+	}
+      else
 	{
+	  //create a new scene for this volume
+	  RTC->create_scene(*vit);
+	  {
+	    PhaseScope triangles_phase( profiler, "add_triangles", vol_id );
+	    const std::vector<Range>& these_tris = em_scene_tris[index];
+	    for( unsigned int i = 0; i < these_tris.size(); i++ )
+	      RTC->add_triangles(MBI,*vit,these_tris[i],em_scene_senses[index][i],NULL,scene_motions[index][i]);
+	  }
+	  //now that we've added everything for this volume, commit the scene
+	  PhaseScope commit_phase( profiler, "commit_scene", vol_id );
+	  RTC->commit_scene(*vit);
+	}
+    }
+  std::cout << "done (" << num_instances << " instanced volumes)." << std::endl;
+
 
-	  Range tris;
-	  these_surfs.push_back(*it);
+  // setup indices
+  rval = setup_indices();MB_CHK_SET_ERR(rval, "Failed to setup problem indices");
 
-	  int sense;
-	  rval = surface_sense( *vit, 1, &(*it), &sense);
+  // the parsed property tables are indexed like the volumes and surfaces, and
+  // the index holds handles, so both are read again from the property tags of
+  // this mesh
+  rval = build_property_tables();MB_CHK_SET_ERR(rval, "Failed to build the property tables");
+  rval = build_property_index();MB_CHK_SET_ERR(rval, "Failed to build the property index");
 
-	  rval = MBI->get_entities_by_type(*it, MBTRI, tris);
+  // locating points needs the volume indices
+  PhaseScope grid_phase( profiler, "build_volume_grid" );
+  rval = build_volume_grid();MB_CHK_SET_ERR(rval, "Failed to build the volume grid");
 
-	  RTC->add_triangles(MBI,*vit,tris,sense);
-	}
+  return MB_SUCCESS;
+}
 
-      em_scene_map[*vit] = these_surfs;
-      em_scene_arr[*vit-em_scene_arr_offset] = these_surfs;
-      //now that we've added everything for this volume, commit the scene
-      RTC->commit_scene(*vit);
-  
+
+// frees the MOAB mesh, keeping the sets and what the Embree based queries need
+ErrorCode DagMC::release_mesh( unsigned long long* bytes_reclaimed )
+{
+  if (meshReleased) {
+    if (bytes_reclaimed) *bytes_reclaimed = 0;
+    return MB_SUCCESS;
+  }
+
+  ErrorCode rval;
+  Range surfs, vols;
+  rval = setup_geometry( surfs, vols );
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  // measure everything while the triangles are still there
+  volMeasures.assign( num_entities(3) + 1, 0.0 );
+  areaMeasures.assign( num_entities(2) + 1, 0.0 );
+  for (int i = 1; i < (int)volMeasures.size(); ++i) {
+    rval = measure_volume( entity_by_index(3, i), volMeasures[i] );
+    if (MB_SUCCESS != rval)
+      return rval;
+  }
+  for (int i = 1; i < (int)areaMeasures.size(); ++i) {
+    rval = measure_area( entity_by_index(2, i), areaMeasures[i] );
+    if (MB_SUCCESS != rval)
+      return rval;
+  }
+
+  unsigned long long before = 0, after = 0;
+  MBI->estimated_memory_use( 0, 0, &before );
+
+  // the OBB trees: every node below the roots, shared subtrees once
+  Range tree_sets;
+  for (unsigned i = 0; i < rootSets.size(); ++i) {
+    if (!rootSets[i])
+      continue;
+    if (tree_sets.find( rootSets[i] ) == tree_sets.end()) {
+      tree_sets.insert( rootSets[i] );
+      rval = MBI->get_child_meshsets( rootSets[i], tree_sets, 0 );
+      if (MB_SUCCESS != rval)
+        return rval;
     }
-  std::cout << "done." << std::endl;
+    rootSets[i] = 0;
+  }
+  Range geom_sets = surfs;
+  geom_sets.merge( vols );
+  MBI->tag_delete_data( obbTag, geom_sets );
+  rval = MBI->delete_entities( tree_sets );
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  // then the elements, highest dimension first, and the vertices
+  for (int dim = 3; dim >= 0; --dim) {
+    Range ents;
+    rval = MBI->get_entities_by_dimension( 0, dim, ents );
+    if (MB_SUCCESS != rval)
+      return rval;
+    rval = MBI->delete_entities( ents );
+    if (MB_SUCCESS != rval)
+      return rval;
+  }
 
+  MBI->estimated_memory_use( 0, 0, &after );
+  const unsigned long long reclaimed = before > after ? before - after : 0;
+  if (bytes_reclaimed)
+    *bytes_reclaimed = reclaimed;
+  std::cout << "Released the MOAB mesh: " << reclaimed / (1024.0*1024.0)
+            << " MB reclaimed." << std::endl;
 
-  // setup indices
-  rval = setup_indices();MB_CHK_SET_ERR(rval, "Failed to setup problem indices");
+  meshReleased = true;
+  return MB_SUCCESS;
+}
+
+rtc* DagMC::thread_variant()
+{
+  if (thread_variants.empty())
+    return NULL;
+  std::map<unsigned long, rtc*>::iterator it = thread_variants.find( serialNumber );
+  return it == thread_variants.end() ? NULL : it->second;
+}
+
+bool DagMC::using_numa_replica()
+{
+  rtc* scenes = query_scenes();
+  return scenes != RTC && scenes != thread_variant();
+}
+
+rtc* DagMC::query_scenes()
+{
+  if (rtc* variant = thread_variant())
+    return variant;
+  // only asks for the node when there are copies to choose between
+  if (!numaReplicas.empty()) {
+    int node = numaTopology.current_node();
+    if (node >= 0 && numaReplicas[node])
+      return numaReplicas[node];
+  }
+  return RTC;
+}
+
+ErrorCode DagMC::create_variant( const std::vector<int>& vol_ids, const std::vector<CartVect>& offsets,
+                                 rtc*& variant )
+{
+  variant = NULL;
+  if (meshReleased)
+    return need_mesh( "create_variant" );
+  if (em_scene_arr.empty() || vol_ids.size() != offsets.size())
+    return MB_FAILURE;
+
+  // the surfaces moved with each volume; a surface shared by two moved
+  // volumes must move with both
+  std::map<EntityHandle, CartVect> moved_surfs;
+  std::vector<EntityHandle> moved_vols;
+  for (unsigned i = 0; i < vol_ids.size(); ++i) {
+    EntityHandle vol = entity_by_id( 3, vol_ids[i] );
+    if (0 == vol) {
+      std::cerr << "DagMC: no volume " << vol_ids[i] << " to move." << std::endl;
+      return MB_FAILURE;
+    }
+    moved_vols.push_back( vol );
+    const std::vector<EntityHandle>& surfs = em_scene_arr[vol-em_scene_arr_offset];
+    for (unsigned j = 0; j < surfs.size(); ++j) {
+      std::map<EntityHandle, CartVect>::iterator it = moved_surfs.find( surfs[j] );
+      if (it == moved_surfs.end())
+        moved_surfs[surfs[j]] = offsets[i];
+      else if ((it->second - offsets[i]).length() > 0.0) {
+        std::cerr << "DagMC: surface " << get_entity_id( surfs[j] )
+                  << " is moved by two volumes." << std::endl;
+        return MB_FAILURE;
+      }
+    }
+  }
+
+  variant = RTC->create_variant();
+  if (!variant)
+    return MB_FAILURE;
+
+  // moved volumes become translated instances of the base's scenes, before
+  // any scene they might be instances of is rebuilt
+  for (unsigned i = 0; i < moved_vols.size(); ++i)
+    variant->move_volume( moved_vols[i], offsets[i].array() );
+
+  // the other volumes bounded by a moved surface are rebuilt, with the
+  // moved surfaces' triangles translated; the rest stay shared
+  int num_rebuilt = 0;
+  const std::vector<EntityHandle>& vols = vol_handles();
+  for (unsigned v = 1; v < vols.size(); ++v) {
+    EntityHandle vol = vols[v];
+    if (std::find( moved_vols.begin(), moved_vols.end(), vol ) != moved_vols.end())
+      continue;
+    const std::vector<EntityHandle>& surfs = em_scene_arr[vol-em_scene_arr_offset];
+    bool touched = false;
+    for (unsigned j = 0; j < surfs.size() && !touched; ++j)
+      touched = moved_surfs.count( surfs[j] ) > 0;
+    if (!touched)
+      continue;
+
+    variant->create_scene( vol );
+    for (unsigned j = 0; j < surfs.size(); ++j) {
+      std::map<EntityHandle, CartVect>::iterator it = moved_surfs.find( surfs[j] );
+      std::map<EntityHandle, CartVect>::iterator motion = surfMotions.find( surfs[j] );
+      variant->add_triangles( MBI, vol, em_scene_tris[vol-em_scene_arr_offset][j],
+                              em_scene_senses[vol-em_scene_arr_offset][j],
+                              it == moved_surfs.end() ? NULL : it->second.array(),
+                              motion == surfMotions.end() ? NULL : motion->second.array() );
+    }
+    variant->commit_scene( vol );
+    num_rebuilt++;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock( variantMutex );
+    variantUsers[variant] = 0;
+  }
+
+  std::cout << "Created a variant: " << moved_vols.size() << " volumes moved, "
+            << num_rebuilt << " rebuilt, the rest shared with the base." << std::endl;
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::use_variant( rtc* variant )
+{
+  std::lock_guard<std::mutex> lock( variantMutex );
+  if (variant && !variantUsers.count( variant )) {
+    std::cerr << "DagMC: the variant was not created by this DagMC or was deleted." << std::endl;
+    return MB_FAILURE;
+  }
+
+  rtc* current = thread_variant();
+  if (current)
+    variantUsers[current]--;
+  if (variant) {
+    variantUsers[variant]++;
+    thread_variants[serialNumber] = variant;
+  }
+  else
+    thread_variants.erase( serialNumber );
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::delete_variant( rtc* variant )
+{
+  std::lock_guard<std::mutex> lock( variantMutex );
+  std::map<rtc*, int>::iterator it = variantUsers.find( variant );
+  if (it == variantUsers.end()) {
+    std::cerr << "DagMC: the variant was not created by this DagMC or was deleted." << std::endl;
+    return MB_FAILURE;
+  }
+  if (it->second > 0) {
+    std::cerr << "DagMC: the variant is still used by " << it->second << " threads." << std::endl;
+    return MB_FAILURE;
+  }
+  variantUsers.erase( it );
+  delete variant;
+  return MB_SUCCESS;
+}
 
+// MOAB is not safe to read from the builder threads at once; the copies
+// still commit their scenes in parallel
+static std::mutex replica_mesh_mutex;
+
+void DagMC::build_replica( int node, rtc** replica )
+{
+  if (!numaTopology.pin_thread( node ))
+    std::cerr << "DagMC: failed to pin the builder of NUMA node " << node
+              << ", its copy may not be local." << std::endl;
+
+  rtc* copy = RTC->create_replica();
+  if (!copy)
+    return;
+  const std::vector<EntityHandle>& vols = vol_handles();
+  for (unsigned v = 1; v < vols.size(); ++v) {
+    EntityHandle vol = vols[v];
+    int index = vol - em_scene_arr_offset;
+    // instances are made once their prototypes are committed
+    if (em_prototypes[index])
+      continue;
+
+    copy->create_scene( vol );
+    {
+      std::lock_guard<std::mutex> lock( replica_mesh_mutex );
+      const std::vector<EntityHandle>& surfs = em_scene_arr[index];
+      for (unsigned j = 0; j < surfs.size(); ++j) {
+        std::map<EntityHandle, CartVect>::iterator motion = surfMotions.find( surfs[j] );
+        copy->add_triangles( MBI, vol, em_scene_tris[index][j], em_scene_senses[index][j], NULL,
+                             motion == surfMotions.end() ? NULL : motion->second.array() );
+      }
+    }
+    copy->commit_scene( vol );
+  }
+  copy->build_instances();
+  *replica = copy;
+}
+
+ErrorCode DagMC::set_numa_replication( bool enable, bool force )
+{
+  for (unsigned i = 0; i < numaReplicas.size(); ++i)
+    delete numaReplicas[i];
+  numaReplicas.clear();
+  if (!enable)
+    return MB_SUCCESS;
+
+  if (meshReleased)
+    return need_mesh( "set_numa_replication" );
+  if (em_scene_arr.empty())
+    return MB_FAILURE;
+
+  int num_nodes = numaTopology.num_nodes();
+  if (num_nodes < 2 && !force) {
+    std::cout << "One NUMA node, the scenes are not copied." << std::endl;
+    return MB_SUCCESS;
+  }
+
+  std::vector<rtc*> replicas( num_nodes, (rtc*)NULL );
+  std::vector<std::thread> builders;
+  for (int node = 0; node < num_nodes; ++node)
+    builders.push_back( std::thread( &DagMC::build_replica, this, node, &replicas[node] ) );
+  for (unsigned i = 0; i < builders.size(); ++i)
+    builders[i].join();
+
+  for (int node = 0; node < num_nodes; ++node)
+    if (!replicas[node]) {
+      for (unsigned i = 0; i < replicas.size(); ++i)
+        delete replicas[i];
+      return MB_FAILURE;
+    }
+
+  numaReplicas.swap( replicas );
+  std::cout << "Copied the scenes to " << num_nodes << " NUMA nodes." << std::endl;
   return MB_SUCCESS;
 }
 
+ErrorCode DagMC::need_mesh( const char* query )
+{
+  std::cerr << "DagMC: " << query << " needs the mesh freed by release_mesh." << std::endl;
+  return MB_FAILURE;
+}
 
 /* SECTION I (private) */
 
@@ -648,9 +1333,200 @@ ErrorCode DagMC::build_obb_impl_compl(Range &surfs)
 
 }
 
+// guards the lazy build of the global scene by ray_intersections
+static std::mutex global_scene_mutex;
+
+ErrorCode DagMC::build_global_scene()
+{
+  if (meshReleased)
+    return need_mesh( "ray_intersections on the global scene" );
+
+  ErrorCode rval;
+  Range surfs, vols;
+  rval = setup_geometry(surfs, vols);
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  RTC->create_global_scene();
+  em_global_surfs.clear();
+  for (Range::iterator i = surfs.begin(); i != surfs.end(); ++i) {
+    Range tris;
+    rval = MBI->get_entities_by_type( *i, MBTRI, tris );
+    if (MB_SUCCESS != rval)
+      return rval;
+    RTC->add_global_triangles( MBI, tris );
+    em_global_surfs.push_back( *i );
+  }
+  RTC->commit_global_scene();
+
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::build_surface_senses()
+{
+  ErrorCode rval;
+  Range surfs;
+  const int two = 2;
+  const void* const dim_two = &two;
+  em_surf_vols.clear();
+  rval = MBI->get_entities_by_type_and_tag( 0, MBENTITYSET, &geomTag, &dim_two, 1, surfs );
+  if (MB_SUCCESS != rval)
+    return rval;
+  if (surfs.empty())
+    return MB_SUCCESS;
+
+  // one bulk read of the sense tag, after which surface_sense makes no MOAB calls.
+  // If some surface has no senses, surface_sense keeps reading the tag.
+  std::vector<EntityHandle> tag_vols( 2*surfs.size() );
+  rval = MBI->tag_get_data( sense_tag(), surfs, &tag_vols[0] );
+  if (MB_TAG_NOT_FOUND == rval)
+    return MB_SUCCESS;
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  std::vector<EntityHandle> surf_vols( 2*(surfs.back()-surfs.front()+1), 0 );
+  em_surf_offset = surfs.front();
+  std::vector<EntityHandle>::const_iterator j = tag_vols.begin();
+  for (Range::iterator i = surfs.begin(); i != surfs.end(); ++i) {
+    surf_vols[2*(*i-em_surf_offset)]   = *j; ++j;
+    surf_vols[2*(*i-em_surf_offset)+1] = *j; ++j;
+  }
+  em_surf_vols.swap( surf_vols );
+
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::build_facet_normals()
+{
+  ErrorCode rval;
+  Range tris;
+  em_tri_normals.clear();
+  rval = MBI->get_entities_by_type( 0, MBTRI, tris );
+  if (MB_SUCCESS != rval)
+    return rval;
+  if (tris.empty())
+    return MB_SUCCESS;
+
+  em_tri_offset = tris.front();
+  em_tri_normals.resize( 3*(tris.back()-em_tri_offset+1), 0.0f );
+
+  CartVect coords[3], normal;
+  const EntityHandle *conn;
+  int len;
+  for (Range::iterator i = tris.begin(); i != tris.end(); ++i) {
+    rval = MBI->get_connectivity( *i, conn, len );
+    if (MB_SUCCESS != rval)
+      return rval;
+    rval = MBI->get_coords( conn, 3, coords[0].array() );
+    if (MB_SUCCESS != rval)
+      return rval;
+
+    coords[1] -= coords[0];
+    coords[2] -= coords[0];
+    normal = coords[1] * coords[2];
+    normal.normalize();
+
+    float *n = &em_tri_normals[3*(*i-em_tri_offset)];
+    n[0] = float(normal[0]);
+    n[1] = float(normal[1]);
+    n[2] = float(normal[2]);
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::scene_coords( const std::vector<Range>& tris, std::vector<double>& coords )
+{
+  if (meshReleased)
+    return need_mesh( "reading triangle coordinates" );
+
+  ErrorCode rval;
+  std::vector<EntityHandle> conn;
+  for (unsigned i = 0; i < tris.size(); ++i) {
+    if (tris[i].empty())
+      continue;
+    std::vector<EntityHandle> handles( tris[i].begin(), tris[i].end() ), surf_conn;
+    rval = MBI->get_connectivity( &handles[0], handles.size(), surf_conn );
+    if (MB_SUCCESS != rval)
+      return rval;
+    conn.insert( conn.end(), surf_conn.begin(), surf_conn.end() );
+  }
+
+  coords.resize( 3*conn.size() );
+  if (conn.empty())
+    return MB_SUCCESS;
+  return MBI->get_coords( &conn[0], conn.size(), &coords[0] );
+}
+
+// the summed edge lengths of the triangles of a list of coordinates, which a
+// translation keeps
+static double coords_edge_sum( const std::vector<double>& coords )
+{
+  double sum = 0.0;
+  for (unsigned t = 0; t+9 <= coords.size(); t += 9)
+    for (int e = 0; e < 3; ++e) {
+      const double* a = &coords[t+3*e];
+      const double* b = &coords[t+3*((e+1)%3)];
+      sum += sqrt( (a[0]-b[0])*(a[0]-b[0]) + (a[1]-b[1])*(a[1]-b[1]) + (a[2]-b[2])*(a[2]-b[2]) );
+    }
+  return sum;
+}
+
+ErrorCode DagMC::find_prototype( EntityHandle vol, const std::vector<Range>& tris, const std::vector<int>& senses,
+                                 PrototypeIndex& prototypes, EntityHandle& prototype, double offset[3] )
+{
+  ErrorCode rval;
+  prototype = 0;
+
+  // surfaces, senses and triangle counts must agree before any coordinates
+  // are compared
+  std::vector<int> key;
+  key.push_back( tris.size() );
+  for (unsigned i = 0; i < tris.size(); ++i) {
+    key.push_back( tris[i].size() );
+    key.push_back( senses[i] );
+  }
+
+  std::vector<double> coords, proto;
+  rval = scene_coords( tris, coords );
+  if (MB_SUCCESS != rval)
+    return rval;
+  if (coords.empty())
+    return MB_SUCCESS;
+  double edge_sum = coords_edge_sum( coords );
+
+  // each edge of a copy is within 2*sqrt(3)*instance_tol of the prototype's
+  std::multimap<double, EntityHandle>& candidates = prototypes[key];
+  double edge_tol = 4*instance_tol*coords.size()/3;
+  std::multimap<double, EntityHandle>::iterator c = candidates.lower_bound( edge_sum - edge_tol );
+  std::multimap<double, EntityHandle>::iterator c_end = candidates.upper_bound( edge_sum + edge_tol );
+  for (; c != c_end; ++c) {
+    rval = scene_coords( em_scene_tris[c->second-em_scene_arr_offset], proto );
+    if (MB_SUCCESS != rval)
+      return rval;
+
+    // every vertex must be the prototype's, moved by the same translation
+    double trans[3] = { coords[0]-proto[0], coords[1]-proto[1], coords[2]-proto[2] };
+    bool match = true;
+    for (unsigned i = 0; i < coords.size() && match; ++i)
+      match = fabs( coords[i] - proto[i] - trans[i%3] ) <= instance_tol;
+    if (match) {
+      prototype = c->second;
+      std::copy( trans, trans+3, offset );
+      return MB_SUCCESS;
+    }
+  }
+
+  // later copies of this volume are instances of it
+  candidates.insert( std::make_pair( edge_sum, vol ) );
+  return MB_SUCCESS;
+}
+
   /* SECTION II: Fundamental Geometry Operations/Queries */
 void DagMC::RayHistory::reset() {
   prev_facets.clear();
+  prev_prims.clear();
+  last_geom = -1;
 }
 
 void DagMC::RayHistory::reset_to_last_intersection() {
@@ -658,13 +1534,82 @@ void DagMC::RayHistory::reset_to_last_intersection() {
   if( prev_facets.size() > 1 ){
     prev_facets[0] = prev_facets.back();
     prev_facets.resize( 1 );
+    prev_prims[0] = prev_prims.back();
+    prev_prims.resize( 1 );
   }
 
 }
 
 void DagMC::RayHistory::rollback_last_intersection() {
-  if( prev_facets.size() )
+  if( prev_facets.size() ) {
     prev_facets.pop_back();
+    prev_prims.pop_back();
+  }
+  last_geom = -1;
+}
+
+// number of queries open on this thread; point_in_volume calls made inside
+// ray_fire_overlap or find_volume are replayed by their caller, so only the
+// outermost query is recorded
+static thread_local int capture_depth = 0;
+
+// marks a query that is not itself recorded but whose inner queries must not
+// be recorded either
+struct CaptureNesting {
+  CaptureNesting() { ++capture_depth; }
+  ~CaptureNesting() { --capture_depth; }
+};
+
+// records a query to the capture file, if one is open, when it goes out of
+// scope; the results are read through references so that every return path
+// of the query is recorded
+struct CaptureScope {
+  QueryRecord rec;
+  bool on;
+  const EntityHandle *surf;
+  const double *dist;
+  const int *result;
+
+  CaptureScope( QueryType type, EntityHandle vol, const double point[3], const double *dir,
+                double dist_limit, int orientation, const EntityHandle *surf_in,
+                const double *dist_in, const int *result_in )
+    : on( 0 == capture_depth && QueryCapture::active() ),
+      surf(surf_in), dist(dist_in), result(result_in) {
+    ++capture_depth;
+    if ( !on )
+      return;
+    memset( &rec, 0, sizeof(rec) );
+    rec.type = type;
+    rec.orientation = orientation;
+    rec.volume = vol;
+    std::copy( point, point+3, rec.point );
+    if ( dir )
+      std::copy( dir, dir+3, rec.dir );
+    rec.dist_limit = dist_limit;
+  }
+
+  ~CaptureScope() {
+    --capture_depth;
+    if ( !on )
+      return;
+    if ( surf ) rec.surf = *surf;
+    if ( dist ) rec.dist = *dist;
+    if ( result ) rec.result = *result;
+    QueryCapture::record( rec );
+  }
+};
+
+ErrorCode DagMC::start_capture(const char* filename) {
+  if ( !QueryCapture::start( filename ) ) {
+    std::cerr << "Could not open query capture file " << filename << std::endl;
+    return MB_FILE_DOES_NOT_EXIST;
+  }
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::stop_capture() {
+  QueryCapture::stop();
+  return MB_SUCCESS;
 }
 
 ErrorCode DagMC::ray_fire(const EntityHandle vol,
@@ -672,16 +1617,30 @@ ErrorCode DagMC::ray_fire(const EntityHandle vol,
                           EntityHandle& next_surf, double& next_surf_dist,
                           RayHistory* history, double user_dist_limit,
 			  int ray_orientation,
-                          OrientedBoxTreeTool::TrvStats* stats  ) {
+                          OrientedBoxTreeTool::TrvStats* stats,
+                          double time ) {
+
+  CaptureScope capture( QUERY_RAY_FIRE, vol, point, dir, user_dist_limit, ray_orientation,
+                        &next_surf, &next_surf_dist, NULL );
+
+  if ( 0 < overlapThickness )
+    return ray_fire_overlap( vol, point, dir, next_surf, next_surf_dist, history,
+                             user_dist_limit, ray_orientation, time );
 
   float pos[3], direction[3], tri_norm[3], tnear;
   std::copy( point, point + 3, pos);
   std::copy( dir, dir + 3, direction);
 
+  // the distance limit (e.g. the distance to the next collision) is handed
+  // to Embree as the far end of the ray so that the traversal stops there
+  // instead of searching for a surface the particle will never reach
+  float tfar = ( user_dist_limit > 0 ) ? float(user_dist_limit) : 1.0e38f;
+
   tnear = 0.0f;
-  int em_geom_id;
-  float distance_to_hit;
-  RTC->ray_fire( vol, pos, direction, rtc::rf_type::RF, tnear, em_geom_id, distance_to_hit, tri_norm);
+  int em_geom_id, em_prim_id;
+  float distance_to_hit, bary[2];
+  const float ray_time = embree_time( time );
+  query_scenes()->ray_fire( vol, pos, direction, rtc::rf_type::RF, tnear, em_geom_id, distance_to_hit, tri_norm, tfar, ray_orientation, &em_prim_id, bary, ray_time);
     
   // std::cout << RTC->all_vertices[0].x << " " << RTC->all_vertices[0].y << " " << RTC->all_vertices[0].z << std::endl;
   // std::cout << RTC->all_vertices[RTC->vertex_buffer_size-1].x << " " << RTC->all_vertices[RTC->vertex_buffer_size-1].y << " " << RTC->all_vertices[RTC->vertex_buffer_size-1].z << std::endl;
@@ -690,7 +1649,7 @@ ErrorCode DagMC::ray_fire(const EntityHandle vol,
   next_surf_dist = double(distance_to_hit);
 
   //if we're "on" a surface, we need to check if we're going against or with the tri norm
-  if ( faceting_tolerance() >= fabs(next_surf_dist) )
+  if ( 0 != next_surf && faceting_tolerance() >= fabs(next_surf_dist) )
     {
 
       //      std::cout << "Got here" << std::endl;
@@ -703,15 +1662,25 @@ ErrorCode DagMC::ray_fire(const EntityHandle vol,
 
       double dot_prod = dir % normal;
 
-      //if we're going against the normal, set tnear to a small value to avoid the hit
-      if (dot_prod < 0 )
-	RTC->ray_fire( vol, pos, direction, rtc::rf_type::RF, 1e-05f, em_geom_id, distance_to_hit, tri_norm);
+      //if we're going against the requested orientation, set tnear to a small value to avoid the hit
+      if ( ray_orientation*dot_prod < 0 )
+	query_scenes()->ray_fire( vol, pos, direction, rtc::rf_type::RF, 1e-05f, em_geom_id, distance_to_hit, tri_norm, tfar, ray_orientation, &em_prim_id, bary, ray_time);
 
       next_surf = (-1 == em_geom_id) ? 0 : em_scene_arr[vol-em_scene_arr_offset][em_geom_id];
       next_surf_dist = double(distance_to_hit);
 
     }
 
+  // distinguish "no surface within the distance limit" from a lost ray
+  if ( 0 == next_surf )
+    next_surf_dist = ( user_dist_limit > 0 ) ? user_dist_limit : std::numeric_limits<double>::max();
+  else if ( history )
+    {
+      const double normal[3] = { tri_norm[0], tri_norm[1], tri_norm[2] };
+      const double uv[2] = { bary[0], bary[1] };
+      record_hit( *history, vol, em_geom_id, em_prim_id, normal, uv );
+    }
+
   //  std::cout << "Next surf hit: " << next_surf << std::endl;
   
   /*
@@ -720,150 +1689,176 @@ ErrorCode DagMC::ray_fire(const EntityHandle vol,
      normal[2] = double(tri_norm[2]);
   */
 
-  /*
-  // take some stats that are independent of nps
-  if(counting) {
-    ++n_ray_fire_calls;
-    if(0==n_ray_fire_calls%10000000) {
-      std::cout << "n_ray_fires="   << n_ray_fire_calls
-                << " n_pt_in_vols=" << n_pt_in_vol_calls << std::endl;
+  return MB_SUCCESS;
+}
+
+// a ray of a batch, ordered for coherent packets
+struct BatchRay {
+  EntityHandle vol;
+  int octant;
+  unsigned long long code;
+  unsigned index;
+  bool operator<( const BatchRay& other ) const {
+    if (vol != other.vol) return vol < other.vol;
+    if (octant != other.octant) return octant < other.octant;
+    return code < other.code;
+  }
+};
+
+ErrorCode DagMC::ray_fire_batch(unsigned num_rays, const EntityHandle* volumes,
+                                const double* ray_starts, const double* ray_dirs,
+                                EntityHandle* next_surfs, double* next_surf_dists,
+                                double dist_limit, int ray_orientation,
+                                double* utilization, const double* times ) {
+  ErrorCode rval;
+  if (utilization)
+    *utilization = 0.0;
+
+  if (!query_scenes()->packets || 0 < overlapThickness) {
+    for (unsigned i = 0; i < num_rays; ++i) {
+      rval = ray_fire( volumes[i], ray_starts+3*i, ray_dirs+3*i, next_surfs[i], next_surf_dists[i],
+                       NULL, dist_limit, ray_orientation, NULL, times ? times[i] : 0.0 );
+      if (MB_SUCCESS != rval)
+        return rval;
     }
+    return MB_SUCCESS;
   }
+  if (0 == num_rays)
+    return MB_SUCCESS;
 
-  if (debug) {
-    std::cout << "ray_fire:"
-              << " xyz=" << point[0] << " " << point[1] << " " << point[2]
-              << " uvw=" << dir[0] << " " << dir[1] << " " << dir[2]
-              << " vol_id=" << id_by_index(3, index_by_handle(vol)) << std::endl;
+  // bin the rays by volume, then direction octant, then along a Morton curve
+  // through the bounding box of their origins
+  float lo[3], hi[3], size[3];
+  for (unsigned j = 0; j < 3; ++j)
+    lo[j] = hi[j] = float(ray_starts[j]);
+  for (unsigned i = 1; i < num_rays; ++i)
+    for (unsigned j = 0; j < 3; ++j) {
+      lo[j] = std::min( lo[j], float(ray_starts[3*i+j]) );
+      hi[j] = std::max( hi[j], float(ray_starts[3*i+j]) );
+    }
+  for (unsigned j = 0; j < 3; ++j)
+    size[j] = hi[j] - lo[j];
+
+  std::vector<BatchRay> order( num_rays );
+  for (unsigned i = 0; i < num_rays; ++i) {
+    const float pt[3] = { float(ray_starts[3*i]), float(ray_starts[3*i+1]), float(ray_starts[3*i+2]) };
+    order[i].vol = volumes[i];
+    order[i].octant = (ray_dirs[3*i] < 0) | (ray_dirs[3*i+1] < 0) << 1 | (ray_dirs[3*i+2] < 0) << 2;
+    order[i].code = morton_code( pt, lo, size );
+    order[i].index = i;
+  }
+  std::sort( order.begin(), order.end() );
+
+  const float tfar = ( dist_limit > 0 ) ? float(dist_limit) : 1.0e38f;
+  unsigned num_packets = 0, num_lanes = 0;
+  for (unsigned i = 0; i < num_rays; ) {
+    // a packet holds up to 8 rays of one volume and octant
+    const EntityHandle vol = order[i].vol;
+    const int octant = order[i].octant;
+    int valid[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    float org[8][3], dir[8][3], tfars[8], lane_times[8];
+    unsigned index[8], n = 0;
+    for (; i < num_rays && n < 8 && order[i].vol == vol && order[i].octant == octant; ++i, ++n) {
+      index[n] = order[i].index;
+      for (unsigned j = 0; j < 3; ++j) {
+        org[n][j] = float(ray_starts[3*index[n]+j]);
+        dir[n][j] = float(ray_dirs[3*index[n]+j]);
+      }
+      tfars[n] = tfar;
+      lane_times[n] = embree_time( times ? times[index[n]] : 0.0 );
+      valid[n] = 1;
+    }
+
+    int surfs[8];
+    float dists[8];
+    query_scenes()->ray_fire8( vol, valid, org, dir, 0.0f, tfars, ray_orientation, surfs, dists, lane_times );
+    num_packets++;
+    num_lanes += n;
+
+    for (unsigned k = 0; k < n; ++k) {
+      const unsigned r = index[k];
+      // hits at the origin need ray_fire's orientation check
+      if (-1 != surfs[k] && faceting_tolerance() >= fabs(dists[k])) {
+        rval = ray_fire( vol, ray_starts+3*r, ray_dirs+3*r, next_surfs[r], next_surf_dists[r],
+                         NULL, dist_limit, ray_orientation, NULL, times ? times[r] : 0.0 );
+        if (MB_SUCCESS != rval)
+          return rval;
+        continue;
+      }
+      CaptureScope capture( QUERY_RAY_FIRE, vol, ray_starts+3*r, ray_dirs+3*r, dist_limit,
+                            ray_orientation, &next_surfs[r], &next_surf_dists[r], NULL );
+      if (-1 == surfs[k]) {
+        // as ray_fire reports a ray that found no surface within the limit
+        next_surfs[r] = 0;
+        next_surf_dists[r] = ( dist_limit > 0 ) ? dist_limit : std::numeric_limits<double>::max();
+        continue;
+      }
+      next_surfs[r] = em_scene_arr[vol-em_scene_arr_offset][surfs[k]];
+      next_surf_dists[r] = double(dists[k]);
     }
+  }
 
-  const double huge_val = std::numeric_limits<double>::max();
-  double dist_limit = huge_val;
-  if( user_dist_limit > 0 )
-    dist_limit = user_dist_limit;
+  if (utilization)
+    *utilization = double(num_lanes) / (8.0*num_packets);
 
-  // don't recreate these every call
-  std::vector<double>       &dists       = distList;
-  std::vector<EntityHandle> &hit_surfs       = surfList;
-  std::vector<EntityHandle> &facets      = facetList;
-  dists.clear();
-  hit_surfs.clear();
-  facets.clear();
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::ray_fire_overlap(const EntityHandle vol,
+                                  const double point[3], const double dir[3],
+                                  EntityHandle& next_surf, double& next_surf_dist,
+                                  RayHistory* history, double user_dist_limit,
+                                  int ray_orientation, double time) {
 
-  assert(vol - setOffset < rootSets.size());
-  const EntityHandle root = rootSets[vol - setOffset];
   ErrorCode rval;
 
-  // check behind the ray origin for intersections
-  double neg_ray_len;
-  if(0 == overlapThickness) {
-    neg_ray_len = -numericalPrecision;
-  } else {
-    neg_ray_len = -overlapThickness;
-  }
+  // check behind the ray origin for intersections, as far as the overlap thickness
+  const double neg_ray_len = overlapThickness;
 
   // optionally, limit the nonneg_ray_len with the distance to next collision.
-  double nonneg_ray_len = dist_limit;
-
-  // the nonneg_ray_len should not be less than -neg_ray_len, or an overlap
-  // may be missed due to optimization within ray_intersect_sets
-  if(nonneg_ray_len < -neg_ray_len) nonneg_ray_len = -neg_ray_len;
-  assert(0 <= nonneg_ray_len);
-  assert(0 >     neg_ray_len);
-
-  // min_tolerance_intersections is passed but not used in this call
-  const int min_tolerance_intersections = 0;
-
-  // numericalPrecision is used for box.intersect_ray and find triangles in the
-  // neighborhood of edge/node intersections.
-  //  rval = obbTree.ray_intersect_sets( dists, hit_surfs, facets,
-  //                                     root, numericalPrecision,
-  //                                     min_tolerance_intersections,
-  //                                     point, dir, &nonneg_ray_len,
-  //                                     stats, &neg_ray_len, &vol, &senseTag,
-  //                                     &ray_orientation,
-  //                                     history ? &(history->prev_facets) : NULL );
-  //  assert( MB_SUCCESS == rval );
-  //  if(MB_SUCCESS != rval) return rval;
-  // rm History for now
-  history = NULL;
-  std::vector<std::array<double, 3> > tri_norms;
-  std::vector<int> em_surfs;
-  RTC->psuedo_ris( vol, dists, em_surfs, tri_norms,point, dir, nonneg_ray_len, neg_ray_len);
-
-  //convert embree surfaces to the MOAB EntityHandles
-  hit_surfs.clear();
-  hit_surfs.resize(em_surfs.size());
-  unsigned int i = 0;
-  std::vector<int>::iterator it; 
-  for ( it = em_surfs.begin(); it != em_surfs.end(); it++)
-    hit_surfs[i++] = (*it == -1 ) ? 0 : em_scene_map[vol][*it];
-    
-
-  // if useCAD is true at this point, then we know we can call CGM's ray casting function.
-  if (useCAD) {
-    rval = CAD_ray_intersect( point, dir, huge_val, dists, hit_surfs, nonneg_ray_len );
-    if (MB_SUCCESS != rval) return rval;
-  }
+  const double nonneg_ray_len = ( user_dist_limit > 0 ) ? user_dist_limit : 1.0e38;
 
-  // If no distances are returned, the particle is lost unless the physics limit
-  // is being used. If the physics limit is being used, there is no way to tell
-  // if the particle is lost. To avoid ambiguity, DO NOT use the distance limit
-  // unless you know lost particles do not occur.
-  if( dists.empty() ) {
-    next_surf = 0;
-    if(debug) {
-      std::cout << "          next_surf=0 dist=(undef)" << std::endl;
-    }
-    return MB_SUCCESS;
-  }
+  // facets crossed earlier along this ray are not hit again
+  static thread_local std::vector<unsigned> skip;
+  skip.clear();
+  if( history )
+    history_prims( vol, *history, skip );
 
-  // Assume that a (neg, nonneg) pair of RTIs could be returned,
-  // however, only one or the other may exist. dists[] may be populated, but
-  // intersections are ONLY indicated by nonzero hit_surfs[] and facets[].
-  assert(2 == dists.size());
-  assert(2 == hit_surfs.size());
-  assert(0.0 >= dists[0]);
-  assert(0.0 <= dists[1]);
+  // the nearest exits behind and ahead of the origin, found in one traversal
+  RISHits hits;
+  query_scenes()->psuedo_ris( vol, hits, point, dir, nonneg_ray_len, neg_ray_len, ray_orientation,
+                   skip.empty() ? NULL : &skip[0], skip.size()/2, numericalPrecision,
+                   embree_time( time ) );
 
-  // If both negative and nonnegative RTIs are returned, the negative RTI must
-  // closer to the origin.
-  if(0!=hit_surfs[0] && 0!=hit_surfs[1]) {
-    assert(-dists[0] <= dists[1]);
-  }
+  const std::vector<EntityHandle> &geom_surfs = em_scene_arr[vol-em_scene_arr_offset];
+  EntityHandle hit_surfs[2];
+  for( int i = 0; i < 2; ++i )
+    hit_surfs[i] = ( -1 == hits.surfs[i] ) ? 0 : geom_surfs[hits.surfs[i]];
 
   // If an RTI is found at negative distance, perform a PMT to see if the
-  // particle is inside an overlap.
+  // particle is inside an overlap. The list of previous facets is what tells
+  // a particle sitting on the surface it just crossed apart from one inside an
+  // overlap, so the test is only made when a history is given.
   int exit_idx = -1;
-  if(0!=hit_surfs[0] && history) {
-    // get the next volume
-    std::vector<EntityHandle> vols;
+  if( 0 != hit_surfs[0] && history ) {
     EntityHandle nx_vol;
-    rval = MBI->get_parent_meshsets( hit_surfs[0], vols );
+    rval = next_vol( hit_surfs[0], vol, nx_vol );
     if(MB_SUCCESS != rval) return rval;
-    assert(2 == vols.size());
-    if(vols.front() == vol) {
-      nx_vol = vols.back();
-    } else {
-      nx_vol = vols.front();
-    }
-    // Check to see if the point is actually in the next volume.
-    // The list of previous facets is used to topologically identify the
-    // "on_boundary" result of the PMT. This avoids a test that uses proximity
-    // (a tolerance).
+
     int result;
-    rval = point_in_volume( nx_vol, point, result, dir, history );
+    rval = point_in_volume( nx_vol, point, result, dir, history, time );
     if(MB_SUCCESS != rval) return rval;
     if(1==result) exit_idx = 0;
-
   }
 
   // if the negative distance is not the exit, try the nonnegative distance
   if(-1==exit_idx && 0!=hit_surfs[1]) exit_idx = 1;
 
-  // if the exit index is still unknown, the particle is lost
+  // if the exit index is still unknown, no surface lies within the distance
+  // limit or the particle is lost
   if(-1 == exit_idx) {
     next_surf = 0;
+    next_surf_dist = ( user_dist_limit > 0 ) ? user_dist_limit : std::numeric_limits<double>::max();
     if (debug) {
       std::cout << "next surf hit = 0, dist = (undef)" << std::endl;
     }
@@ -872,25 +1867,102 @@ ErrorCode DagMC::ray_fire(const EntityHandle vol,
 
   // return the intersection
   next_surf = hit_surfs[exit_idx];
-  next_surf_dist = ( 0>dists[exit_idx] ? 0 : dists[exit_idx]);
+  next_surf_dist = ( 0 > hits.distances[exit_idx] ) ? 0 : hits.distances[exit_idx];
 
-  if( history ){
-    history->prev_facets.push_back( facets[exit_idx] );
-  }
+  if( history )
+    record_hit( *history, vol, hits.surfs[exit_idx], hits.prims[exit_idx],
+                hits.tri_norms[exit_idx], hits.uvs[exit_idx] );
 
   if (debug) {
-    if( 0 > dists[exit_idx] ){
-      std::cout << "          OVERLAP track length=" << dists[exit_idx] << std::endl;
+    if( 0 > hits.distances[exit_idx] ){
+      std::cout << "          OVERLAP track length=" << hits.distances[exit_idx] << std::endl;
     }
     std::cout << "          next_surf = " <<  id_by_index(2, index_by_handle(next_surf))
-              << ", dist = " << next_surf_dist << " new_pt=";
-    for( int i = 0; i < 3; ++i ){
-      std::cout << point[i]+dir[i]*next_surf_dist << " ";
+              << ", dist = " << next_surf_dist << std::endl;
+  }
+
+  return MB_SUCCESS;
+}
+
+void DagMC::record_hit(RayHistory& history, const EntityHandle vol, int geom, int prim,
+                       const double normal[3], const double uv[2])
+{
+  history.prev_facets.push_back( em_scene_tris[vol-em_scene_arr_offset][geom][prim] );
+  history.prev_prims.push_back( std::make_pair( em_scene_arr[vol-em_scene_arr_offset][geom], prim ) );
+
+  // Embree's normal points out of the volume, flip it into the surface's sense
+  CartVect norm( normal );
+  norm.normalize();
+  norm *= em_scene_senses[vol-em_scene_arr_offset][geom];
+
+  history.last_vol = vol;
+  history.last_geom = geom;
+  history.last_prim = prim;
+  norm.get( history.last_normal );
+  history.last_on_edge = ( edge_tol > uv[0] || edge_tol > uv[1] ||
+                           edge_tol > 1.0 - uv[0] - uv[1] );
+}
+
+void DagMC::history_prims(const EntityHandle vol, const RayHistory& history,
+                          std::vector<unsigned>& prims)
+{
+  // a facet keeps its position within its surface in every volume's scene
+  const std::map<EntityHandle,int> &geoms = em_scene_geoms[vol-em_scene_arr_offset];
+  std::vector< std::pair<EntityHandle,int> >::const_iterator it;
+  for( it = history.prev_prims.begin(); it != history.prev_prims.end(); ++it ) {
+    std::map<EntityHandle,int>::const_iterator geom = geoms.find( it->first );
+    if( geom != geoms.end() ) {
+      prims.push_back( geom->second );
+      prims.push_back( it->second );
+    }
+  }
+}
+
+ErrorCode DagMC::ray_intersections(const EntityHandle vol,
+                                   const double point[3], const double dir[3],
+                                   std::vector<double>& dists, std::vector<EntityHandle>& surfs,
+                                   double user_dist_limit, int ray_orientation)
+{
+  // hit buffer reused between calls, one per thread
+  static thread_local std::vector<RayHit> hits(64);
+
+  if (0 == vol && thread_variant()) {
+    std::cerr << "DagMC: a variant has no scene of every surface for ray_intersections." << std::endl;
+    return MB_FAILURE;
+  }
+  if (0 == vol && !RTC->have_global_scene()) {
+    // the first thread to get here builds it, the others wait for it
+    std::lock_guard<std::mutex> lock( global_scene_mutex );
+    if (!RTC->have_global_scene()) {
+      ErrorCode rval = build_global_scene();
+      if (MB_SUCCESS != rval) return rval;
     }
-    std::cout << std::endl;
   }
 
-  */
+  float pos[3], direction[3];
+  std::copy( point, point + 3, pos);
+  std::copy( dir, dir + 3, direction);
+  float tfar = ( user_dist_limit > 0 ) ? float(user_dist_limit) : 1.0e38f;
+
+  // the scene of every surface has a single copy
+  rtc* scenes = (0 == vol) ? RTC : query_scenes();
+  unsigned num_hits = scenes->get_all_intersections( vol, pos, direction, &hits[0], hits.size(),
+                                                     0.0f, tfar, ray_orientation );
+  // the buffer was too small to hold every hit, grow it and fire again
+  if (num_hits > hits.size()) {
+    hits.resize( num_hits );
+    num_hits = scenes->get_all_intersections( vol, pos, direction, &hits[0], hits.size(),
+                                              0.0f, tfar, ray_orientation );
+  }
+
+  const std::vector<EntityHandle> &geom_surfs = (0 == vol) ? em_global_surfs
+                                                          : em_scene_arr[vol-em_scene_arr_offset];
+  dists.resize( num_hits );
+  surfs.resize( num_hits );
+  for (unsigned i = 0; i < num_hits; ++i) {
+    dists[i] = double(hits[i].dist);
+    surfs[i] = geom_surfs[hits[i].surf];
+  }
 
   return MB_SUCCESS;
 }
@@ -899,7 +1971,10 @@ ErrorCode DagMC::point_in_volume(const EntityHandle volume,
                                  const double xyz[3],
                                  int& result,
                                  const double *uvw,
-                                 const RayHistory *history) {
+                                 const RayHistory *history,
+                                 double time) {
+
+  CaptureScope capture( QUERY_POINT_IN_VOLUME, volume, xyz, uvw, 0, 0, NULL, NULL, &result );
 
    // if uvw is not given or is full of zeros, use a random direction
   double u = 0, v = 0, w = 0;
@@ -911,10 +1986,12 @@ ErrorCode DagMC::point_in_volume(const EntityHandle volume,
 
   if( u == 0 && v == 0 && w == 0 )
   {
-    srand(51);    
-    u = rand();
-    v = rand();
-    w = rand();
+    // a generator of its own, so that every call and thread gets the same
+    // direction without touching the process's rand() sequence
+    std::mt19937 rng( 51 );
+    u = rng();
+    v = rng();
+    w = rng();
     const double magnitude = sqrt( u*u + v*v + w*w );
     u /= magnitude;
     v /= magnitude;
@@ -928,11 +2005,44 @@ ErrorCode DagMC::point_in_volume(const EntityHandle volume,
   direction[0] = float(u); 
   direction[1] = float(v); 
   direction[2] = float(w);
+  const float ray_time = embree_time( time );
+
+  // with overlaps the first crossing is not enough, count every crossing instead.
+  // The point is inside if there are more exits than entrances along the ray.
+  if ( 0 != overlapThickness )
+    {
+      static thread_local std::vector<RayHit> hits(64);
+      unsigned num_hits = query_scenes()->get_all_intersections( volume, pos, direction, &hits[0], hits.size(),
+								 0.0f, 1.0e38f, 0, ray_time );
+      if ( num_hits > hits.size() )
+	{
+	  hits.resize( num_hits );
+	  num_hits = query_scenes()->get_all_intersections( volume, pos, direction, &hits[0], hits.size(),
+							    0.0f, 1.0e38f, 0, ray_time );
+	}
+
+      int sum = 0;
+      for ( unsigned i = 0; i < num_hits; i++ )
+	{
+	  // a crossing at an edge or vertex is found once for each triangle there
+	  if ( 0 < i && hits[i].surf == hits[i-1].surf && hits[i].exit == hits[i-1].exit &&
+	       numericalPrecision >= hits[i].dist - hits[i-1].dist )
+	    continue;
+	  sum += hits[i].exit ? -1 : 1;
+	}
+
+      if ( 0 < sum )                          result = 0; // pt is outside (for all vols)
+      else if ( 0 > sum )                     result = 1; // pt is inside  (for all vols)
+      else if ( impl_compl_handle == volume ) result = 1; // pt is inside  (for impl_compl_vol)
+      else                                    result = 0; // pt is outside (for all other vols)
+      return MB_SUCCESS;
+    }
 
   tnear = 0.0f;
   int em_geom_id;
   float distance_to_hit;
-  RTC->ray_fire( volume, pos, direction, rtc::rf_type::PIV, tnear, em_geom_id, distance_to_hit, tri_norm);
+  query_scenes()->ray_fire( volume, pos, direction, rtc::rf_type::PIV, tnear, em_geom_id, distance_to_hit, tri_norm,
+			    1.0e38f, 1, NULL, NULL, ray_time);
 
   //if the ray misses, we are outside of the volume
   if (-1 == em_geom_id ) 
@@ -992,9 +2102,10 @@ ErrorCode DagMC::point_in_volume(const EntityHandle volume,
 
   if( u == 0 && v == 0 && w == 0 )
   {
-    u = rand();
-    v = rand();
-    w = rand();
+    std::mt19937 rng( 51 );
+    u = rng();
+    v = rng();
+    w = rng();
     const double magnitude = sqrt( u*u + v*v + w*w );
     u /= magnitude;
     v /= magnitude;
@@ -1103,6 +2214,8 @@ ErrorCode DagMC::test_volume_boundary( const EntityHandle volume, const EntityHa
   }
   else{
     // look up nearest facet
+    if( meshReleased )
+      return need_mesh( "test_volume_boundary without a facet" );
 
     // Get OBB Tree for surface
     assert(volume - setOffset < rootSets.size());
@@ -1142,6 +2255,8 @@ ErrorCode DagMC::test_volume_boundary( const EntityHandle volume, const EntityHa
   }
   else{
     // look up nearest facet
+    if( meshReleased )
+      return need_mesh( "test_volume_boundary without a facet" );
 
     // Get OBB Tree for surface
     assert(volume - setOffset < rootSets.size());
@@ -1157,18 +2272,94 @@ ErrorCode DagMC::test_volume_boundary( const EntityHandle volume, const EntityHa
     rval = boundary_case( volume, dir, uvw[0], uvw[1], uvw[2], facet_out, surface );
     if (MB_SUCCESS != rval) return rval;
 
-  }
+  }
+
+  result = dir;
+
+  return MB_SUCCESS;
+
+}
+
+// guards the lazy construction of the winding number trees; a built tree
+// is published atomically, so queries only lock while it is missing
+static std::mutex winding_tree_mutex;
+
+void DagMC::reset_winding_trees( size_t num_vols )
+{
+  for (size_t i = 0; i < em_num_winding_trees; ++i)
+    delete em_winding_trees[i].load();
+  delete [] em_winding_trees;
+  em_winding_trees = num_vols ? new std::atomic<WindingTree*>[num_vols]() : NULL;
+  em_num_winding_trees = num_vols;
+}
+
+ErrorCode DagMC::winding_tree( EntityHandle volume, WindingTree*& tree )
+{
+  tree = NULL;
+  // the trees are built from the facets stored for the Embree scenes
+  if ( volume < em_scene_arr_offset ||
+       volume - em_scene_arr_offset >= em_num_winding_trees )
+    return MB_SUCCESS;
+
+  std::atomic<WindingTree*>& vol_tree = em_winding_trees[volume-em_scene_arr_offset];
+  tree = vol_tree.load( std::memory_order_acquire );
+  if ( tree )
+    return MB_SUCCESS;
+
+  // another thread may have built it while this one waited
+  std::lock_guard<std::mutex> lock( winding_tree_mutex );
+  tree = vol_tree.load( std::memory_order_relaxed );
+  if ( tree )
+    return MB_SUCCESS;
+
+  if ( meshReleased )
+    return need_mesh( "winding_tree" );
 
-  result = dir;
+  ErrorCode rval;
+  const std::vector<Range> &surf_tris = em_scene_tris[volume-em_scene_arr_offset];
+  const std::vector<int> &senses = em_scene_senses[volume-em_scene_arr_offset];
+  std::vector<double> tris;
+  CartVect coords[3];
+  const EntityHandle *conn;
+  int len;
+  for (unsigned i = 0; i < surf_tris.size(); ++i) {
+    if (!senses[i])  // skip non-manifold surfaces
+      continue;
+    for (Range::const_iterator j = surf_tris[i].begin(); j != surf_tris[i].end(); ++j) {
+      rval = MBI->get_connectivity( *j, conn, len );
+      if (MB_SUCCESS != rval)
+        return rval;
+      rval = MBI->get_coords( conn, 3, coords[0].array() );
+      if (MB_SUCCESS != rval)
+        return rval;
+      // wind the facet so that its normal points out of the volume
+      if (-1 == senses[i])
+        std::swap( coords[1], coords[2] );
+      for (int k = 0; k < 3; ++k)
+        tris.insert( tris.end(), coords[k].array(), coords[k].array() + 3 );
+    }
+  }
 
+  tree = new WindingTree( tris );
+  vol_tree.store( tree, std::memory_order_release );
   return MB_SUCCESS;
-
 }
 
 // use spherical area test to determine inside/outside of a polyhedron.
 ErrorCode DagMC::point_in_volume_slow( EntityHandle volume, const double xyz[3], int& result )
 {
   ErrorCode rval;
+
+  WindingTree* tree;
+  rval = winding_tree( volume, tree );
+  if (MB_SUCCESS != rval)
+    return rval;
+  if (tree) {
+    // the winding number is 1 inside and 0 outside, or 2 in an overlap
+    result = fabs( tree->winding_number( xyz ) ) > 0.5;
+    return MB_SUCCESS;
+  }
+
   Range faces;
   std::vector<EntityHandle> surfs;
   std::vector<int> senses;
@@ -1209,11 +2400,45 @@ ErrorCode DagMC::point_in_volume_slow( EntityHandle volume, const double xyz[3],
   return MB_SUCCESS;
 }
 
+ErrorCode DagMC::points_in_volume_slow( EntityHandle volume, unsigned num_points,
+                                        const double* xyz, int* results, unsigned num_threads )
+{
+  ErrorCode rval;
+
+  WindingTree* tree;
+  rval = winding_tree( volume, tree );
+  if (MB_SUCCESS != rval)
+    return rval;
+
+  if (0 == num_points)
+    return MB_SUCCESS;
+
+  // without a tree, test the points one at a time
+  if (!tree) {
+    for (unsigned i = 0; i < num_points; ++i) {
+      rval = point_in_volume_slow( volume, xyz + 3*i, results[i] );
+      if (MB_SUCCESS != rval)
+        return rval;
+    }
+    return MB_SUCCESS;
+  }
+
+  std::vector<double> winding( num_points );
+  tree->winding_numbers( xyz, num_points, &winding[0], num_threads );
+  for (unsigned i = 0; i < num_points; ++i)
+    results[i] = fabs( winding[i] ) > 0.5;
+
+  return MB_SUCCESS;
+}
+
 
 
 // detemine distance to nearest surface
 ErrorCode DagMC::closest_to_location( EntityHandle volume, const double coords[3], double& result)
 {
+  if (meshReleased)
+    return need_mesh( "closest_to_location" );
+
     // Get OBB Tree for volume
   assert(volume - setOffset < rootSets.size());
   EntityHandle root = rootSets[volume - setOffset];
@@ -1232,9 +2457,287 @@ ErrorCode DagMC::closest_to_location( EntityHandle volume, const double coords[3
 
 }
 
+void DagMC::free_safety_grids()
+{
+  for (unsigned i = 0; i < em_safety_grids.size(); ++i)
+    delete em_safety_grids[i];
+  em_safety_grids.clear();
+}
+
+ErrorCode DagMC::build_safety_grids( size_t max_bytes, unsigned num_threads )
+{
+  ErrorCode rval;
+
+  free_safety_grids();
+  em_safety_grids.assign( em_scene_tris.size(), NULL );
+
+  size_t total_tris = 0;
+  for (unsigned i = 0; i < em_scene_tris.size(); ++i)
+    for (unsigned j = 0; j < em_scene_tris[i].size(); ++j)
+      total_tris += em_scene_tris[i][j].size();
+  if (0 == total_tris)
+    return MB_SUCCESS;
+
+  for (unsigned i = 0; i < em_scene_tris.size(); ++i) {
+    std::vector<double> coords;
+    rval = scene_coords( em_scene_tris[i], coords );
+    if (MB_SUCCESS != rval)
+      return rval;
+    if (coords.empty())
+      continue;
+
+    size_t vol_bytes = max_bytes * ( (double)(coords.size()/9) / total_tris );
+    em_safety_grids[i] = new SafetyGrid( coords, vol_bytes, num_threads );
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::build_volume_grid()
+{
+  ErrorCode rval;
+  volGridCells.clear();
+  volGridLists.clear();
+  // cells built from the surfaces at the start would be wrong at later times
+  if (volGridResolution <= 0 || em_scene_tris.empty() || !surfMotions.empty())
+    return MB_SUCCESS;
+
+  // triangle coordinates and bounding box of each volume, by volume index
+  const std::vector<EntityHandle>& vols = vol_handles();
+  std::vector< std::vector<double> > coords( vols.size() );
+  std::vector<double> boxes( 6*vols.size() );
+  double lo[3] = { HUGE_VAL, HUGE_VAL, HUGE_VAL }, hi[3] = { -HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+  for (unsigned v = 1; v < vols.size(); ++v) {
+    rval = scene_coords( em_scene_tris[vols[v]-em_scene_arr_offset], coords[v] );
+    if (MB_SUCCESS != rval)
+      return rval;
+    double *box = &boxes[6*v];
+    std::fill( box, box+3, HUGE_VAL );
+    std::fill( box+3, box+6, -HUGE_VAL );
+    for (unsigned i = 0; i < coords[v].size(); ++i) {
+      box[i%3] = std::min( box[i%3], coords[v][i] );
+      box[3+i%3] = std::max( box[3+i%3], coords[v][i] );
+    }
+    for (unsigned j = 0; j < 3; ++j) {
+      lo[j] = std::min( lo[j], box[j] );
+      hi[j] = std::max( hi[j], box[3+j] );
+    }
+  }
+  double longest = 0.0;
+  for (unsigned j = 0; j < 3; ++j)
+    longest = std::max( longest, hi[j]-lo[j] );
+  if (!(longest > 0.0))
+    return MB_SUCCESS;
+
+  // cubic cells, coarsened until they fit in the memory budget
+  const size_t max_cells = std::max( volGridMaxBytes/sizeof(int), size_t(1) );
+  volGridCellSize = longest / volGridResolution;
+  size_t num_cells;
+  for (;;) {
+    num_cells = 1;
+    for (unsigned j = 0; j < 3; ++j) {
+      volGridDims[j] = int( (hi[j]-lo[j])/volGridCellSize ) + 1;
+      num_cells *= volGridDims[j];
+    }
+    if (num_cells <= max_cells)
+      break;
+    volGridCellSize *= 1.05;
+  }
+  std::copy( lo, lo+3, volGridOrigin );
+  const size_t nx = volGridDims[0], nxy = nx*volGridDims[1];
+
+  // the cells each volume's triangles pass through, from their bounding boxes
+  std::vector< std::pair<size_t, int> > crossings;
+  for (unsigned v = 1; v < vols.size(); ++v) {
+    for (unsigned t = 0; 9*t < coords[v].size(); ++t) {
+      const double *p = &coords[v][9*t];
+      int first[3], last[3];
+      for (unsigned j = 0; j < 3; ++j) {
+        double tlo = std::min( p[j], std::min( p[3+j], p[6+j] ) );
+        double thi = std::max( p[j], std::max( p[3+j], p[6+j] ) );
+        first[j] = std::min( int( (tlo-lo[j])/volGridCellSize ), volGridDims[j]-1 );
+        last[j] = std::min( int( (thi-lo[j])/volGridCellSize ), volGridDims[j]-1 );
+      }
+      for (int k = first[2]; k <= last[2]; ++k)
+        for (int j = first[1]; j <= last[1]; ++j)
+          for (int i = first[0]; i <= last[0]; ++i)
+            crossings.push_back( std::make_pair( i + nx*j + nxy*k, (int)v ) );
+    }
+  }
+  std::sort( crossings.begin(), crossings.end() );
+  crossings.erase( std::unique( crossings.begin(), crossings.end() ), crossings.end() );
+
+  // candidate lists of the crossed cells, with the implicit complement last
+  const int impl_compl_index = impl_compl_handle ? index_by_handle( impl_compl_handle ) : 0;
+  volGridCells.assign( num_cells, 0 );
+  volGridLists.assign( 1, 0 );
+  std::vector<bool> done( num_cells, false );
+  for (size_t i = 0; i < crossings.size(); ) {
+    const size_t cell = crossings[i].first;
+    bool in_impl_compl = false;
+    volGridCells[cell] = -(int)volGridLists.size();
+    done[cell] = true;
+    for (; i < crossings.size() && crossings[i].first == cell; ++i) {
+      if (crossings[i].second == impl_compl_index)
+        in_impl_compl = true;
+      else
+        volGridLists.push_back( crossings[i].second );
+    }
+    if (in_impl_compl)
+      volGridLists.push_back( impl_compl_index );
+    volGridLists.push_back( 0 );
+  }
+
+  // no surface separates face-adjacent uncrossed cells, so each connected
+  // region of them lies in one volume, found from the center of its first cell
+  std::vector<size_t> stack;
+  for (size_t seed = 0; seed < num_cells; ++seed) {
+    if (done[seed])
+      continue;
+
+    const int ijk[3] = { int(seed % nx), int((seed / nx) % volGridDims[1]), int(seed / nxy) };
+    double center[3];
+    for (unsigned j = 0; j < 3; ++j)
+      center[j] = volGridOrigin[j] + (ijk[j] + 0.5)*volGridCellSize;
+    int region_vol = impl_compl_index;
+    for (unsigned v = 1; v < vols.size(); ++v) {
+      const double *box = &boxes[6*v];
+      if ((int)v == impl_compl_index ||
+          center[0] < box[0] || center[1] < box[1] || center[2] < box[2] ||
+          center[0] > box[3] || center[1] > box[4] || center[2] > box[5])
+        continue;
+      int result;
+      rval = point_in_volume( vols[v], center, result );
+      if (MB_SUCCESS != rval)
+        return rval;
+      if (1 == result) {
+        region_vol = v;
+        break;
+      }
+    }
+
+    done[seed] = true;
+    stack.push_back( seed );
+    while (!stack.empty()) {
+      const size_t cell = stack.back();
+      stack.pop_back();
+      volGridCells[cell] = region_vol;
+      const int i = cell % nx, j = (cell / nx) % volGridDims[1], k = cell / nxy;
+      const size_t neighbors[6] = { cell-1, cell+1, cell-nx, cell+nx, cell-nxy, cell+nxy };
+      const bool valid[6] = { i > 0, i+1 < volGridDims[0], j > 0, j+1 < volGridDims[1],
+                              k > 0, k+1 < volGridDims[2] };
+      for (unsigned n = 0; n < 6; ++n) {
+        if (valid[n] && !done[neighbors[n]]) {
+          done[neighbors[n]] = true;
+          stack.push_back( neighbors[n] );
+        }
+      }
+    }
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::find_volume( const double xyz[3], EntityHandle& volume, const double* uvw,
+                              double time )
+{
+  CaptureNesting nesting;
+  ErrorCode rval;
+  volume = 0;
+  const bool have_ic = 0 != impl_compl_handle;
+
+  const int *candidates;
+  std::vector<int> all_vols;
+  if (!volGridCells.empty()) {
+    size_t cell = 0, stride = 1;
+    for (unsigned j = 0; j < 3; ++j) {
+      double x = (xyz[j] - volGridOrigin[j]) / volGridCellSize;
+      // beyond the model everything is in the implicit complement
+      if (!(x >= 0.0 && x < volGridDims[j])) {
+        if (!have_ic)
+          return MB_ENTITY_NOT_FOUND;
+        volume = impl_compl_handle;
+        return MB_SUCCESS;
+      }
+      cell += stride * (size_t)x;
+      stride *= volGridDims[j];
+    }
+
+    int value = volGridCells[cell];
+    if (0 < value) {
+      volume = vol_handles()[value];
+      return MB_SUCCESS;
+    }
+    if (0 == value)
+      return MB_ENTITY_NOT_FOUND;
+    candidates = &volGridLists[-value];
+  }
+  else {
+    // without a grid every volume is a candidate
+    for (unsigned v = 1; v < vol_handles().size(); ++v)
+      if (vol_handles()[v] != impl_compl_handle)
+        all_vols.push_back( v );
+    if (have_ic)
+      all_vols.push_back( index_by_handle( impl_compl_handle ) );
+    all_vols.push_back( 0 );
+    candidates = &all_vols[0];
+  }
+
+  EntityHandle on_boundary = 0;
+  for (; *candidates; ++candidates) {
+    EntityHandle vol = vol_handles()[*candidates];
+    // the implicit complement is last, holding whatever the others do not
+    if (vol == impl_compl_handle) {
+      volume = on_boundary ? on_boundary : vol;
+      return MB_SUCCESS;
+    }
+    int result;
+    rval = point_in_volume( vol, xyz, result, uvw, NULL, time );
+    if (MB_SUCCESS != rval)
+      return rval;
+    if (1 == result) {
+      volume = vol;
+      return MB_SUCCESS;
+    }
+    if (-1 == result && !on_boundary)
+      on_boundary = vol;
+  }
+
+  volume = on_boundary;
+  return on_boundary ? MB_SUCCESS : MB_ENTITY_NOT_FOUND;
+}
+
+ErrorCode DagMC::safety_distance( EntityHandle volume, const double coords[3], double& result )
+{
+  // the grids and the mesh hold the surfaces at the start of the motion
+  double sweep = 0.0;
+  if (volume >= em_scene_arr_offset && volume - em_scene_arr_offset < em_scene_sweeps.size())
+    sweep = em_scene_sweeps[volume - em_scene_arr_offset];
+
+  if (volume >= em_scene_arr_offset && volume - em_scene_arr_offset < em_safety_grids.size()) {
+    const SafetyGrid *grid = em_safety_grids[volume - em_scene_arr_offset];
+    if (grid) {
+      result = grid->lower_bound( coords ) - sweep;
+      if (0.0 < result)
+        return MB_SUCCESS;
+    }
+  }
+
+  ErrorCode rval = closest_to_location( volume, coords, result );
+  if (MB_SUCCESS != rval)
+    return rval;
+  result = std::max( result - sweep, 0.0 );
+  return MB_SUCCESS;
+}
+
 // calculate volume of polyhedron
 ErrorCode DagMC::measure_volume( EntityHandle volume, double& result )
 {
+  if (meshReleased) {
+    result = volMeasures[index_by_handle( volume )];
+    return MB_SUCCESS;
+  }
+
   ErrorCode rval;
   std::vector<EntityHandle> surfaces, surf_volumes;
   result = 0.0;
@@ -1303,6 +2806,11 @@ ErrorCode DagMC::measure_volume( EntityHandle volume, double& result )
 // sum area of elements in surface
 ErrorCode DagMC::measure_area( EntityHandle surface, double& result )
 {
+  if (meshReleased) {
+    result = areaMeasures[index_by_handle( surface )];
+    return MB_SUCCESS;
+  }
+
     // get triangles in surface
   Range triangles;
   ErrorCode rval = MBI->get_entities_by_dimension( surface, 2, triangles );
@@ -1385,10 +2893,16 @@ ErrorCode DagMC::surface_sense( EntityHandle volume,
   //if (volume == impl_compl_handle)
   //  volume = (EntityHandle) 0;
 
-    // get sense of surfaces wrt volumes
+    // get sense of surfaces wrt volumes, from the cache if it holds this surface
   EntityHandle surf_volumes[2];
-  ErrorCode rval = MBI->tag_get_data( sense_tag(), &surface, 1, surf_volumes );
-  if (MB_SUCCESS != rval)  return rval;
+  if ( surface >= em_surf_offset && 2*(surface-em_surf_offset) < em_surf_vols.size() ) {
+    surf_volumes[0] = em_surf_vols[2*(surface-em_surf_offset)];
+    surf_volumes[1] = em_surf_vols[2*(surface-em_surf_offset)+1];
+  }
+  else {
+    ErrorCode rval = MBI->tag_get_data( sense_tag(), &surface, 1, surf_volumes );
+    if (MB_SUCCESS != rval)  return rval;
+  }
 
   if (surf_volumes[0] == volume)
     sense_out = (surf_volumes[1] != volume); // zero if both, otherwise 1
@@ -1405,10 +2919,21 @@ ErrorCode DagMC::get_angle(EntityHandle surf, const double in_pt[3], double angl
   EntityHandle root = rootSets[surf - setOffset];
   ErrorCode rval;
 
+  // the normal of the last hit is kept by the history
+  if( history && -1 != history->last_geom && !history->last_on_edge &&
+      surf == em_scene_arr[history->last_vol-em_scene_arr_offset][history->last_geom] ){
+    std::copy( history->last_normal, history->last_normal + 3, angle );
+    return MB_SUCCESS;
+  }
+
   std::vector<EntityHandle> facets;
 
-  // if no history or history empty, use nearby facets
-  if( !history || (history->prev_facets.size() == 0) ){
+  // if no history or history empty, or the last hit was on an edge or vertex,
+  // use nearby facets
+  if( !history || (history->prev_facets.size() == 0) ||
+      (-1 != history->last_geom && history->last_on_edge) ){
+    if( meshReleased )
+      return need_mesh( "get_angle without a history" );
     rval = obbTree.closest_to_location( in_pt, root, numericalPrecision, facets );
     assert(MB_SUCCESS == rval);
     if (MB_SUCCESS != rval) return rval;
@@ -1418,6 +2943,15 @@ ErrorCode DagMC::get_angle(EntityHandle surf, const double in_pt[3], double angl
     facets.push_back( history->prev_facets.back() );
   }
 
+  // without the mesh the stored normal of the facet is used
+  if( meshReleased ){
+    if( facets.size() != 1 )
+      return need_mesh( "get_angle without a history" );
+    std::copy( &em_tri_normals[3*(facets[0]-em_tri_offset)],
+               &em_tri_normals[3*(facets[0]-em_tri_offset)] + 3, angle );
+    return MB_SUCCESS;
+  }
+
   CartVect coords[3], normal(0.0);
   const EntityHandle *conn;
   int len;
@@ -1558,22 +3092,31 @@ ErrorCode DagMC::boundary_case( EntityHandle volume, int& result,
     const EntityHandle *conn;
     int len, sense_out;
 
-    rval = mbImpl->get_connectivity( facet, conn, len );
-    assert( MB_SUCCESS == rval );
-    if(MB_SUCCESS != rval) return rval;
-    assert( 3 == len );
+    if ( facet >= em_tri_offset && 3*(facet-em_tri_offset) < em_tri_normals.size() ) {
+      // the facet normal is stored, no need to read the mesh
+      const float *n = &em_tri_normals[3*(facet-em_tri_offset)];
+      normal = CartVect( n[0], n[1], n[2] );
+    }
+    else {
+      rval = mbImpl->get_connectivity( facet, conn, len );
+      assert( MB_SUCCESS == rval );
+      if(MB_SUCCESS != rval) return rval;
+      assert( 3 == len );
 
-    rval = mbImpl->get_coords( conn, 3, coords[0].array() );
-    assert(MB_SUCCESS == rval);
-    if(MB_SUCCESS != rval) return rval;
+      rval = mbImpl->get_coords( conn, 3, coords[0].array() );
+      assert(MB_SUCCESS == rval);
+      if(MB_SUCCESS != rval) return rval;
+
+      coords[1] -= coords[0];
+      coords[2] -= coords[0];
+      normal = coords[1] * coords[2];
+    }
 
     rval = surface_sense( volume, surface, sense_out );
     assert( MB_SUCCESS == rval);
     if(MB_SUCCESS != rval) return rval;
 
-    coords[1] -= coords[0];
-    coords[2] -= coords[0];
-    normal = sense_out * (coords[1] * coords[2]);
+    normal *= sense_out;
 
     double sense = ray_vector % normal;
 
@@ -1921,6 +3464,65 @@ void DagMC::set_use_CAD( bool use_cad ){
 
 }
 
+void DagMC::set_volume_motion( int vol_id, const CartVect& displacement ){
+
+  if ( 0.0 == displacement.length() )
+    volMotions.erase( vol_id );
+  else
+    volMotions[vol_id] = displacement;
+
+  std::cout << "Set motion of volume " << vol_id << " = " << displacement << std::endl;
+
+}
+
+void DagMC::set_instancing( bool enable ){
+
+  instancing = enable;
+
+  std::cout << "Turned " << (instancing?"ON":"OFF") << " instancing of translated volumes." << std::endl;
+
+}
+
+void DagMC::set_motion_interval( double start, double end ){
+
+  if ( end <= start ) {
+    std::cerr << "Invalid motion interval = " << start << " to " << end << std::endl;
+  }
+  else{
+    motionStart = start;
+    motionEnd = end;
+  }
+
+  std::cout << "Set motion interval = " << motionStart << " to " << motionEnd << std::endl;
+
+}
+
+// the Embree ray time of a time, 0 and 1 at the ends of the motion interval
+float DagMC::embree_time( double time ){
+
+  if ( surfMotions.empty() )
+    return 0.0f;
+  double t = ( time - motionStart ) / ( motionEnd - motionStart );
+  return float( std::min( std::max( t, 0.0 ), 1.0 ) );
+
+}
+
+void DagMC::set_volume_grid( int resolution, size_t max_bytes ){
+
+  if ( resolution < 0 || 0 == max_bytes ) {
+    std::cerr << "Invalid volume grid resolution = " << resolution
+              << ", memory = " << max_bytes << std::endl;
+  }
+  else{
+    volGridResolution = resolution;
+    volGridMaxBytes = max_bytes;
+  }
+
+  std::cout << "Set volume grid resolution = " << volGridResolution
+            << ", memory = " << volGridMaxBytes << std::endl;
+
+}
+
 ErrorCode DagMC::write_mesh(const char* ffile,
                             const int flen)
 {
@@ -2114,6 +3716,81 @@ ErrorCode DagMC::parse_properties( const std::vector<std::string>& keywords,
       }
     }
   }
+
+  rval = build_property_tables();
+  if( MB_SUCCESS != rval ) return rval;
+
+  return build_property_index();
+}
+
+ErrorCode DagMC::build_property_tables()
+{
+  ErrorCode rval;
+
+  DagmcVolData defaults;
+  defaults.mat_id = 0;
+  defaults.density = 0.0;
+  defaults.importance = 1.0;
+  defaults.flags = 0;
+  volData.assign( vol_handles().size(), defaults );
+  surfFlags.assign( surf_handles().size(), 0 );
+  if( entIndices.empty() ) return MB_SUCCESS;
+
+  static const char* const flag_props[] = { "graveyard", "spec.reflect", "white.reflect", "tally" };
+  static const int flag_bits[] = { DAGMC_GRAVEYARD, DAGMC_SPEC_REFLECT, DAGMC_WHITE_REFLECT, DAGMC_TALLY };
+
+  for( std::map<std::string, Tag>::iterator it = property_tagmap.begin();
+       it != property_tagmap.end(); ++it )
+  {
+    const std::string& prop = (*it).first;
+    int flag = 0;
+    for( unsigned int k = 0; k < sizeof(flag_bits)/sizeof(flag_bits[0]); ++k )
+      if( prop == flag_props[k] ) flag = flag_bits[k];
+    if( !flag && prop != "mat" && prop != "rho" && prop != "imp" && prop != "comp" )
+      continue;
+
+    // only the sets that carry the property are visited
+    Range ents;
+    rval = MBI->get_entities_by_type_and_tag( 0, MBENTITYSET, &(*it).second, NULL, 1, ents );
+    if( MB_SUCCESS != rval ) return rval;
+
+    for( Range::iterator i = ents.begin(); i != ents.end(); ++i ){
+      // groups may also contain sets that are neither surfaces nor volumes
+      if( *i < setOffset || *i - setOffset >= entIndices.size() ) continue;
+      unsigned int index = entIndices[*i - setOffset];
+      bool is_vol = index < vol_handles().size() && vol_handles()[index] == *i;
+      bool is_surf = index < surf_handles().size() && surf_handles()[index] == *i;
+      if( 0 == index || !(is_vol || is_surf) ) continue;
+
+      if( flag ){
+        if( is_vol ) volData[index].flags |= flag;
+        else surfFlags[index] |= flag;
+        continue;
+      }
+      if( !is_vol ) continue;
+
+      std::vector<std::string> values;
+      rval = unpack_packed_string( (*it).second, *i, values );
+      if( MB_SUCCESS != rval ) return rval;
+      if( values.empty() ) continue;
+
+      // the first value wins if a volume is in several groups
+      const std::string& value = values.front();
+      DagmcVolData& data = volData[index];
+      if( prop == "mat" )
+        data.mat_id = atoi( value.c_str() );
+      else if( prop == "rho" )
+        data.density = atof( value.c_str() );
+      else if( prop == "imp" ){
+        // importances may be given per particle as "particle/value"
+        std::string::size_type slash = value.find('/');
+        data.importance = atof( value.c_str() + (slash == std::string::npos ? 0 : slash+1) );
+      }
+      else
+        data.comp_name = value;
+    }
+  }
+
   return MB_SUCCESS;
 }
 
@@ -2171,64 +3848,112 @@ bool DagMC::has_prop( EntityHandle eh, const std::string& prop )
 
 ErrorCode DagMC::get_all_prop_values( const std::string& prop, std::vector<std::string>& return_list )
 {
-  ErrorCode rval;
-  std::map<std::string, Tag>::iterator it = property_tagmap.find(prop);
-  if( it == property_tagmap.end() ){
-    return MB_TAG_NOT_FOUND;
-  }
-  Tag proptag = (*it).second;
-  Range all_ents;
-
-  rval = MBI->get_entities_by_type_and_tag( 0, MBENTITYSET, &proptag, NULL, 1, all_ents );
+  const std::vector<std::string>* values;
+  ErrorCode rval = get_all_prop_values( prop, values );
   if( MB_SUCCESS != rval ) return rval;
 
-  std::set<std::string> unique_values;
-  for( Range::iterator i = all_ents.begin(); i!= all_ents.end(); ++i){
-    std::vector<std::string> values;
-    rval = prop_values( *i, prop, values );
-    if( MB_SUCCESS != rval ) return rval;
-    unique_values.insert( values.begin(), values.end() );
-  }
-
-  return_list.assign( unique_values.begin(), unique_values.end() );
+  return_list = *values;
   return MB_SUCCESS;
 }
 
 ErrorCode DagMC::entities_by_property( const std::string& prop, std::vector<EntityHandle>& return_list,
                                        int dimension, const std::string* value )
 {
-  ErrorCode rval;
-  std::map<std::string, Tag>::iterator it = property_tagmap.find(prop);
-  if( it == property_tagmap.end() ){
-    return MB_TAG_NOT_FOUND;
-  }
-  Tag proptag = (*it).second;
-  Range all_ents;
-
-  // Note that we cannot specify values for proptag here-- the passed value,
-  // if it exists, may be only a subset of the packed string representation
-  // of this tag.
-  Tag tags[2] = {proptag, geomTag };
-  void* vals[2] = {NULL, (dimension!=0) ? &dimension : NULL };
-  rval = MBI->get_entities_by_type_and_tag( 0, MBENTITYSET, tags, vals, 2, all_ents );
+  const std::vector<EntityHandle>* handles;
+  ErrorCode rval = entities_by_property( prop, handles, dimension, value );
   if( MB_SUCCESS != rval ) return rval;
 
-  std::set<EntityHandle> handles;
-  for( Range::iterator i = all_ents.begin(); i!=all_ents.end(); ++i){
-    std::vector<std::string> values;
-    rval = prop_values( *i, prop, values );
+  return_list = *handles;
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::build_property_index()
+{
+  ErrorCode rval;
+  propIndex.clear();
+
+  for( std::map<std::string, Tag>::iterator it = property_tagmap.begin();
+       it != property_tagmap.end(); ++it )
+  {
+    Tag proptag = (*it).second;
+    prop_index& index = propIndex[(*it).first];
+
+    Range all_ents;
+    rval = MBI->get_entities_by_type_and_tag( 0, MBENTITYSET, &proptag, NULL, 1, all_ents );
     if( MB_SUCCESS != rval ) return rval;
-    if( value ){
-      if( std::find(values.begin(), values.end(), *value) != values.end() ){
-        handles.insert(*i);
-      }
+
+    std::set<std::string> unique_values;
+    for( Range::iterator i = all_ents.begin(); i != all_ents.end(); ++i ){
+      std::vector<std::string> values;
+      rval = unpack_packed_string( proptag, *i, values );
+      if( MB_SUCCESS != rval ) return rval;
+      unique_values.insert( values.begin(), values.end() );
     }
-    else{
-      handles.insert(*i);
+    index.values.assign( unique_values.begin(), unique_values.end() );
+
+    // only geometric sets are returned by entities_by_property
+    Tag tags[2] = {proptag, geomTag };
+    Range geom_ents;
+    rval = MBI->get_entities_by_type_and_tag( 0, MBENTITYSET, tags, NULL, 2, geom_ents );
+    if( MB_SUCCESS != rval ) return rval;
+    if( geom_ents.empty() ) continue;
+
+    std::vector<int> dims( geom_ents.size() );
+    rval = MBI->tag_get_data( geomTag, geom_ents, &dims[0] );
+    if( MB_SUCCESS != rval ) return rval;
+
+    // the range is sorted, so appending keeps every list sorted
+    int j = 0;
+    for( Range::iterator i = geom_ents.begin(); i != geom_ents.end(); ++i, ++j ){
+      std::vector<std::string> values;
+      rval = unpack_packed_string( proptag, *i, values );
+      if( MB_SUCCESS != rval ) return rval;
+      std::sort( values.begin(), values.end() );
+      values.erase( std::unique( values.begin(), values.end() ), values.end() );
+
+      int keys[2] = { 0, dims[j] };
+      for( int k = 0; k < (dims[j] ? 2 : 1); ++k ){
+        index.entities[keys[k]].push_back( *i );
+        for( unsigned int v = 0; v < values.size(); ++v )
+          index.entities_by_value[std::make_pair( keys[k], values[v] )].push_back( *i );
+      }
     }
   }
 
-  return_list.assign( handles.begin(), handles.end() );
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::get_all_prop_values( const std::string& prop, const std::vector<std::string>*& return_list )
+{
+  std::map<std::string, prop_index>::iterator it = propIndex.find(prop);
+  if( it == propIndex.end() ){
+    return MB_TAG_NOT_FOUND;
+  }
+  return_list = &(*it).second.values;
+  return MB_SUCCESS;
+}
+
+ErrorCode DagMC::entities_by_property( const std::string& prop, const std::vector<EntityHandle>*& return_list,
+                                       int dimension, const std::string* value )
+{
+  static const std::vector<EntityHandle> no_entities;
+
+  std::map<std::string, prop_index>::iterator it = propIndex.find(prop);
+  if( it == propIndex.end() ){
+    return MB_TAG_NOT_FOUND;
+  }
+  prop_index& index = (*it).second;
+
+  return_list = &no_entities;
+  if( value ){
+    std::map<std::pair<int, std::string>, std::vector<EntityHandle> >::iterator found =
+      index.entities_by_value.find( std::make_pair( dimension, *value ) );
+    if( found != index.entities_by_value.end() ) return_list = &(*found).second;
+  }
+  else{
+    std::map<int, std::vector<EntityHandle> >::iterator found = index.entities.find( dimension );
+    if( found != index.entities.end() ) return_list = &(*found).second;
+  }
   return MB_SUCCESS;
 }
 
@@ -2298,6 +4023,9 @@ ErrorCode DagMC::getobb(EntityHandle volume, double minPt[3],
 ErrorCode DagMC::getobb(EntityHandle volume, double center[3], double axis1[3],
                           double axis2[3], double axis3[3])
 {
+  if (meshReleased)
+    return need_mesh( "getobb" );
+
     //find EntityHandle node_set for use in box
   EntityHandle root = rootSets[volume - setOffset];
 
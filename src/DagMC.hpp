@@ -4,19 +4,32 @@
 #include "moab/Interface.hpp"
 #include "MBTagConventions.hpp"
 #include "embree.hpp"
+#include "winding_tree.hpp"
+#include "safety_grid.hpp"
+#include "phase_profiler.hpp"
+#include "domain_decomp.hpp"
+#include "numa_topology.hpp"
 #include <vector>
 #include <map>
 #include <string>
+#include <atomic>
+#include <mutex>
 #include <assert.h>
 
 #include "moab/OrientedBoxTreeTool.hpp"
 
 class RefEntity;
 
+// boundary condition and tally flags of a volume or surface
+enum DagmcPropFlag { DAGMC_GRAVEYARD = 1, DAGMC_SPEC_REFLECT = 2,
+                     DAGMC_WHITE_REFLECT = 4, DAGMC_TALLY = 8 };
+
+// numeric properties of a volume, parsed once from its group metadata
 struct DagmcVolData {
   int mat_id;
   double density, importance;
   std::string comp_name;
+  int flags; // DagmcPropFlag bits
 };
 
 
@@ -61,6 +74,39 @@ public:
   std::map<EntityHandle, std::vector<EntityHandle> > em_scene_map;
   std::vector< std::vector<EntityHandle> > em_scene_arr;
   EntityHandle em_scene_arr_offset;
+  // surfaces of the global Embree scene, indexed by geometry ID
+  std::vector<EntityHandle> em_global_surfs;
+  // triangles of each surface in a volume's scene, indexed like em_scene_arr
+  // and then by Embree primitive ID
+  std::vector< std::vector<Range> > em_scene_tris;
+  // sense of each surface with respect to the volume, indexed like em_scene_arr
+  std::vector< std::vector<int> > em_scene_senses;
+  // Embree geometry ID of each surface in a volume's scene, indexed like em_scene_arr
+  std::vector< std::map<EntityHandle,int> > em_scene_geoms;
+  // forward and reverse volumes of each surface, copied from the sense tag and
+  // indexed by 2*(surface - em_surf_offset)
+  std::vector<EntityHandle> em_surf_vols;
+  EntityHandle em_surf_offset;
+  // unit normal of each triangle in its surface's forward sense, indexed by
+  // 3*(triangle - em_tri_offset)
+  std::vector<float> em_tri_normals;
+  EntityHandle em_tri_offset;
+  // winding number tree of each volume, indexed like em_scene_arr and built
+  // on first use by point_in_volume_slow, and how many there are room for
+  std::atomic<WindingTree*>* em_winding_trees;
+  size_t em_num_winding_trees;
+  // safety distance grid of each volume, indexed like em_scene_arr and built
+  // by build_safety_grids
+  std::vector<SafetyGrid*> em_safety_grids;
+  // volume whose Embree scene each volume instances, indexed like
+  // em_scene_arr (0 if the volume has its own triangles)
+  std::vector<EntityHandle> em_prototypes;
+  // farthest any surface of each volume moves over the motion interval,
+  // indexed like em_scene_arr
+  std::vector<double> em_scene_sweeps;
+  // times the phases of load_file and init_OBBTree once enabled, e.g.
+  // profiler.enable() before load_file and profiler.report(std::cout) after
+  PhaseProfiler profiler;
   ~DagMC();
 
   /** Return the version of this library */
@@ -84,6 +130,56 @@ public:
   ErrorCode load_file(const char* cfile,
                       const double facet_tolerance = 0);
 
+  /**\brief Load only some of the volumes of a geometry file
+   *
+   * For domain decomposed runs, where each process needs only the volumes
+   * of its domain and a halo.  Only the requested volume sets, their surfaces
+   * and curves, and the triangles and vertices of those are read from the file
+   * (a MOAB partial read, supported by .h5m files), so memory and startup
+   * scale with the size of the subset.  init_OBBTree then builds only these
+   * volumes.  Surfaces shared with volumes that were not loaded bound the
+   * implicit complement instead.  Groups are not read, so properties assigned
+   * through group names are not available.
+   *\param cfile the file name to be loaded
+   *\param vol_ids the IDs of the volumes to load
+   *\param facet_tolerance the faceting tolerance guidance, as for load_file
+   */
+  ErrorCode load_volumes(const char* cfile,
+                         const std::vector<int>& vol_ids,
+                         const double facet_tolerance = 0);
+
+  /**\brief Find the volumes of a geometry file within a region
+   *
+   * Reads the whole file into a scratch MOAB instance, so it is meant to be
+   * run once (e.g. on one process, with the result shared) to choose the
+   * volumes for load_volumes.
+   *\param cfile the file name to be searched
+   *\param lo, hi the corners of the region
+   *\param vol_ids Output, the IDs of the volumes whose bounding boxes overlap it
+   */
+  static ErrorCode volumes_in_region(const char* cfile, const double lo[3], const double hi[3],
+                                     std::vector<int>& vol_ids);
+
+  /**\brief Estimate the cost of every volume of a geometry file
+   *
+   * For partition_volumes (domain_decomp.hpp).  Reads the whole file into a
+   * scratch MOAB instance, so, like volumes_in_region, it is meant to be run
+   * once and its result shared.
+   *\param cfile the file name to be read
+   *\param costs Output, the ID, bounding box and triangle count (as the cost) of each volume
+   */
+  static ErrorCode volume_costs(const char* cfile, std::vector<VolumeCost>& costs);
+
+  /**\brief Record which rank owns each volume of a domain decomposition
+   *
+   * @param vol_ids The volume IDs, e.g. from volume_costs
+   * @param owners The rank owning each, e.g. from partition_volumes
+   */
+  void set_volume_owners(const std::vector<int>& vol_ids, const std::vector<int>& owners);
+
+  /**\brief The rank owning a volume, -1 if it has not been assigned one */
+  int owner_of(EntityHandle volume);
+
   /*\brief Use pre-loaded geometry set
    *
    * Works like load_file, but using data that has been externally
@@ -104,6 +200,77 @@ public:
    */
   ErrorCode init_OBBTree();
 
+  /**\brief Free the MOAB mesh once the Embree scenes are built (compact runtime)
+   *
+   * For transport-only runs.  The triangles, edges and vertices are deleted
+   * from MOAB along with the OBB trees, leaving the geometric sets and their
+   * tags (IDs, senses, names and properties), the triangle handles of each
+   * surface kept for ray histories, and the facet normals.  Volumes and areas
+   * are measured beforehand and kept.  ray_fire, point_in_volume,
+   * ray_intersections, find_volume and get_angle with a history keep
+   * working, as do safety grids and winding trees built before the call; the
+   * queries that need the mesh (closest_to_location, getobb, get_angle
+   * without a history, building safety, volume grid or winding trees) return
+   * MB_FAILURE afterwards.
+   * @param bytes_reclaimed Optional output, MOAB's estimate of the memory freed
+   */
+  ErrorCode release_mesh( unsigned long long* bytes_reclaimed = NULL );
+
+  /** true once release_mesh has freed the MOAB mesh */
+  bool mesh_released() { return meshReleased; }
+
+  /**\brief Derive a copy-on-write variant of the geometry with some volumes moved
+   *
+   * For comparing design variants.  The volumes with the given IDs are
+   * translated by the matching offsets.  A moved volume becomes an instance
+   * of its scene and the volumes sharing a surface with it get new scenes;
+   * every other volume shares the scene, vertex and index buffers of the
+   * base.  The base must keep all of its scenes (no scene_budget), and a
+   * surface bounding two moved volumes must move the same way with both.
+   * @param vol_ids IDs of the volumes to move
+   * @param offsets Translation of each volume
+   * @param variant Output, the variant, selected with use_variant and freed
+   *        with delete_variant; it belongs to this DagMC
+   */
+  ErrorCode create_variant( const std::vector<int>& vol_ids, const std::vector<CartVect>& offsets,
+                            rtc*& variant );
+
+  /**\brief Fire the calling thread's queries at a variant (NULL for the base)
+   *
+   * The variant must have been created by this DagMC and not deleted.
+   * Threads may use different variants at once.  ray_fire, ray_fire_batch,
+   * point_in_volume and ray_intersections within a volume see the variant;
+   * the queries answered from MOAB or the grids built at initialization
+   * (closest_to_location, safety_distance, find_volume, measure_*, ...)
+   * still see the base geometry.
+   */
+  ErrorCode use_variant( rtc* variant );
+
+  /** frees a variant of this DagMC, refusing while a thread still uses it */
+  ErrorCode delete_variant( rtc* variant );
+
+  /**\brief Keep a copy of the scenes on each NUMA node
+   *
+   * Each copy of the vertex buffer and volume scenes is built by a thread
+   * pinned to its node, so that first touch places it there, and ray_fire,
+   * ray_fire_batch, point_in_volume and ray_intersections within a volume
+   * are answered from the copy on the node the calling thread runs on.  Pin
+   * the query threads (NumaTopology::pin_thread) to keep them on one node;
+   * the node of a pinned thread is remembered instead of looked up per query.
+   * The memory of the scenes grows by the number of nodes; on a single node
+   * nothing is copied.  Needs the mesh and a base keeping all of its scenes
+   * (no scene_budget); variants still share the single copy.
+   * @param enable true to build the copies, false to free them
+   * @param force copy the scenes even on a single node, to test the copies
+   */
+  ErrorCode set_numa_replication( bool enable, bool force = false );
+
+  /** whether the calling thread's queries use a copy of set_numa_replication */
+  bool using_numa_replica();
+
+  /** the NUMA nodes used by set_numa_replication */
+  const NumaTopology& numa_topology() { return numaTopology; }
+
   /**\brief sets up storage for the implicit complimennt
    *
    * This method generates the implicit compliment storage, in normal situations
@@ -137,6 +304,13 @@ private:
   /** loading code shared by load_file and load_existing_contents */
   ErrorCode finish_loading();
 
+  /** reads the whole file, or only the volumes with the given IDs if vol_ids is given */
+  ErrorCode load_file_subset(const char* cfile, const double facet_tolerance,
+                             const std::vector<int>* vol_ids);
+
+  /** removes the sets a partial read of vol_ids loaded for other volumes */
+  ErrorCode prune_partial_load(const std::vector<int>& vol_ids);
+
   /** test for existing OBB Tree */
   bool have_obb_tree();
 
@@ -152,6 +326,37 @@ private:
   /** build obb structure for the implicit complement */
   ErrorCode build_obb_impl_compl(Range &surfs);
 
+  /** build the Embree scene holding every surface of the model */
+  ErrorCode build_global_scene();
+
+  /** cache the volumes on either side of every surface */
+  ErrorCode build_surface_senses();
+
+  /** store the normal of every triangle */
+  ErrorCode build_facet_normals();
+
+  /** get the winding number tree of a volume, building it if needed */
+  ErrorCode winding_tree( EntityHandle volume, WindingTree*& tree );
+
+  /** free the winding number trees and make room for num_vols of them */
+  void reset_winding_trees( size_t num_vols );
+
+  /** free the safety distance grids */
+  void free_safety_grids();
+
+  /** get the vertex coordinates of a volume's triangles, in scene order */
+  ErrorCode scene_coords( const std::vector<Range>& tris, std::vector<double>& coords );
+
+  /** the volumes with scenes of their own that later volumes may copy, by
+   *  surface count, triangle counts and senses, then by summed edge length */
+  typedef std::map< std::vector<int>, std::multimap<double, EntityHandle> > PrototypeIndex;
+
+  /** find an earlier volume whose scene triangles, in order, are those of
+   *  tris translated by -offset; prototype is 0 if there is none, and vol
+   *  is added to prototypes */
+  ErrorCode find_prototype( EntityHandle vol, const std::vector<Range>& tris, const std::vector<int>& senses,
+                            PrototypeIndex& prototypes, EntityHandle& prototype, double offset[3] );
+
 
   /* SECTION II: Fundamental Geometry Operations/Queries */
 public:
@@ -167,6 +372,8 @@ public:
   class RayHistory {
 
   public:
+    RayHistory() : last_geom(-1) {}
+
     /**
      * Clear this entire history-- logically equivalent to creating a new history,
      * but probably more efficient.
@@ -193,6 +400,17 @@ public:
 
   private:
     std::vector<EntityHandle> prev_facets;
+    // the surface of each facet in prev_facets and the facet's position in
+    // it, so that a volume's scene can skip them without searching
+    std::vector< std::pair<EntityHandle,int> > prev_prims;
+
+    // the most recent hit: the volume whose scene it was found in, its Embree
+    // geometry and primitive IDs, the facet normal in the surface's forward sense
+    // and whether it lies on a facet edge or vertex. last_geom is -1 if unknown.
+    EntityHandle last_vol;
+    int last_geom, last_prim;
+    double last_normal[3];
+    bool last_on_edge;
 
     friend class DagMC;
 
@@ -215,6 +433,11 @@ public:
    * If a ray changes direction at an intersection site, the caller should call
    * reset_to_last_intersection() on the history object before the next ray fire.
    *
+   * If an overlap thickness has been set, exits up to that distance behind the
+   * ray start are found in the same traversal.  When a history is given and the
+   * start point lies inside the volume beyond such an exit, that exit is returned
+   * at a distance of zero so that the particle leaves the overlap.
+   *
    * @param volume The volume to fire the ray at.
    * @param ray_start An array of x,y,z coordinates from which to start the ray.
    * @param ray_dir An array of x,y,z coordinates indicating the direction of the ray.
@@ -222,17 +445,25 @@ public:
    * @param next_surf Output parameter indicating the next surface intersected by the ray.
    *                If no intersection is found, will be set to 0.
    * @param next_surf_dist Output parameter indicating distance to next_surf.  If next_surf is
-   *                0, this value is undefined and should not be used.
+   *                0 and a dist_limit was given, this is set to dist_limit, meaning no surface
+   *                lies within the limit.  If next_surf is 0 and no limit was given (a lost ray),
+   *                this is set to std::numeric_limits<double>::max().
    * @param history Optional RayHistory object.  If provided, the facets in the history are
    *                assumed to not intersect with the given ray.  The facet intersected
    *                by this query will also be added to the history.
    * @param dist_limit Optional distance limit.  If provided and > 0, no intersections at a
-   *                distance further than this value will be returned.
+   *                distance further than this value will be returned.  The limit also
+   *                bounds the underlying traversal, so passing the distance to the next
+   *                collision makes short flights in dense materials cheaper.
    * @param ray_orientation Optional ray orientation. If provided determines intersections
    *                along the normal provided, e.g. if -1 allows intersections back along the
-   *                the ray direction, Default is 1, i.e. exit intersections
+   *                the ray direction, Default is 1, i.e. exit intersections.  -1 returns
+   *                entering intersections only and 0 returns both.  All orientations are
+   *                resolved in the same single traversal.
    * @param stats Optional TrvStats object used to measure performance of underlying OBB
    *              ray-firing query.  See OrientedBoxTreeTool.hpp for details.
+   * @param time Optional time of the ray, placing the volumes set moving with
+   *              set_volume_motion.
    *
    */
   ErrorCode ray_fire(const EntityHandle volume,
@@ -240,7 +471,77 @@ public:
                      EntityHandle& next_surf, double& next_surf_dist,
                      RayHistory* history = NULL, double dist_limit = 0,
 		     int ray_orientation = 1, 
-                     OrientedBoxTreeTool::TrvStats* stats = NULL  );
+                     OrientedBoxTreeTool::TrvStats* stats = NULL,
+                     double time = 0 );
+
+  /**\brief Record every ray_fire and point_in_volume query to a file
+   *
+   * Until stop_capture() is called, the arguments and results of each query
+   * are appended to filename as fixed size binary records (see
+   * ray_capture.hpp), which ray_replay re-executes to benchmark a change
+   * against a production workload.  Each thread buffers its own records, so
+   * capturing does not serialize the queries.  Ray histories are not recorded.
+   * @param filename The file to write, replaced if it exists
+   */
+  ErrorCode start_capture(const char* filename);
+
+  /**\brief Write out the buffered records and close the capture file
+   *
+   * Must not be called while other threads are making queries.
+   */
+  ErrorCode stop_capture();
+
+  /**\brief ray_fire for many independent rays at once
+   *
+   * The rays are sorted by volume, direction octant and the Morton code of
+   * their origin, fired 8 at a time as Embree packets, and their results are
+   * stored in the input order.  Rays that miss, or hit a surface at their
+   * origin (including a surface found behind the origin of a ray that
+   * missed), are repeated with ray_fire to get its handling of those cases.
+   * Packets need rtc::packets to have been set before init_OBBTree; without
+   * it, or with an overlap thickness, each ray goes through ray_fire.
+   *
+   * @param num_rays Number of rays
+   * @param volumes The volume each ray is fired at
+   * @param ray_starts 3 coordinates of each ray's origin
+   * @param ray_dirs 3 components of each ray's (unit) direction
+   * @param next_surfs Output, the surface each ray hits as from ray_fire
+   * @param next_surf_dists Output, the distance to it as from ray_fire
+   * @param dist_limit Optional distance limit applied to every ray, as for ray_fire
+   * @param ray_orientation Optional ray orientation of every ray, as for ray_fire
+   * @param utilization Optional output, the fraction of packet lanes that held a ray
+   * @param times Optional time of each ray, as for ray_fire (0 if NULL)
+   */
+  ErrorCode ray_fire_batch(unsigned num_rays, const EntityHandle* volumes,
+                           const double* ray_starts, const double* ray_dirs,
+                           EntityHandle* next_surfs, double* next_surf_dists,
+                           double dist_limit = 0, int ray_orientation = 1,
+                           double* utilization = NULL, const double* times = NULL );
+
+  /**\brief find every surface crossing along a ray in a single traversal
+   *
+   * Unlike repeated calls to ray_fire(), all intersections are collected by one
+   * traversal of the acceleration structure, so coincident hits are not skipped.
+   * Hits on a shared edge or vertex are reported once per triangle.
+   *
+   * @param volume The volume to fire the ray at.  If 0, the ray is fired at every
+   *               surface in the model (the global scene is built on first use, so
+   *               the first such call should not be made concurrently with others).
+   * @param ray_start An array of x,y,z coordinates from which to start the ray.
+   * @param ray_dir An array of x,y,z coordinates indicating the direction of the ray.
+   *                Must be of unit length.
+   * @param dists Output parameter, the distances to each intersection in ascending order.
+   * @param surfs Output parameter, the surface intersected at each distance.
+   * @param dist_limit Optional distance limit.  If provided and > 0, no intersections at a
+   *                distance further than this value will be returned.
+   * @param ray_orientation Optional ray orientation.  1 returns exiting intersections only,
+   *                -1 entering intersections only and 0 (the default) all intersections.
+   *                Orientation is undefined for the whole model and should be 0 there.
+   */
+  ErrorCode ray_intersections(const EntityHandle volume,
+                              const double ray_start[3], const double ray_dir[3],
+                              std::vector<double>& dists, std::vector<EntityHandle>& surfs,
+                              double dist_limit = 0, int ray_orientation = 0);
 
   /**\brief Test if a point is inside or outside a volume
    *
@@ -256,23 +557,39 @@ public:
    *        given, a random direction will be used.
    * @param history Optional RayHistory object to pass to underlying ray fire query.
    *        The history is not modified by this call.
+   * @param time Optional time of the test, placing the moving volumes as for ray_fire.
    */
   ErrorCode point_in_volume(const EntityHandle volume,
                             const double xyz[3],
                             int& result,
                             const double* uvw = NULL,
-                            const RayHistory* history = NULL );
+                            const RayHistory* history = NULL,
+                            double time = 0 );
 
   /**\brief Robust test if a point is inside or outside a volume using unit sphere area method
    *
-   * This test may be more robust that the standard point_in_volume, but is much slower.
+   * This test may be more robust that the standard point_in_volume, but is slower.
    * It does not detect 'on boundary' situations as point_in_volume does.
+   * Once init_OBBTree has been called, the solid angle is summed over a tree
+   * of the volume's facets (a fast winding number) in O(log N) per point.
+   * The tree is built on the first call for each volume.
    * @param volume The volume to test
    * @param xyz The location to test for volume containment
    * @param result Set to 0 if xyz it outside volume, 1 if inside.
    */
   ErrorCode point_in_volume_slow( const EntityHandle volume, const double xyz[3], int& result );
 
+  /**\brief point_in_volume_slow for many points at once, spread over threads
+   *
+   * @param volume The volume to test
+   * @param num_points The number of points
+   * @param xyz The point coordinates, 3 per point
+   * @param results Set to 0 for each point outside the volume, 1 for each inside
+   * @param num_threads Number of threads to use, 0 for one per hardware thread
+   */
+  ErrorCode points_in_volume_slow( const EntityHandle volume, unsigned num_points,
+                                   const double* xyz, int* results, unsigned num_threads = 0 );
+
 
   /** \brief Given a ray starting at a surface of a volume, check whether the ray enters or exits the volume
    *
@@ -289,6 +606,8 @@ public:
    *        the history is used to look up the surface facet at which the ray begins.  Absent a
    *        history, the facet nearest to xyz will be looked up.  The history should always be
    *        provided if available, as it avoids the computational expense of a nearest-facet query.
+   *        ray_fire records its hit facet in the history, and with the facet normals and surface
+   *        senses stored at initialization the test is then a single dot product.
    */
   ErrorCode test_volume_boundary( const EntityHandle volume, const EntityHandle surface,
                                   const double xyz[3], const double uvw[3], int& result,
@@ -319,6 +638,53 @@ public:
    */
   ErrorCode closest_to_location( EntityHandle volume, const double point[3], double& result);
 
+  /**\brief Build the grids used by safety_distance for every volume
+   *
+   * Must follow init_OBBTree.  Each volume gets a share of the memory budget
+   * in proportion to its number of triangles.
+   * @param max_bytes Memory budget of all the grids together
+   * @param num_threads Threads building each grid, 0 for one per hardware thread
+   */
+  ErrorCode build_safety_grids( size_t max_bytes = 64*1024*1024, unsigned num_threads = 0 );
+
+  /**\brief Find a lower bound on the distance from the test point to the boundary of the volume
+   *
+   * The bound is read from the volume's safety grid in constant time; near a
+   * surface, outside the grid, or without a grid the exact distance from
+   * closest_to_location is returned instead.  For a volume with moving
+   * surfaces the farthest they move is taken off, so that the bound holds at
+   * every time of the motion interval.
+   * @param volume Volume to query
+   * @param point Coordinates of test point
+   * @param result Set to a distance no greater than that from point to any surface of volume
+   */
+  ErrorCode safety_distance( EntityHandle volume, const double point[3], double& result );
+
+  /**\brief Build the grid used by find_volume to locate points
+   *
+   * Called by init_OBBTree when the grid is enabled by set_volume_grid.  Cells
+   * that no surface passes through hold the one volume containing them, found
+   * by one point_in_volume test per connected region of such cells; the others
+   * hold the volumes whose surfaces pass through them.  No grid is built while
+   * volumes move (set_volume_motion), since the cells would hold only at the
+   * start.
+   */
+  ErrorCode build_volume_grid();
+
+  /**\brief Find the volume containing a point
+   *
+   * Inside a cell of the volume grid that no surface crosses this is a lookup;
+   * elsewhere, or with no grid, the candidate volumes are tested with
+   * point_in_volume, the implicit complement last.
+   * @param xyz The location to find
+   * @param volume Set to the volume containing xyz
+   * @param uvw Optional direction passed to point_in_volume
+   * @param time Optional time passed to point_in_volume, placing the moving volumes
+   * @return MB_ENTITY_NOT_FOUND if no volume contains the point
+   */
+  ErrorCode find_volume( const double xyz[3], EntityHandle& volume, const double* uvw = NULL,
+                         double time = 0 );
+
   /** Calculate the volume contained in a 'volume' */
   ErrorCode measure_volume( EntityHandle volume, double& result );
 
@@ -346,6 +712,10 @@ public:
    * @param history Optional ray history from a previous call to ray_fire().
    *        If present and non-empty, return the normal
    *        of the most recently intersected facet, ignoring xyz.
+   *        The normal of a hit in the interior of a facet is kept by
+   *        the history and returned without any mesh queries; for a hit
+   *        on a facet edge or vertex the normals of the facets near xyz
+   *        are averaged instead.
    */
   ErrorCode get_angle(EntityHandle surf, const double xyz[3], double angle[3],
                       const RayHistory* history = NULL );
@@ -361,6 +731,21 @@ public:
                       EntityHandle& new_volume );
 
 private:
+  /** ray_fire for geometries with overlaps, see set_overlap_thickness */
+  ErrorCode ray_fire_overlap(const EntityHandle volume,
+                             const double ray_start[3], const double ray_dir[3],
+                             EntityHandle& next_surf, double& next_surf_dist,
+                             RayHistory* history, double dist_limit,
+                             int ray_orientation, double time);
+
+  /** add a hit returned by ray_fire to a history */
+  void record_hit(RayHistory& history, const EntityHandle volume, int geom, int prim,
+                  const double normal[3], const double uv[2]);
+
+  /** the facets of a history that belong to a volume, as (geomID, primID) pairs */
+  void history_prims(const EntityHandle volume, const RayHistory& history,
+                     std::vector<unsigned>& prims);
+
   /**\brief pass the ray_intersection test to the solid modeling engine
    *
    * The user has the options to specify that ray tracing should ultimately occur on the
@@ -457,6 +842,41 @@ public:
   /** attempt to set useCAD, first checking for availability */
   void set_use_CAD( bool use_cad );
 
+  /** retrieve the volume grid resolution (0 if there is no grid) */
+  int volume_grid_resolution() {return volGridResolution;}
+  /** retrieve the volume grid memory budget in bytes */
+  size_t volume_grid_memory() {return volGridMaxBytes;}
+
+  /** Set the volume grid used by find_volume: resolution cells along the
+   *  longest side of the model, or fewer if the cells would need more than
+   *  max_bytes.  A resolution of 0 disables the grid.  Takes effect at the
+   *  next init_OBBTree or build_volume_grid.
+   */
+  void set_volume_grid( int resolution, size_t max_bytes = 64*1024*1024 );
+
+  /** Move a volume (e.g. a shutter or pulsed target) linearly over the motion
+   *  interval, from its position in the file at the start to that plus
+   *  displacement at the end, so that one build serves a time-dependent run.
+   *  The surfaces it shares with other volumes move with it.  ray_fire,
+   *  point_in_volume and find_volume place it by their time argument and
+   *  ray_fire_batch by the time of each ray (0 without times); safety_distance
+   *  bounds the distance at every time, and the other queries, including
+   *  point_in_volume_slow, see it at the start.  No volume grid is built while
+   *  any volume moves.  A zero displacement stops it moving.  Takes effect at
+   *  the next init_OBBTree.
+   */
+  void set_volume_motion( int vol_id, const CartVect& displacement );
+
+  /** Share the scene of a volume with its translated copies (the default),
+   *  or give every volume a scene of its own.  Takes effect at the next
+   *  init_OBBTree.
+   */
+  void set_instancing( bool enable );
+
+  /** Set the times at the start and end of the motion (default 0 and 1);
+   *  times outside the interval see the volumes at its ends. */
+  void set_motion_interval( double start, double end );
+
   /* SECTION V: Metadata handling */
   /** Detect all the property keywords that appear in the loaded geometry
    *
@@ -537,6 +957,32 @@ public:
   ErrorCode entities_by_property( const std::string& prop, std::vector<EntityHandle>& return_list,
                                   int dimension = 0, const std::string* value = NULL );
 
+  /** As above, but return a view of the sorted handle list held in the index
+   *  built by parse_properties(), valid until parse_properties() is called again
+   */
+  ErrorCode entities_by_property( const std::string& prop, const std::vector<EntityHandle>*& return_list,
+                                  int dimension = 0, const std::string* value = NULL );
+
+  /** As get_all_prop_values, but return a view of the sorted list of values */
+  ErrorCode get_all_prop_values( const std::string& prop, const std::vector<std::string>*& return_list );
+
+  /** Parsed properties of a volume, by base-1 ordinal index
+   *
+   * Filled by parse_properties() from the canonical properties "mat", "rho",
+   * "imp", "comp", "tally", "graveyard", "spec.reflect" and "white.reflect"
+   * (where requested), so that host codes need no string lookups in their
+   * inner loops. A volume without a value has material 0 (void), density 0,
+   * importance 1 and no flags.
+   */
+  const DagmcVolData& vol_data( int index );
+  int mat_id( int index ) { return vol_data(index).mat_id; }
+  double density( int index ) { return vol_data(index).density; }
+  double importance( int index ) { return vol_data(index).importance; }
+
+  /** DagmcPropFlag bits of a surface (dimension 2) or volume (dimension 3),
+   *  by base-1 ordinal index */
+  int prop_flags( int dimension, int index );
+
   bool is_implicit_complement(EntityHandle volume);
 
   /** get the tag for the "name" of a surface == global ID */
@@ -566,6 +1012,10 @@ private:
   /** Convert a property tag's value on a handle to a list of strings */
   ErrorCode unpack_packed_string( Tag tag, EntityHandle eh,
                                   std::vector< std::string >& values );
+  /** Fill volData and surfFlags from the property tags */
+  ErrorCode build_property_tables();
+  /** Fill propIndex from the property tags */
+  ErrorCode build_property_index();
 
   std::vector<EntityHandle>& surf_handles() {return entHandles[2];}
   std::vector<EntityHandle>& vol_handles() {return entHandles[3];}
@@ -598,6 +1048,10 @@ public:
 private:
 
   DagMC(Interface *mb_impl, OrientedBoxTreeTool::Settings *settings = 0);
+  // the winding trees, safety grids and Embree instance are owned by the
+  // one instance, which is never copied
+  DagMC(const DagMC&);
+  DagMC& operator=(const DagMC&);
 
   static void create_instance(Interface *mb_impl = NULL, OrientedBoxTreeTool::Settings *settings = 0);
 
@@ -629,6 +1083,19 @@ private:
   static const std::map<std::string,std::string> no_synonyms;
   // a map from the canonical property names to the tags representing them
   std::map<std::string, Tag> property_tagmap;
+  // parsed volume properties and surface flags, indexed like vol_handles()
+  // and surf_handles()
+  std::vector<DagmcVolData> volData;
+  std::vector<int> surfFlags;
+
+  // inverted index of a property: its values and the sorted handles of the
+  // geometric sets carrying it, keyed by dimension (0 for any) and value
+  struct prop_index {
+    std::vector<std::string> values;
+    std::map<int, std::vector<EntityHandle> > entities;
+    std::map<std::pair<int, std::string>, std::vector<EntityHandle> > entities_by_value;
+  };
+  std::map<std::string, prop_index> propIndex;
 
   char implComplName[NAME_TAG_SIZE];
 
@@ -636,6 +1103,43 @@ private:
   double numericalPrecision;
   double facetingTolerance, defaultFacetingTolerance;
   bool useCAD;         /// true if user requested CAD-based ray firing
+  int volGridResolution;  /// cells along the longest side of the volume grid, 0 for no grid
+  size_t volGridMaxBytes; /// memory budget of the volume grid cells
+  bool instancing; /// whether translated copies of a volume share its scene
+  std::map<int,int> volOwners; /// owning rank of each volume, by ID, for domain decomposition
+  bool meshReleased; /// set by release_mesh
+  std::vector<double> volMeasures, areaMeasures; /// kept by release_mesh, by base-1 index
+  std::map<int, CartVect> volMotions; /// displacement of each moving volume over the motion interval, by ID
+  std::map<EntityHandle, CartVect> surfMotions; /// the moving surfaces, as built by init_OBBTree
+  double motionStart, motionEnd; /// the motion interval
+  NumaTopology numaTopology;
+  std::vector<rtc*> numaReplicas; /// copy of the scenes on each NUMA node, empty for a single copy
+  unsigned long serialNumber; /// tells this DagMC's variant of each thread apart from other DagMCs'
+  std::mutex variantMutex; /// guards variantUsers
+  std::map<rtc*, int> variantUsers; /// the threads using each variant of this DagMC
+
+  /** reports that query needs the mesh freed by release_mesh */
+  ErrorCode need_mesh( const char* query );
+
+  /** the scenes the calling thread's queries fire at: its variant, the
+      copy on its NUMA node or RTC */
+  rtc* query_scenes();
+
+  /** the variant the calling thread uses in this DagMC, NULL for none */
+  rtc* thread_variant();
+
+  /** builds the copy of the scenes on node, run on a thread of its own */
+  void build_replica( int node, rtc** replica );
+
+  /** the Embree ray time of a time in the motion interval */
+  float embree_time( double time );
+
+  // volume grid: each cell holds a volume index (> 0), the negated offset in
+  // volGridLists of a 0 terminated list of candidate volume indices (< 0), or
+  // 0 if no volume contains it
+  double volGridOrigin[3], volGridCellSize;
+  int volGridDims[3];
+  std::vector<int> volGridCells, volGridLists;
   bool have_cgm_geom;  /// true if CGM contains problem geometry; required for CAD-based ray firing.
 
   // temporary storage so functions don't have to reallocate vectors
@@ -671,6 +1175,23 @@ inline int DagMC::index_by_handle( EntityHandle handle )
   return entIndices[handle-setOffset];
 }
 
+inline const DagmcVolData& DagMC::vol_data( int index )
+{
+  assert((unsigned) index < volData.size());
+  return volData[index];
+}
+
+inline int DagMC::prop_flags( int dimension, int index )
+{
+  assert(2 <= dimension && 3 >= dimension);
+  if (3 == dimension) {
+    assert((unsigned) index < volData.size());
+    return volData[index].flags;
+  }
+  assert((unsigned) index < surfFlags.size());
+  return surfFlags[index];
+}
+
 inline int DagMC::num_entities( int dimension )
 {
   assert(0 <= dimension && 3 >= dimension);
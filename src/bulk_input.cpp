@@ -0,0 +1,130 @@
+#include "bulk_input.hpp"
+
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+BulkInput::BulkInput() : map(NULL), map_size(0), data(NULL), num_rows(0), width(0) {}
+
+BulkInput::~BulkInput()
+{
+  close();
+}
+
+void BulkInput::close()
+{
+  if ( map )
+    munmap( map, map_size );
+  map = NULL;
+  map_size = 0;
+  data = NULL;
+  num_rows = 0;
+  parsed.clear();
+}
+
+bool BulkInput::open(const char *filename, unsigned width_in, unsigned min_width)
+{
+  close();
+  width = width_in;
+
+  int fd = ::open( filename, O_RDONLY );
+  struct stat st;
+  if ( fd < 0 || fstat( fd, &st ) )
+    {
+      if ( fd >= 0 )
+	::close( fd );
+      std::cerr << "Failed to open '" << filename << "'" << std::endl;
+      return false;
+    }
+  if ( 0 == st.st_size )
+    {
+      ::close( fd );
+      return true;
+    }
+
+  map_size = st.st_size;
+  map = mmap( NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  ::close( fd );
+  if ( MAP_FAILED == map )
+    {
+      map = NULL;
+      std::cerr << "Failed to map '" << filename << "'" << std::endl;
+      return false;
+    }
+  madvise( map, map_size, MADV_SEQUENTIAL );
+
+  size_t len = strlen( filename );
+  if ( len > 4 && ( 0 == strcmp( filename+len-4, ".csv" ) || 0 == strcmp( filename+len-4, ".txt" ) ) )
+    {
+      bool ok = parse_text( static_cast<const char*>(map), map_size, min_width );
+      munmap( map, map_size );
+      map = NULL;
+      if ( !ok )
+	{
+	  std::cerr << "Failed to parse '" << filename << "'" << std::endl;
+	  parsed.clear();
+	  return false;
+	}
+      data = parsed.empty() ? NULL : &parsed[0];
+      num_rows = parsed.size() / width;
+      return true;
+    }
+
+  if ( 0 != map_size % ( width*sizeof(double) ) )
+    {
+      std::cerr << "'" << filename << "' is not a whole number of rows of "
+		<< width << " doubles" << std::endl;
+      close();
+      return false;
+    }
+  data = static_cast<const double*>(map);
+  num_rows = map_size / ( width*sizeof(double) );
+  return true;
+}
+
+bool BulkInput::parse_text(const char *text, size_t length, unsigned min_width)
+{
+  const char *end = text + length;
+  // the mapping is not null terminated, so each value is copied out to parse it
+  char buffer[64];
+  while ( text < end )
+    {
+      const char *eol = static_cast<const char*>( memchr( text, '\n', end - text ) );
+      if ( !eol )
+	eol = end;
+
+      unsigned count = 0;
+      const char *p = text;
+      while ( p < eol )
+	{
+	  while ( p < eol && ( ',' == *p || ' ' == *p || '\t' == *p || '\r' == *p ) )
+	    p++;
+	  if ( p == eol || ( 0 == count && '#' == *p ) )
+	    break;
+	  const char *q = p;
+	  while ( q < eol && ',' != *q && ' ' != *q && '\t' != *q && '\r' != *q )
+	    q++;
+	  if ( count == width || size_t(q - p) >= sizeof(buffer) )
+	    return false;
+	  memcpy( buffer, p, q - p );
+	  buffer[q - p] = '\0';
+	  char *parse_end;
+	  parsed.push_back( strtod( buffer, &parse_end ) );
+	  if ( *parse_end )
+	    return false;
+	  count++;
+	  p = q;
+	}
+
+      if ( count > 0 && count < min_width )
+	return false;
+      if ( count > 0 )
+	parsed.resize( parsed.size() + width - count, 0.0 );
+      text = eol + 1;
+    }
+  return true;
+}
@@ -0,0 +1,41 @@
+#ifndef BULK_INPUT_HPP
+#define BULK_INPUT_HPP
+
+#include <vector>
+#include <cstddef>
+
+/* Rows of doubles (points or rays) read from a file for a batch of queries.
+
+   A file whose name ends in .csv or .txt is text with one row per line, the
+   values separated by commas or white space; lines starting with '#' are
+   skipped and rows shorter than the full width are padded with zeros.  Any
+   other file is binary: rows of native doubles, mapped into memory and used
+   in place. */
+class BulkInput {
+  public:
+  BulkInput();
+  ~BulkInput();
+
+  // reads filename as rows of width values, text rows need at least
+  // min_width; false, with a message on std::cerr, if it cannot be read
+  bool open(const char *filename, unsigned width, unsigned min_width);
+
+  size_t size() const { return num_rows; }
+  const double* row(size_t i) const { return data + i*width; }
+
+  private:
+  void *map;
+  size_t map_size;
+  const double *data;
+  size_t num_rows;
+  unsigned width;
+  std::vector<double> parsed;
+
+  bool parse_text(const char *text, size_t length, unsigned min_width);
+  void close();
+
+  BulkInput(const BulkInput&);
+  BulkInput& operator=(const BulkInput&);
+};
+
+#endif
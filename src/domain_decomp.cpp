@@ -0,0 +1,166 @@
+#include "domain_decomp.hpp"
+#include "morton.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+void partition_volumes(const std::vector<VolumeCost> &vols, int num_ranks, std::vector<int> &owners)
+{
+  owners.assign( vols.size(), 0 );
+  if ( vols.empty() || num_ranks <= 1 )
+    return;
+
+  // order the volumes along a Morton curve through the model
+  float lo[3] = { HUGE_VALF, HUGE_VALF, HUGE_VALF }, hi[3] = { -HUGE_VALF, -HUGE_VALF, -HUGE_VALF };
+  std::vector<float> centers( 3*vols.size() );
+  for ( unsigned i = 0; i < vols.size(); i++ )
+    for ( unsigned j = 0; j < 3; j++ )
+      {
+	centers[3*i+j] = float( 0.5*( vols[i].lo[j] + vols[i].hi[j] ) );
+	lo[j] = std::min( lo[j], centers[3*i+j] );
+	hi[j] = std::max( hi[j], centers[3*i+j] );
+      }
+  float size[3] = { hi[0]-lo[0], hi[1]-lo[1], hi[2]-lo[2] };
+
+  std::vector< std::pair<unsigned long long, unsigned> > keys( vols.size() );
+  double total = 0.0;
+  for ( unsigned i = 0; i < vols.size(); i++ )
+    {
+      keys[i] = std::make_pair( morton_code( &centers[3*i], lo, size ), i );
+      total += std::max( vols[i].cost, 0.0 );
+    }
+  std::sort( keys.begin(), keys.end() );
+
+  // a volume goes to the rank whose share of the total cost holds its midpoint
+  double before = 0.0;
+  for ( unsigned i = 0; i < keys.size(); i++ )
+    {
+      double cost = std::max( vols[keys[i].second].cost, 0.0 );
+      int rank = ( total > 0.0 ) ? int( ( before + 0.5*cost ) * num_ranks / total )
+				 : int( ( i * (long long)num_ranks ) / keys.size() );
+      owners[keys[i].second] = std::min( rank, num_ranks-1 );
+      before += cost;
+    }
+}
+
+void domain_volumes(const std::vector<VolumeCost> &vols, const std::vector<int> &owners,
+		    int rank, double halo, std::vector<int> &ids)
+{
+  ids.clear();
+  std::vector<const VolumeCost*> owned;
+  for ( unsigned i = 0; i < vols.size(); i++ )
+    if ( owners[i] == rank )
+      {
+	owned.push_back( &vols[i] );
+	ids.push_back( vols[i].id );
+      }
+
+  for ( unsigned i = 0; i < vols.size(); i++ )
+    {
+      if ( owners[i] == rank )
+	continue;
+      for ( unsigned k = 0; k < owned.size(); k++ )
+	{
+	  bool near = true;
+	  for ( unsigned j = 0; j < 3 && near; j++ )
+	    near = vols[i].lo[j] <= owned[k]->hi[j] + halo && vols[i].hi[j] >= owned[k]->lo[j] - halo;
+	  if ( near )
+	    {
+	      ids.push_back( vols[i].id );
+	      break;
+	    }
+	}
+    }
+}
+
+#ifdef USE_MPI
+
+static const int particle_tag = 7070;
+
+ParticleExchange::ParticleExchange(MPI_Comm comm_in, size_t record_size_in, size_t buffer_records)
+  : comm(comm_in), record_size(record_size_in),
+    buffer_bytes( record_size_in * std::max( buffer_records, size_t(1) ) )
+{
+  MPI_Comm_size( comm, &num_ranks );
+  buffers.resize( num_ranks );
+  messages_sent.assign( num_ranks, 0 );
+}
+
+ParticleExchange::~ParticleExchange()
+{
+  complete_sends( true );
+}
+
+void ParticleExchange::send(int rank, const void *record)
+{
+  std::vector<char> &buffer = buffers[rank];
+  const char *bytes = static_cast<const char*>(record);
+  buffer.insert( buffer.end(), bytes, bytes + record_size );
+  if ( buffer.size() >= buffer_bytes )
+    {
+      post( rank );
+      complete_sends( false );
+    }
+}
+
+void ParticleExchange::post(int rank)
+{
+  if ( buffers[rank].empty() )
+    return;
+  // the buffer must outlive the send, so it moves to in_flight
+  in_flight.push_back( std::vector<char>() );
+  in_flight.back().swap( buffers[rank] );
+  requests.push_back( MPI_REQUEST_NULL );
+  MPI_Isend( &in_flight.back()[0], int(in_flight.back().size()), MPI_BYTE, rank,
+	     particle_tag, comm, &requests.back() );
+  messages_sent[rank]++;
+}
+
+void ParticleExchange::complete_sends(bool wait)
+{
+  if ( requests.empty() )
+    return;
+  if ( wait )
+    MPI_Waitall( int(requests.size()), &requests[0], MPI_STATUSES_IGNORE );
+  else
+    {
+      int done;
+      MPI_Testall( int(requests.size()), &requests[0], &done, MPI_STATUSES_IGNORE );
+      if ( !done )
+	return;
+    }
+  requests.clear();
+  in_flight.clear();
+}
+
+long long ParticleExchange::exchange(std::vector<char> &received)
+{
+  for ( int rank = 0; rank < num_ranks; rank++ )
+    post( rank );
+
+  // each rank learns how many messages to expect from every other
+  std::vector<int> messages_expected( num_ranks );
+  MPI_Alltoall( &messages_sent[0], 1, MPI_INT, &messages_expected[0], 1, MPI_INT, comm );
+  std::fill( messages_sent.begin(), messages_sent.end(), 0 );
+
+  long long num_received = 0;
+  for ( int rank = 0; rank < num_ranks; rank++ )
+    for ( int m = 0; m < messages_expected[rank]; m++ )
+      {
+	MPI_Status status;
+	int bytes;
+	MPI_Probe( rank, particle_tag, comm, &status );
+	MPI_Get_count( &status, MPI_BYTE, &bytes );
+	size_t start = received.size();
+	received.resize( start + bytes );
+	MPI_Recv( &received[start], bytes, MPI_BYTE, rank, particle_tag, comm, MPI_STATUS_IGNORE );
+	num_received += bytes / record_size;
+      }
+  complete_sends( true );
+
+  long long total = 0;
+  MPI_Allreduce( &num_received, &total, 1, MPI_LONG_LONG, MPI_SUM, comm );
+  return total;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef DOMAIN_DECOMP_HPP
+#define DOMAIN_DECOMP_HPP
+
+#include <vector>
+#include <cstddef>
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+/* Spatial domain decomposition of a model's volumes over MPI ranks.
+
+   Volumes are ordered along a Morton curve through the centers of their
+   bounding boxes and the curve is cut into one piece per rank of nearly
+   equal total cost, so that each rank owns a compact region. A rank then
+   loads its volumes and a halo around them with DagMC::load_volumes, and
+   hands particles leaving its domain to their owners with ParticleExchange. */
+
+// estimated tracking cost of a volume; DagMC::volume_costs sets cost to the
+// triangle count, which may be scaled by e.g. measured ray fire times
+struct VolumeCost {
+  int id;
+  double cost;
+  double lo[3], hi[3]; // bounding box
+};
+
+// assigns each of vols (in order) to one of num_ranks ranks
+void partition_volumes(const std::vector<VolumeCost> &vols, int num_ranks, std::vector<int> &owners);
+
+// IDs of the volumes owned by rank, followed by those of the other volumes
+// whose bounding boxes come within halo of an owned volume's box
+void domain_volumes(const std::vector<VolumeCost> &vols, const std::vector<int> &owners,
+		    int rank, double halo, std::vector<int> &ids);
+
+#ifdef USE_MPI
+/* Buffered, non-blocking hand-off of fixed size particle records between ranks.
+
+   send() only copies a record into its destination's buffer; a full buffer
+   is sent at once with MPI_Isend. exchange() is collective: it sends what is
+   left, receives every record sent to this rank since the previous exchange
+   and returns how many records were exchanged by all ranks together, so the
+   transport loop ends once that is 0 and no rank has particles left. */
+class ParticleExchange {
+  public:
+  ParticleExchange(MPI_Comm comm, size_t record_size, size_t buffer_records = 4096);
+  ~ParticleExchange();
+
+  void send(int rank, const void *record);
+  // appends the records received to received
+  long long exchange(std::vector<char> &received);
+
+  private:
+  MPI_Comm comm;
+  int num_ranks;
+  size_t record_size, buffer_bytes;
+  std::vector< std::vector<char> > buffers;          // being filled, by destination
+  std::vector<int> messages_sent;                    // since the last exchange, by destination
+  std::vector< std::vector<char> > in_flight;        // posted, until their sends complete
+  std::vector<MPI_Request> requests;
+
+  void post(int rank);
+  void complete_sends(bool wait);
+
+  ParticleExchange(const ParticleExchange&);
+  ParticleExchange& operator=(const ParticleExchange&);
+};
+#endif
+
+#endif
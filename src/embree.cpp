@@ -1,9 +1,95 @@
 #include "embree.hpp"
+#include "morton.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <mutex>
+
+rtc::rtc() : g_scene(NULL), g_scene_ready(false), base(NULL), replica(false), use_clock(0), device(NULL),
+	     cache_bytes(0), cache_peak_bytes(0), cache_hits(0), cache_misses(0),
+	     spatial_order(false), packets(false), scene_budget(0)
+{
+  memset( &cache_stats, 0, sizeof(cache_stats) );
+}
+
+rtc::~rtc()
+{
+  for ( unsigned int i = 0; i < owned.size(); i++ )
+    if ( owned[i] && scenes[i] )
+      rtcDeleteScene(scenes[i]);
+}
+
+/* memory allocated by Embree for the scenes of the rtc owner's cache */
+bool rtc::count_memory(void* owner, const ssize_t bytes, const bool /* post */)
+{
+  rtc *cache = (rtc*) owner;
+  long long now = ( cache->cache_bytes += bytes );
+  long long peak = cache->cache_peak_bytes.load();
+  while ( now > peak && !cache->cache_peak_bytes.compare_exchange_weak( peak, now ) )
+    ;
+  // allocations are never refused, the budget is enforced by evicting scenes
+  return true;
+}
+
+/* the scene of a volume (or the global scene for an index of -1), built and
+   kept from eviction for the lifetime of a query */
+class rtc::SceneUse {
+  public:
+  SceneUse(rtc *owner_in, long index_in) : owner(owner_in), index(index_in)
+  { scene = ( index < 0 ) ? owner->g_scene : owner->acquire_scene(index); }
+  ~SceneUse() { if ( index >= 0 ) owner->release_scene(index); }
+  RTCScene scene;
+
+  private:
+  rtc *owner;
+  long index;
+};
+
+/* sorts the indices 0..n-1 by Morton code */
+static void morton_order(const std::vector<Vertex> &points, std::vector<unsigned> &order)
+{
+  float lo[3] = { HUGE_VALF, HUGE_VALF, HUGE_VALF }, hi[3] = { -HUGE_VALF, -HUGE_VALF, -HUGE_VALF };
+  for ( unsigned int i = 0; i < points.size(); i++ )
+    {
+      const float *p = &points[i].x;
+      for ( unsigned int j = 0; j < 3; j++ )
+	{
+	  lo[j] = std::min( lo[j], p[j] );
+	  hi[j] = std::max( hi[j], p[j] );
+	}
+    }
+  float size[3] = { hi[0]-lo[0], hi[1]-lo[1], hi[2]-lo[2] };
+
+  std::vector< std::pair<unsigned long long, unsigned> > keys(points.size());
+  for ( unsigned int i = 0; i < points.size(); i++ )
+    keys[i] = std::make_pair( morton_code(&points[i].x, lo, size), i );
+  std::sort( keys.begin(), keys.end() );
+
+  order.resize(points.size());
+  for ( unsigned int i = 0; i < points.size(); i++ )
+    order[i] = keys[i].second;
+}
 
 void rtc::init()
 {
   /* initialize ray tracing core */
   rtcInit(NULL);
+  if ( scene_budget && !device )
+    {
+      device = rtcNewDevice(NULL);
+      rtcDeviceSetMemoryMonitorFunction2(device, &rtc::count_memory, this);
+    }
+}
+
+/* a scene on the device of this rtc's cache (or its base's), if it has one */
+RTCScene rtc::new_scene()
+{
+  RTCDevice scene_device = base ? base->device : device;
+  if ( scene_device )
+    return rtcDeviceNewScene(scene_device,RTC_SCENE_ROBUST,algorithm_flags());
+  return rtcNewScene(RTC_SCENE_ROBUST,algorithm_flags());
 }
 
 
@@ -20,26 +106,116 @@ double dot_prod( RTCRay &ray )
 
 
 
+static bool skip_hit( const RTCRayRIS &ray )
+{
+  for ( unsigned i = 0; i < ray.num_skip; i++ )
+    if ( ray.skip[2*i] == ray.geomID &&
+	 ( ray.skip[2*i+1] == ray.primID || fabs(double(ray.tfar) - ray.split) <= ray.skip_tol ) )
+      return true;
+
+  return false;
+}
+
 void intersectionFilter(void* ptr, RTCRay2 &ray) 
 {
 
   switch(ray.rf_type) 
     {
-    case 0: //if this is a typical ray_fire, check the dot_product
-      if ( 0 > dot_prod(ray) )
+    case 0: //if this is a typical ray_fire, check the dot_product against the requested orientation
+      if ( 0 > ray.orientation*dot_prod(ray) )
 	ray.geomID = RTC_INVALID_GEOMETRY_ID;
       break;
     case 1: //if this is a point_in_vol fire, do nothing
       break;
+    case 2: //if collecting all hits, record this one and reject it so that the traversal continues
+      if ( 0 <= ray.orientation*dot_prod(ray) )
+	{
+	  RTCRayHits &hits_ray = static_cast<RTCRayHits&>(ray);
+	  if ( hits_ray.num_hits < hits_ray.max_hits )
+	    {
+	      RayHit &hit = hits_ray.hits[hits_ray.num_hits];
+	      hit.dist = ray.tfar;
+	      hit.surf = ray.geomID;
+	      hit.prim = ray.primID;
+	      hit.exit = 0 < dot_prod(ray);
+	    }
+	  hits_ray.num_hits++;
+	}
+      ray.geomID = RTC_INVALID_GEOMETRY_ID;
+      break;
+    case 3: //if this is a bidirectional query, keep the nearest hit behind the split point aside
+      {
+	if ( 0 > ray.orientation*dot_prod(ray) )
+	  {
+	    ray.geomID = RTC_INVALID_GEOMETRY_ID;
+	    break;
+	  }
+	RTCRayRIS &ris_ray = static_cast<RTCRayRIS&>(ray);
+	//facets already crossed by this track are never hit again
+	if ( skip_hit(ris_ray) )
+	  {
+	    ray.geomID = RTC_INVALID_GEOMETRY_ID;
+	    break;
+	  }
+	if ( double(ray.tfar) < ris_ray.split )
+	  {
+	    // the nearest hit behind the origin is the one with the largest t
+	    if ( ray.tfar >= ris_ray.behind_dist )
+	      {
+		ris_ray.behind_dist = ray.tfar;
+		ris_ray.behind_geomID = ray.geomID;
+		ris_ray.behind_primID = ray.primID;
+		memcpy(ris_ray.behind_Ng,ray.Ng,3*sizeof(float));
+		ris_ray.behind_u = ray.u;
+		ris_ray.behind_v = ray.v;
+	      }
+	    ray.geomID = RTC_INVALID_GEOMETRY_ID;
+	  }
+	// hits at or beyond the split are accepted, pruning the rest of the traversal
+      }
+      break;
     }
 
 }
 
+/* packet version of the RF case of intersectionFilter */
+void intersectionFilter8(const void* valid_ptr, void* ptr, RTCRay8 &ray)
+{
+  const int *valid = (const int*)valid_ptr;
+  const int orientation = static_cast<RTCRay8Oriented&>(ray).orientation;
+  for ( unsigned int i = 0; i < 8; i++ )
+    {
+      if ( !valid[i] )
+	continue;
+      float dot = ray.dirx[i]*ray.Ngx[i] + ray.diry[i]*ray.Ngy[i] + ray.dirz[i]*ray.Ngz[i];
+      if ( 0 > orientation*dot )
+	ray.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+    }
+}
+
 void rtc::set_offset(moab::Range &vols) {
 
   sceneOffset = *vols.begin();
   std::cout << "Scene offset: " << sceneOffset << std::endl;
   scenes.resize(vols.back()-sceneOffset+1);
+  prim_orders.assign(scenes.size(), std::vector<PrimOrder>());
+  order_scene.resize(scenes.size());
+  for ( unsigned int i = 0; i < order_scene.size(); i++ )
+    order_scene[i] = i;
+  scene_tris.assign(scenes.size(), std::vector< std::vector<Triangle> >());
+  instance_of.assign(scenes.size(), -1);
+  instance_offsets.resize(scenes.size());
+  scene_instances.assign(scenes.size(), std::vector<unsigned>());
+  resident.reset(new std::atomic<bool>[scenes.size()]);
+  scene_pins.reset(new std::atomic<int>[scenes.size()]);
+  last_use.reset(new std::atomic<unsigned long long>[scenes.size()]);
+  for ( unsigned int i = 0; i < scenes.size(); i++ )
+    {
+      resident[i] = false;
+      scene_pins[i] = 0;
+      last_use[i] = 0;
+    }
+  owned.assign(scenes.size(), false);
   std::cout << "Size of scenes: " << scenes.size() << std::endl;
   
 }
@@ -47,36 +223,372 @@ void rtc::set_offset(moab::Range &vols) {
 void rtc::create_scene(moab::EntityHandle vol)
 {
   /* create scene */
-  scenes[vol-sceneOffset] = rtcNewScene(RTC_SCENE_ROBUST,RTC_INTERSECT1);
+  unsigned index = vol-sceneOffset;
+  scenes[index] = new_scene();
+
+  // a variant's rebuilt volume replaces the base's scene (or instance)
+  if ( base )
+    {
+      owned[index] = true;
+      instance_of[index] = -1;
+      order_scene[index] = index;
+    }
 }
 
 void rtc::commit_scene(moab::EntityHandle vol)
 {
   /* commit the scene */
-  rtcCommit (scenes[vol-sceneOffset]);
+  commit(scenes[vol-sceneOffset]);
+
+  if ( scene_budget )
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      unsigned index = vol-sceneOffset;
+      last_use[index] = ++use_clock;
+      resident[index] = true;
+      enforce_budget();
+    }
 }
  
+/* the prototype's geometries keep their IDs inside the instance, so hits
+   report the same geomID and primID they would in the prototype's scene.
+   Only translations are used, which leave ray directions, normals and hit
+   distances unchanged for the intersection filter. */
+void rtc::create_instance(moab::EntityHandle vol, moab::EntityHandle prototype, const double offset[3])
+{
+  unsigned index = vol-sceneOffset, proto = prototype-sceneOffset;
+  instance_of[index] = proto;
+  for ( unsigned int i = 0; i < 3; i++ )
+    instance_offsets[index][i] = float(offset[i]);
+  order_scene[index] = order_scene[proto];
+
+  if ( !scene_budget )
+    {
+      build_instance(index);
+      return;
+    }
+
+  // the prototype may have been evicted since it was built
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  scene_instances[proto].push_back(index);
+  make_resident(proto);
+  build_instance(index);
+  resident[index] = true;
+  enforce_budget();
+}
+
+void rtc::build_instance(unsigned index)
+{
+  scenes[index] = new_instance_scene(scenes[instance_of[index]], &instance_offsets[index][0]);
+}
+
+/* a committed scene holding the prototype scene translated by offset */
+RTCScene rtc::new_instance_scene(RTCScene prototype, const float offset[3])
+{
+  RTCScene scene = new_scene();
+  unsigned int inst = rtcNewInstance(scene, prototype);
+
+  const float xfm[12] = { 1.0f, 0.0f, 0.0f, offset[0],
+			  0.0f, 1.0f, 0.0f, offset[1],
+			  0.0f, 0.0f, 1.0f, offset[2] };
+  rtcSetTransform(scene, inst, RTC_MATRIX_ROW_MAJOR, xfm);
+
+  commit(scene);
+  return scene;
+}
+
+/* builds a scene; a replica's only on the calling thread, which Embree's
+   worker threads would otherwise share, placing parts of it on other nodes */
+void rtc::commit(RTCScene scene)
+{
+  if ( replica )
+    rtcCommitThread(scene, 0, 1);
+  else
+    rtcCommit(scene);
+}
+
+/* the scene handles and per-volume tables are copied, which costs a few
+   words per volume; the BVHs, index and vertex buffers stay the base's */
+rtc* rtc::create_variant()
+{
+  if ( base || scene_budget )
+    {
+      std::cout << "Variants need a base keeping all of its scenes." << std::endl;
+      return NULL;
+    }
+
+  rtc *variant = new rtc();
+  variant->base = this;
+  variant->sceneOffset = sceneOffset;
+  variant->scenes = scenes;
+  variant->order_scene = order_scene;
+  variant->instance_of = instance_of;
+  variant->instance_offsets = instance_offsets;
+  variant->prim_orders.assign(scenes.size(), std::vector<PrimOrder>());
+  variant->owned.assign(scenes.size(), false);
+  variant->spatial_order = spatial_order;
+  variant->packets = packets;
+  variant->vertex_buffer_ptr = vertex_buffer_ptr;
+  variant->vertex_buffer_size = vertex_buffer_size;
+  variant->ray_fire_type = ray_fire_type;
+  return variant;
+}
+
+rtc* rtc::create_replica()
+{
+  if ( base || scene_budget )
+    {
+      std::cout << "Replicas need a base keeping all of its scenes." << std::endl;
+      return NULL;
+    }
+
+  rtc *copy = new rtc();
+  copy->base = this;
+  copy->replica = true;
+  copy->sceneOffset = sceneOffset;
+  copy->scenes.assign(scenes.size(), NULL);
+  copy->order_scene = order_scene;
+  copy->instance_of = instance_of;
+  copy->instance_offsets = instance_offsets;
+  copy->prim_orders.assign(scenes.size(), std::vector<PrimOrder>());
+  copy->owned.assign(scenes.size(), false);
+  copy->spatial_order = spatial_order;
+  copy->packets = packets;
+  copy->ray_fire_type = ray_fire_type;
+
+  // written by this thread, so allocated on its node
+  copy->vertices = vertices;
+  copy->vertex_buffer_ptr = copy->vertices.empty() ? NULL : (void*) &(copy->vertices[0]);
+  copy->vertex_buffer_size = vertex_buffer_size;
+  return copy;
+}
+
+/* the instance scenes of a replica, once their prototypes are committed */
+void rtc::build_instances()
+{
+  for ( unsigned int i = 0; i < scenes.size(); i++ )
+    if ( instance_of[i] >= 0 )
+      {
+	build_instance(i);
+	owned[i] = true;
+      }
+}
+
+/* the volume becomes an instance of the base's scene translated by offset.
+   Embree instances cannot be nested, so an instance in the base is moved by
+   instancing its prototype instead. */
+void rtc::move_volume(moab::EntityHandle vol, const double offset[3])
+{
+  unsigned index = vol-sceneOffset;
+  int proto = base->instance_of[index];
+  float shift[3];
+  for ( unsigned int i = 0; i < 3; i++ )
+    shift[i] = float(offset[i]) + ( proto >= 0 ? base->instance_offsets[index][i] : 0.0f );
+
+  if ( owned[index] )
+    rtcDeleteScene(scenes[index]);
+  scenes[index] = new_instance_scene(base->scenes[proto >= 0 ? proto : index], shift);
+  owned[index] = true;
+}
+
+/* the scene of the volume with the given index, rebuilt if it was evicted
+   and pinned until release_scene. A query pins its scenes before checking
+   that they are built, and evict_scene marks a scene unbuilt before checking
+   its pins, so a scene found built is not deleted and hits take no lock. */
+RTCScene rtc::acquire_scene(unsigned index)
+{
+  if ( !scene_budget )
+    return scenes[index];
+
+  int proto = instance_of[index];
+  scene_pins[index]++;
+  if ( proto >= 0 )
+    scene_pins[proto]++;
+  last_use[proto >= 0 ? proto : index] = ++use_clock;
+  if ( resident[index] && ( proto < 0 || resident[proto] ) )
+    {
+      cache_hits++;
+      return scenes[index];
+    }
+
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  cache_misses++;
+  make_resident(index);
+  enforce_budget();
+  return scenes[index];
+}
+
+void rtc::release_scene(unsigned index)
+{
+  if ( !scene_budget )
+    return;
+
+  scene_pins[index]--;
+  if ( instance_of[index] >= 0 )
+    scene_pins[instance_of[index]]--;
+}
+
+/* rebuilds the scene from its retained triangles if needed (with its
+   prototype, for an instance); cache_mutex must be held */
+void rtc::make_resident(unsigned index)
+{
+  int proto = instance_of[index];
+  if ( proto >= 0 )
+    {
+      make_resident(proto);
+      if ( !resident[index] )
+	{
+	  build_instance(index);
+	  resident[index] = true;
+	  cache_stats.rebuilds++;
+	}
+      return;
+    }
+
+  if ( resident[index] )
+    return;
+
+  RTCScene scene = new_scene();
+  std::vector<PrimOrder> orders;
+  const std::vector< std::vector<Triangle> > &meshes = scene_tris[index];
+  for ( unsigned int g = 0; g < meshes.size(); g++ )
+    {
+      unsigned int mesh = new_mesh(scene, meshes[g].size(), orders);
+      Triangle* triangles = (Triangle*) rtcMapBuffer(scene,mesh,RTC_INDEX_BUFFER);
+      std::copy( meshes[g].begin(), meshes[g].end(), triangles );
+      rtcUnmapBuffer(scene,mesh,RTC_INDEX_BUFFER);
+    }
+  rtcCommit(scene);
+
+  // the scene is stored before it is marked built for the queries that
+  // check without the lock
+  scenes[index] = scene;
+  last_use[index] = ++use_clock;
+  resident[index] = true;
+  cache_stats.rebuilds++;
+}
+
+/* deletes a scene and the instances of it, unless a query pinned the scene
+   while it was being marked unbuilt; cache_mutex must be held */
+bool rtc::evict_scene(unsigned index)
+{
+  const std::vector<unsigned> &instances = scene_instances[index];
+  std::vector<unsigned> built;
+  resident[index] = false;
+  for ( unsigned int i = 0; i < instances.size(); i++ )
+    if ( resident[instances[i]].exchange(false) )
+      built.push_back(instances[i]);
+
+  if ( scene_pins[index] )
+    {
+      for ( unsigned int i = 0; i < built.size(); i++ )
+	resident[built[i]] = true;
+      resident[index] = true;
+      return false;
+    }
+
+  for ( unsigned int i = 0; i < built.size(); i++ )
+    {
+      rtcDeleteScene(scenes[built[i]]);
+      scenes[built[i]] = NULL;
+    }
+  rtcDeleteScene(scenes[index]);
+  scenes[index] = NULL;
+  cache_stats.evictions++;
+  return true;
+}
+
+/* evicts the least recently used scenes not in use until Embree's memory
+   for this rtc is within the budget; cache_mutex must be held */
+void rtc::enforce_budget()
+{
+  if ( cache_bytes.load() <= (long long)scene_budget )
+    return;
+
+  std::vector< std::pair<unsigned long long, unsigned> > unused;
+  for ( unsigned int i = 0; i < scenes.size(); i++ )
+    if ( instance_of[i] < 0 && resident[i] && !scene_pins[i] )
+      unused.push_back( std::make_pair( last_use[i].load(), i ) );
+  std::sort( unused.begin(), unused.end() );
+
+  for ( unsigned int i = 0; i < unused.size() && cache_bytes.load() > (long long)scene_budget; i++ )
+    evict_scene(unused[i].second);
+}
+
+SceneCacheStats rtc::scene_cache_stats()
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  SceneCacheStats stats = cache_stats;
+  stats.hits = cache_hits.load();
+  stats.misses = cache_misses.load();
+  stats.bytes = cache_bytes.load();
+  stats.peak_bytes = cache_peak_bytes.load();
+  return stats;
+}
+
+RTCAlgorithmFlags rtc::algorithm_flags()
+{
+  return packets ? RTCAlgorithmFlags(RTC_INTERSECT1 | RTC_INTERSECT8) : RTC_INTERSECT1;
+}
+
+void rtc::create_global_scene()
+{
+  g_scene = rtcNewScene(RTC_SCENE_ROBUST,RTC_INTERSECT1);
+}
+
+void rtc::commit_global_scene()
+{
+  rtcCommit (g_scene);
+  g_scene_ready.store(true, std::memory_order_release);
+}
+
 void rtc::shutdown()
 {
   /* delete the scene */
-  rtcDeleteScene(g_scene);
+  if (g_scene) rtcDeleteScene(g_scene);
+
+  /* the cached scenes, instances first, then their device */
+  if ( device )
+    {
+      for ( int pass = 0; pass < 2; pass++ )
+	for ( unsigned int i = 0; i < scenes.size(); i++ )
+	  if ( ( instance_of[i] >= 0 ) == ( 0 == pass ) && resident[i] )
+	    {
+	      rtcDeleteScene(scenes[i]);
+	      scenes[i] = NULL;
+	      resident[i] = false;
+	    }
+      rtcDeleteDevice(device);
+      device = NULL;
+    }
 
   /* done with ray tracing */
   rtcExit();
 }
 
-void rtc::create_vertex_map(moab::Interface* MBI)
+void rtc::create_vertex_map(moab::Interface* MBI, const moab::Range* verts)
 {
   
   std::vector<moab::EntityHandle> all_verts;
-  //use the moab interface to get all vertices in the mesh 
-  moab::ErrorCode rval = MBI->get_entities_by_type(0, moab::MBVERTEX, all_verts, true);
+  moab::ErrorCode rval = moab::MB_SUCCESS;
+  if ( verts )
+    all_verts.assign(verts->begin(), verts->end());
+  else
+    //use the moab interface to get all vertices in the mesh 
+    rval = MBI->get_entities_by_type(0, moab::MBVERTEX, all_verts, true);
   if (moab::MB_SUCCESS != rval ) 
     std::cout << "Error getting the mesh vertices for the global map." << std::endl;
 
   //now create a structure with enough room for all verts in the mesh
   int num_verts = all_verts.size();
 
+  // the global scene of an earlier mesh uses the old vertex buffer
+  g_scene_ready = false;
+  if (g_scene) rtcDeleteScene(g_scene);
+  g_scene = NULL;
+  g_prim_orders.clear();
+  // an earlier mesh's handles may be reused by this one
+  global_vertex_map.clear();
   vertices.resize(num_verts);
 
   //now populate the structure
@@ -87,7 +599,8 @@ void rtc::create_vertex_map(moab::Interface* MBI)
   //std::cout << "adding " << vert_eh.size() << " vertices to Embree" << std::endl;
   // convert the vertices to embree's format 
   double *coordinates = new double[3*all_verts.size()];
-  rval = MBI->get_coords(&(all_verts[0]), (int)all_verts.size(),coordinates);
+  if ( num_verts )
+    rval = MBI->get_coords(&(all_verts[0]), (int)all_verts.size(),coordinates);
 
   int index;
   for ( vert_it = all_verts.begin() ; vert_it != all_verts.end() ; vert_it++ )
@@ -115,30 +628,138 @@ void rtc::create_vertex_map(moab::Interface* MBI)
     }
   delete[] coordinates;
 
+  //store the vertices along a Morton curve, so that neighbours share cache lines
+  if ( spatial_order && num_verts )
+    {
+      std::vector<unsigned> order;
+      morton_order(vertices, order);
+      std::vector<Vertex> sorted(num_verts);
+      std::vector<int> new_index(num_verts);
+      for ( int i = 0; i < num_verts; i++ )
+	{
+	  sorted[i] = vertices[order[i]];
+	  new_index[order[i]] = i;
+	}
+      vertices.swap(sorted);
+      for ( int i = 0; i < num_verts; i++ )
+	global_vertex_map[all_verts[i]] = new_index[i];
+    }
+
   //now set the buffer pointer and size
-  vertex_buffer_ptr = (void*) &(vertices[0]);
+  vertex_buffer_ptr = num_verts ? (void*) &(vertices[0]) : NULL;
   vertex_buffer_size = num_verts;
   
 }
 
 /* adds moab range to triangles to the ray tracer */
-void rtc::add_triangles(moab::Interface* MBI, moab::EntityHandle vol, moab::Range triangles_eh, int sense)
+void rtc::add_triangles(moab::Interface* MBI, moab::EntityHandle vol, moab::Range triangles_eh, int sense,
+			const double offset[3], const double motion[3])
 {
-  moab::ErrorCode rval;
+  bool own_verts = add_triangles_to_scene(scenes[vol-sceneOffset], MBI, triangles_eh, sense, prim_orders[vol-sceneOffset],
+					  scene_budget ? &scene_tris[vol-sceneOffset] : NULL, offset, motion);
 
-  int num_tris = triangles_eh.size();
+  // the retained triangles index the shared vertex buffer, so a scene with
+  // moving or copied vertices is never evicted
+  if ( own_verts && scene_budget )
+    scene_pins[vol-sceneOffset] = 1;
+}
 
-  /* make the mesh */
-  unsigned int mesh = rtcNewTriangleMesh(scenes[vol-sceneOffset],RTC_GEOMETRY_STATIC,num_tris,vertex_buffer_size);
+/* adds a surface's triangles to the global scene, in the surface's forward sense */
+void rtc::add_global_triangles(moab::Interface* MBI, moab::Range triangles_eh)
+{
+  add_triangles_to_scene(g_scene, MBI, triangles_eh, 1, g_prim_orders);
+}
+
+/* makes a triangle mesh sharing the vertex buffer (or using num_verts of
+   verts if given), with the intersection filters. With end_verts, the mesh
+   moves linearly from verts at time 0 to end_verts at time 1. */
+unsigned rtc::new_mesh(RTCScene scene, unsigned num_tris, std::vector<PrimOrder> &orders,
+		       const Vertex *verts, unsigned num_verts, const Vertex *end_verts)
+{
+  if ( !num_verts )
+    {
+      verts = (const Vertex*) vertex_buffer_ptr;
+      num_verts = vertex_buffer_size;
+    }
+  unsigned int mesh = rtcNewTriangleMesh(scene,RTC_GEOMETRY_STATIC,num_tris,num_verts,end_verts ? 2 : 1);
+  if ( orders.size() <= mesh )
+    orders.resize(mesh+1);
 
   //set the intersection filter function 
-  rtcSetIntersectionFilterFunction(scenes[vol-sceneOffset], mesh, (RTCFilterFunc)&intersectionFilter);
+  rtcSetIntersectionFilterFunction(scene, mesh, (RTCFilterFunc)&intersectionFilter);
+  if ( packets )
+    rtcSetIntersectionFilterFunction8(scene, mesh, (RTCFilterFunc8)&intersectionFilter8);
 
   // now set the vertex storage 
-  rtcSetBuffer(scenes[vol-sceneOffset],mesh,RTC_VERTEX_BUFFER, vertex_buffer_ptr, 0, sizeof(Vertex));
+  rtcSetBuffer(scene,mesh,RTC_VERTEX_BUFFER, verts, 0, sizeof(Vertex));
+  if ( end_verts )
+    rtcSetBuffer(scene,mesh,RTC_VERTEX_BUFFER1, end_verts, 0, sizeof(Vertex));
+  return mesh;
+}
+
+bool rtc::add_triangles_to_scene(RTCScene scene, moab::Interface* MBI, moab::Range &triangles_eh, int sense,
+				 std::vector<PrimOrder> &orders, std::vector< std::vector<Triangle> > *retained,
+				 const double offset[3], const double motion[3])
+{
+  moab::ErrorCode rval;
+
+  int num_tris = triangles_eh.size();
+
+  // the shared vertices (indexed as the base's in a variant or replica), or
+  // the translated vertices of these triangles alone, followed by their end
+  // positions if they move
+  const std::map<moab::EntityHandle,int> &shared_map = base ? base->global_vertex_map : global_vertex_map;
+  std::map<moab::EntityHandle,int> moved_map;
+  const Vertex *verts = (const Vertex*) vertex_buffer_ptr, *end_verts = NULL;
+  unsigned num_verts = 0;
+  // the vertices only instanced volumes use are not in the vertex buffer, so
+  // triangles with such vertices are copied in place
+  const double no_offset[3] = { 0.0, 0.0, 0.0 };
+  if ( !offset && !motion && num_tris )
+    {
+      moab::Range tri_verts;
+      rval = MBI->get_connectivity(triangles_eh, tri_verts);
+      for ( moab::Range::iterator vert_it = tri_verts.begin(); vert_it != tri_verts.end() && !offset; ++vert_it )
+	if ( !shared_map.count(*vert_it) )
+	  offset = no_offset;
+    }
+  if ( ( offset || motion ) && num_tris )
+    {
+      moab::Range tri_verts;
+      rval = MBI->get_connectivity(triangles_eh, tri_verts);
+      std::vector<double> coords(3*tri_verts.size());
+      rval = MBI->get_coords(tri_verts, &coords[0]);
+
+      const double no_shift[3] = { 0.0, 0.0, 0.0 };
+      const double *start = offset ? offset : no_shift;
+      num_verts = tri_verts.size();
+      moved_vertices.push_back(std::vector<Vertex>(( motion ? 2 : 1 ) * num_verts));
+      std::vector<Vertex> &moved = moved_vertices.back();
+      int i = 0;
+      for ( moab::Range::iterator vert_it = tri_verts.begin(); vert_it != tri_verts.end(); ++vert_it, ++i )
+	{
+	  moved[i].x = static_cast<float>(coords[3*i] + start[0]);
+	  moved[i].y = static_cast<float>(coords[3*i+1] + start[1]);
+	  moved[i].z = static_cast<float>(coords[3*i+2] + start[2]);
+	  if ( motion )
+	    {
+	      moved[num_verts+i].x = static_cast<float>(coords[3*i] + start[0] + motion[0]);
+	      moved[num_verts+i].y = static_cast<float>(coords[3*i+1] + start[1] + motion[1]);
+	      moved[num_verts+i].z = static_cast<float>(coords[3*i+2] + start[2] + motion[2]);
+	    }
+	  moved_map[*vert_it] = i;
+	}
+      verts = &moved[0];
+      if ( motion )
+	end_verts = &moved[num_verts];
+    }
+  const std::map<moab::EntityHandle,int> &vertex_map = num_verts ? moved_map : shared_map;
+
+  /* make the mesh */
+  unsigned int mesh = new_mesh(scene, num_tris, orders, verts, num_verts, end_verts);
     
   // make triangle buffer 
-  Triangle* triangles = (Triangle*) rtcMapBuffer(scenes[vol-sceneOffset],mesh,RTC_INDEX_BUFFER);
+  Triangle* triangles = (Triangle*) rtcMapBuffer(scene,mesh,RTC_INDEX_BUFFER);
 
   moab::Range::iterator tri_it;
   int triangle_idx;
@@ -160,19 +781,19 @@ void rtc::add_triangles(moab::Interface* MBI, moab::EntityHandle vol, moab::Rang
       //adjust triangle normals for the surface to volume sense
       if ( 1 == sense )
 	{
-	  triangles[triangle_idx].v0 = global_vertex_map[*it] ; 
+	  triangles[triangle_idx].v0 = vertex_map.find(*it)->second ; 
 	  ++it;
-	  triangles[triangle_idx].v2 = global_vertex_map[*it] ; 
+	  triangles[triangle_idx].v2 = vertex_map.find(*it)->second ; 
 	  ++it;
-	  triangles[triangle_idx].v1 = global_vertex_map[*it] ;
+	  triangles[triangle_idx].v1 = vertex_map.find(*it)->second ;
 	}
       else if ( -1 == sense )
 	{
-	  triangles[triangle_idx].v0 = global_vertex_map[*it] ; 
+	  triangles[triangle_idx].v0 = vertex_map.find(*it)->second ; 
 	  ++it;
-	  triangles[triangle_idx].v1 = global_vertex_map[*it] ; 
+	  triangles[triangle_idx].v1 = vertex_map.find(*it)->second ; 
 	  ++it;
-	  triangles[triangle_idx].v2 = global_vertex_map[*it] ;
+	  triangles[triangle_idx].v2 = vertex_map.find(*it)->second ;
 	}
 
       
@@ -189,28 +810,86 @@ void rtc::add_triangles(moab::Interface* MBI, moab::EntityHandle vol, moab::Rang
     }
   
 
+  //store the triangles along a Morton curve through their centroids,
+  //remembering where each one came from
+  if ( spatial_order && num_tris )
+    {
+      std::vector<Vertex> centroids(num_tris);
+      for ( int i = 0; i < num_tris; i++ )
+	{
+	  const Vertex &a = verts[triangles[i].v0], &b = verts[triangles[i].v1], &c = verts[triangles[i].v2];
+	  centroids[i].x = ( a.x + b.x + c.x ) / 3.0f;
+	  centroids[i].y = ( a.y + b.y + c.y ) / 3.0f;
+	  centroids[i].z = ( a.z + b.z + c.z ) / 3.0f;
+	}
+      PrimOrder &order = orders[mesh];
+      morton_order(centroids, order.to_moab);
+      order.to_embree.resize(num_tris);
+      std::vector<Triangle> sorted(num_tris);
+      for ( int i = 0; i < num_tris; i++ )
+	{
+	  sorted[i] = triangles[order.to_moab[i]];
+	  order.to_embree[order.to_moab[i]] = i;
+	}
+      std::copy( sorted.begin(), sorted.end(), triangles );
+    }
+
+  //keep a copy to rebuild the scene from if it is evicted
+  if ( retained )
+    {
+      if ( retained->size() <= mesh )
+	retained->resize(mesh+1);
+      (*retained)[mesh].assign( triangles, triangles+num_tris );
+    }
+
   //unmap triangle and vertex buffers 
-  rtcUnmapBuffer(scenes[vol-sceneOffset],mesh,RTC_INDEX_BUFFER);
+  rtcUnmapBuffer(scene,mesh,RTC_INDEX_BUFFER);
 
-  rtcUnmapBuffer(scenes[vol-sceneOffset],mesh,RTC_VERTEX_BUFFER);
+  rtcUnmapBuffer(scene,mesh,RTC_VERTEX_BUFFER);
 
+  return num_verts > 0;
 }
 
-bool rtc::point_in_vol(float coordinate[3], float dir[3])
+/* triangle orders of the scene fired at for a volume (0 for the global scene),
+   NULL if its triangles are in Range order */
+const std::vector<PrimOrder>* rtc::scene_orders(moab::EntityHandle volume)
 {
-  std::vector<int> surfaces;
-  std::vector<float> hits;
-  get_all_intersections(coordinate,dir,surfaces,hits);
-  int num_hits = hits.size();
-  dir[0]=-1.0*dir[0],dir[1]=-1.0*dir[1],dir[2]=-1.0*dir[2];
-  get_all_intersections(coordinate,dir,surfaces,hits);
-  if ( hits.size() == num_hits )
-    return true;
+  if ( !spatial_order )
+    return NULL;
+  if ( 0 == volume )
+    return &g_prim_orders;
+  // a variant's volumes it did not rebuild have the base's orders
+  unsigned index = order_scene[volume-sceneOffset];
+  if ( base && prim_orders[index].empty() )
+    return base->scene_orders(volume);
+  return &prim_orders[index];
+}
 
-  return false;
+/* maps an Embree primitive ID back to the triangle's position in its Range */
+static int moab_prim(const std::vector<PrimOrder> *orders, unsigned geomID, unsigned primID)
+{
+  if ( !orders || RTC_INVALID_GEOMETRY_ID == geomID || geomID >= orders->size() ||
+       (*orders)[geomID].to_moab.empty() )
+    return primID;
+  return (*orders)[geomID].to_moab[primID];
 }
 
-void rtc::ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_type filt_func, float tnear, int &em_surf, float &dist_to_hit, float norm[3])
+bool rtc::point_in_vol(float coordinate[3], float dir[3], bool &inside)
+{
+  if ( !have_global_scene() )
+    {
+      std::cerr << "rtc::point_in_vol: the global scene is not built." << std::endl;
+      return false;
+    }
+
+  // only the number of hits behind the point is needed
+  dir[0]=-1.0*dir[0],dir[1]=-1.0*dir[1],dir[2]=-1.0*dir[2];
+  unsigned num_hits = get_all_intersections(0,coordinate,dir,NULL,0);
+  inside = ( 0 == num_hits );
+  return true;
+}
+
+void rtc::ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_type filt_func, float tnear, int &em_surf, float &dist_to_hit, float norm[3], float tfar, int orientation, int *em_prim, float bary[2], float time)
 {
 
 
@@ -220,17 +899,22 @@ void rtc::ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_
   memcpy(ray.org,origin,3*sizeof(float));
   memcpy(ray.dir,dir,3*sizeof(float));
   ray.tnear = tnear;
-  ray.tfar = 1.0e38;
+  // Embree stops descending into any node beyond tfar, so a
+  // finite limit here prunes the traversal
+  ray.tfar = tfar;
   ray.geomID = RTC_INVALID_GEOMETRY_ID;
   ray.primID = RTC_INVALID_GEOMETRY_ID;
   ray.mask = -1;
-  ray.time = 0;
+  ray.time = time;
   ray.rf_type = (int)filt_func;
+  ray.orientation = orientation;
 
   /* fire the ray */
-  rtcIntersect(scenes[volume-sceneOffset],*((RTCRay*)&ray));
+  SceneUse use(this, volume-sceneOffset);
+  rtcIntersect(use.scene,*((RTCRay*)&ray));
 
   //get the critical information from the ray
+  //(if nothing is hit before tfar, dist_to_hit is returned as tfar)
   em_surf = ray.geomID;
   dist_to_hit = ray.tfar;
   
@@ -239,7 +923,10 @@ void rtc::ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_
   norm[2] = ray.Ng[2];
  
   //if we don't hit a surface, check right behind the ray to see if we're ahead of a surface
-  // (do this only for queries comeing from DagMC::ray_fire)
+  // (do this only for queries comeing from DagMC::ray_fire). Only a surface the
+  // ray has already left through counts, so that a particle which just
+  // entered and stops short of the far side within a distance limit is not
+  // sent back; limited and unlimited rays then agree.
   if (RTC_INVALID_GEOMETRY_ID == ray.geomID && rf_type::RF == filt_func) 
     { 
 
@@ -249,9 +936,10 @@ void rtc::ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_
       ray.dir[2] *= -1; 
       //set the distance to some small tolerance (1e-4) 
       ray.tfar = 1.0e-3;
-      ray.rf_type = rf_type::PIV; //to allow for hits against the normal
+      //the reversed ray meets the surface it left through against its orientation
+      ray.orientation = -orientation;
       /* fire the ray */
-      rtcIntersect(scenes[volume-sceneOffset],*((RTCRay*)&ray));
+      rtcIntersect(use.scene,*((RTCRay*)&ray));
 
       //if we get a hit, return that surface ID and a distance of zero.
       if( RTC_INVALID_GEOMETRY_ID != ray.geomID) 
@@ -272,6 +960,15 @@ void rtc::ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_
 
     }
 
+  //the triangle hit and where on it, if requested
+  if ( em_prim )
+    *em_prim = moab_prim(scene_orders(volume), ray.geomID, ray.primID);
+  if ( bary )
+    {
+      bary[0] = ray.u;
+      bary[1] = ray.v;
+    }
+
   // std::cout << "Ray's Barycentric coords: u= " << ray.u << " v= "
   // 	    << ray.v << " w = " << 1-ray.u-ray.v << std::endl;
   // std::cout << "Hit Surface " << ray.geomID << " after "				    
@@ -293,110 +990,203 @@ void rtc::ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_
   
 }
 
-void rtc::get_all_intersections(float origin[3], float dir[3], std::vector<int> &surfaces,
-			       std::vector<float> &distances)
+void rtc::ray_fire8(moab::EntityHandle volume, const int valid[8], const float org[][3], const float dir[][3],
+		    float tnear, const float tfar[8], int orientation, int surf[8], float dist[8],
+		    const float time[8])
 {
-  RTCRay ray;
-  //  ray.org = origin;
+  alignas(32) int valid8[8];
+  RTCRay8Oriented ray;
+  for ( unsigned int i = 0; i < 8; i++ )
+    {
+      valid8[i] = valid[i] ? -1 : 0;
+      // unused lanes still get finite values
+      unsigned int src = valid[i] ? i : 0;
+      ray.orgx[i] = org[src][0]; ray.orgy[i] = org[src][1]; ray.orgz[i] = org[src][2];
+      ray.dirx[i] = dir[src][0]; ray.diry[i] = dir[src][1]; ray.dirz[i] = dir[src][2];
+      ray.tnear[i] = tnear;
+      ray.tfar[i] = tfar[src];
+      ray.time[i] = time ? time[src] : 0.0f;
+      ray.mask[i] = -1;
+      ray.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+      ray.primID[i] = RTC_INVALID_GEOMETRY_ID;
+      ray.instID[i] = RTC_INVALID_GEOMETRY_ID;
+    }
+  ray.orientation = orientation;
+
+  /* fire the packet */
+  SceneUse use(this, volume-sceneOffset);
+  rtcIntersect8(valid8, use.scene, ray);
+
+  // the lanes that hit nothing look right behind their origins, as ray_fire
+  // does, for a surface they have already left through
+  alignas(32) int behind8[8];
+  RTCRay8Oriented back = ray;
+  bool any_behind = false;
+  for ( unsigned int i = 0; i < 8; i++ )
+    {
+      surf[i] = ray.geomID[i];
+      dist[i] = ray.tfar[i];
+      behind8[i] = ( valid8[i] && RTC_INVALID_GEOMETRY_ID == ray.geomID[i] ) ? -1 : 0;
+      any_behind = any_behind || behind8[i];
+      back.dirx[i] = -ray.dirx[i]; back.diry[i] = -ray.diry[i]; back.dirz[i] = -ray.dirz[i];
+      back.tfar[i] = 1.0e-3;
+    }
+  if ( !any_behind )
+    return;
+
+  //the reversed rays meet the surfaces they left through against their orientation
+  back.orientation = -orientation;
+  rtcIntersect8(behind8, use.scene, back);
+  for ( unsigned int i = 0; i < 8; i++ )
+    if ( behind8[i] && RTC_INVALID_GEOMETRY_ID != back.geomID[i] )
+      {
+	surf[i] = back.geomID[i];
+	dist[i] = 0;
+      }
+}
+
+static bool hit_dist_less(const RayHit &a, const RayHit &b)
+{
+  return a.dist < b.dist;
+}
+
+/* collects every hit along the ray in a single traversal. Hits are written
+   to the caller's buffer (up to max_hits of them) sorted by distance. The
+   return value is the total number of hits found; if it exceeds max_hits
+   the stored hits are incomplete and the query should be repeated with a
+   larger buffer. A volume of 0 fires the ray at the global scene. */
+unsigned rtc::get_all_intersections(moab::EntityHandle volume, const float origin[3], const float dir[3],
+				    RayHit* hits, unsigned max_hits, float tnear, float tfar,
+				    int orientation, float time)
+{
+  if ( 0 == volume && !have_global_scene() )
+    {
+      std::cerr << "rtc::get_all_intersections: the global scene is not built." << std::endl;
+      return 0;
+    }
+  SceneUse use(this, (0 == volume) ? -1 : long(volume-sceneOffset));
+  RTCScene scene = use.scene;
+
+  RTCRayHits ray;
   memcpy(ray.org,origin,3*sizeof(float));
   memcpy(ray.dir,dir,3*sizeof(float));
-  //  ray.dir = dir;
-  ray.tnear = 0.0f;
-  ray.tfar = 1.0e38;
+  ray.tnear = tnear;
+  ray.tfar = tfar;
   ray.geomID = RTC_INVALID_GEOMETRY_ID;
   ray.primID = RTC_INVALID_GEOMETRY_ID;
   ray.mask = -1;
-  ray.time = 0;
-  
-  while(true) {
-    /* fire the ray */
-    rtcIntersect(g_scene,ray);
+  ray.time = time;
+  ray.rf_type = rf_type::ALL;
+  ray.orientation = orientation;
+  ray.hits = hits;
+  ray.max_hits = max_hits;
+  ray.num_hits = 0;
 
-    if (ray.geomID == RTC_INVALID_GEOMETRY_ID )
-      break;
+  /* fire the ray, every hit is rejected by the filter after it is recorded */
+  rtcIntersect(scene,*((RTCRay*)&ray));
 
-    // accrue the hits
-    surfaces.push_back(ray.geomID);
-    distances.push_back(ray.tfar);
+  unsigned num_stored = std::min(ray.num_hits, max_hits);
+  std::sort(hits, hits+num_stored, hit_dist_less);
 
-    ray.tnear = 1.00001*ray.tfar;
-    ray.tfar = 1.0e38;
-    ray.geomID = RTC_INVALID_GEOMETRY_ID;
-    ray.primID = RTC_INVALID_GEOMETRY_ID;
-  }
-  return;
+  const std::vector<PrimOrder> *orders = scene_orders(volume);
+  if ( orders )
+    for ( unsigned i = 0; i < num_stored; i++ )
+      hits[i].prim = moab_prim(orders, hits[i].surf, hits[i].prim);
+
+  return ray.num_hits;
 }
 
 
+/* finds the nearest hits both ahead of and behind the ray origin in a single
+   traversal. The ray starts neg_ray_len behind the origin and the filter
+   splits its hits at the origin. Facets listed in skip as (geomID, primID)
+   pairs are ignored, as are other facets of their geometries within skip_tol
+   of the origin. */
 void rtc::psuedo_ris( moab::EntityHandle vol, 
-		      std::vector<double> &distances_out, 
-		      std::vector<int> &surfs_out, 
-		      std::vector<std::array<double, 3> > &tri_norms_out, 
+		      RISHits &hits_out,
 		      const double ray_origin[3], 
 		      const double unit_ray_dir[3], 
 		      double nonneg_ray_len, 
-		      double neg_ray_len)
+		      double neg_ray_len,
+		      int orientation,
+		      const unsigned* skip,
+		      unsigned num_skip,
+		      double skip_tol,
+		      float time)
 {
 
   //get the scene we want to fire on
-  RTCScene this_scene = scenes[vol-sceneOffset];
-  
-  //clear the given vectors and set to the correct size
-  distances_out.clear(); distances_out.resize(2);
-  surfs_out.clear(); surfs_out.resize(2);
-  tri_norms_out.clear(); tri_norms_out.resize(2);
-
-  //convert ray_origin from double to float
-  float origin[3], dir[3];
-  std::copy( ray_origin, ray_origin+3, origin );
-  std::copy( unit_ray_dir, unit_ray_dir+3, dir );
-
-  RTCRay ray;
-
-  memcpy(ray.org,origin,3*sizeof(float));
-  memcpy(ray.dir,dir,3*sizeof(float));
-
-  //fire ray in positive direction
-  ray.tnear = 0.0f;
-  ray.tfar = float(nonneg_ray_len);
-  ray.geomID = RTC_INVALID_GEOMETRY_ID;
-  ray.primID = RTC_INVALID_GEOMETRY_ID;
-  ray.mask = -1;
-  ray.time = 0;
+  SceneUse use(this, vol-sceneOffset);
+  RTCScene this_scene = use.scene;
 
-  /* fire the ray */
-  rtcIntersect(this_scene,ray);
+  //the skipped facets are given by Range position, the filter sees Embree's IDs
+  const std::vector<PrimOrder> *orders = scene_orders(vol);
+  std::vector<unsigned> embree_skip;
+  if ( orders && num_skip )
+    {
+      embree_skip.assign(skip, skip+2*num_skip);
+      for ( unsigned i = 0; i < num_skip; i++ )
+	{
+	  unsigned geom = embree_skip[2*i];
+	  if ( geom < orders->size() && !(*orders)[geom].to_embree.empty() )
+	    embree_skip[2*i+1] = (*orders)[geom].to_embree[embree_skip[2*i+1]];
+	}
+      skip = &embree_skip[0];
+    }
 
-  distances_out[1] = ray.tfar;
-  surfs_out[1] = ray.geomID;
-  tri_norms_out[1][0] = double(ray.Ng[0]);
-  tri_norms_out[1][1] = double(ray.Ng[1]);
-  tri_norms_out[1][2] = double(ray.Ng[2]);
+  // the length behind the origin may be given with either sign
+  neg_ray_len = fabs(neg_ray_len);
 
-  // now fire in the negative direction
-  ray.dir[0] *= -1; ray.dir[1] *= -1; ray.dir[2] *= -1; 
+  RTCRayRIS ray;
 
-  ray.tfar = float(neg_ray_len);
+  //shift the ray origin back by neg_ray_len, converting from double to float.
+  //The split is where the query point lies along the ray from the rounded
+  //origin, in double, so that hits are placed before or after the query
+  //point itself rather than the rounded shift.
+  double split = 0.0;
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+      ray.org[i] = float(ray_origin[i] - neg_ray_len*unit_ray_dir[i]);
+      ray.dir[i] = float(unit_ray_dir[i]);
+      split += ( ray_origin[i] - double(ray.org[i]) ) * unit_ray_dir[i];
+    }
 
   ray.tnear = 0.0f;
-
+  ray.tfar = float(neg_ray_len + nonneg_ray_len);
   ray.geomID = RTC_INVALID_GEOMETRY_ID;
   ray.primID = RTC_INVALID_GEOMETRY_ID;
   ray.mask = -1;
-  ray.time = 0;
+  ray.time = time;
+  ray.rf_type = rf_type::RIS;
+  ray.orientation = orientation;
+  ray.split = split;
+  ray.behind_dist = -1.0f;
+  ray.behind_geomID = RTC_INVALID_GEOMETRY_ID;
+  ray.behind_primID = RTC_INVALID_GEOMETRY_ID;
+  ray.skip = skip;
+  ray.num_skip = num_skip;
+  ray.skip_tol = float(skip_tol);
 
   /* fire the ray */
-  rtcIntersect(this_scene,ray);
-
-  distances_out[0] = ray.tfar;
-  surfs_out[0] = ray.geomID;
-  tri_norms_out[0][0] = double(ray.Ng[0]);
-  tri_norms_out[0][1] = double(ray.Ng[1]);
-  tri_norms_out[0][2] = double(ray.Ng[2]);
-
-
-
-
+  rtcIntersect(this_scene,*((RTCRay*)&ray));
+
+  // hit behind the origin
+  hits_out.surfs[0] = ray.behind_geomID;
+  hits_out.prims[0] = moab_prim(orders, ray.behind_geomID, ray.behind_primID);
+  hits_out.distances[0] = double(ray.behind_dist) - split;
+  for ( unsigned int i = 0; i < 3; i++ )
+    hits_out.tri_norms[0][i] = double(ray.behind_Ng[i]);
+  hits_out.uvs[0][0] = double(ray.behind_u);
+  hits_out.uvs[0][1] = double(ray.behind_v);
+
+  // hit ahead of the origin
+  hits_out.surfs[1] = ray.geomID;
+  hits_out.prims[1] = moab_prim(orders, ray.geomID, ray.primID);
+  hits_out.distances[1] = double(ray.tfar) - split;
+  for ( unsigned int i = 0; i < 3; i++ )
+    hits_out.tri_norms[1][i] = double(ray.Ng[i]);
+  hits_out.uvs[1][0] = double(ray.u);
+  hits_out.uvs[1][1] = double(ray.v);
 
   return;
 }
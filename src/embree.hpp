@@ -14,6 +14,10 @@
 //#include "../kernels/common/default.h"
 #include <array>
 #include <vector>
+#include <list>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <iostream>
 #include "moab/Core.hpp"
 #include "moab/Range.hpp"
@@ -25,45 +29,203 @@ struct Triangle { int v0, v1, v2; };
 struct Vertex   { float x,y,z; };
 
 
-struct RTCRay2 : RTCRay { int rf_type; };
+// orientation is 1 for exiting hits only, -1 for entering hits only, 0 for both
+struct RTCRay2 : RTCRay { int rf_type; int orientation; };
 
-enum rf_type { RF, PIV};
+// a single ray/surface intersection reported by rtc::get_all_intersections,
+// exit is set if the ray leaves the volume there
+struct RayHit { float dist; int surf; int prim; bool exit; };
+
+// ray that records every hit into a caller-supplied buffer (rf_type ALL)
+struct RTCRayHits : RTCRay2 { RayHit* hits; unsigned max_hits; unsigned num_hits; };
+
+// nearest hits on either side of a ray origin as returned by rtc::psuedo_ris,
+// index 0 is behind the origin (distance <= 0) and index 1 is ahead of it.
+// A surface of -1 means there is no hit on that side.
+struct RISHits { double distances[2]; int surfs[2]; int prims[2]; double tri_norms[2][3]; double uvs[2][2]; };
+
+// ray that starts behind the query origin; hits before split are recorded as
+// the nearest hit behind the origin and rejected (rf_type RIS). The num_skip
+// (geomID, primID) pairs in skip are never hit, nor is any triangle of their
+// geometries within skip_tol of the origin (the same crossing, found on a
+// neighbouring triangle at an edge or vertex).
+struct RTCRayRIS : RTCRay2 { double split; float behind_dist; unsigned behind_geomID, behind_primID; float behind_Ng[3]; float behind_u, behind_v;
+                             const unsigned* skip; unsigned num_skip; float skip_tol; };
+
+// packet of 8 rays fired by rtc::ray_fire8, hits are accepted only if their
+// direction relative to the triangle normal matches orientation as for RF
+struct RTCRay8Oriented : RTCRay8 { int orientation; };
+
+enum rf_type { RF, PIV, ALL, RIS };
+
+// order of a reordered triangle mesh: the position in the surface's Range of
+// each Embree primitive, and the inverse
+struct PrimOrder { std::vector<unsigned> to_moab, to_embree; };
+
+// counters of the scene cache enabled by rtc::scene_budget
+struct SceneCacheStats {
+  unsigned long long hits, misses; // queries that found their scene built or not
+  unsigned long long rebuilds, evictions; // scenes rebuilt and deleted
+  long long bytes, peak_bytes; // memory Embree allocated for the rtc's scenes, now and at most
+};
 
 class rtc {
   private:
     RTCScene g_scene;
+  // set once g_scene is committed, so that other threads may fire at it
+  std::atomic<bool> g_scene_ready;
   std::map<moab::EntityHandle,RTCScene> dag_vol_map;
   std::map<moab::EntityHandle,int> global_vertex_map;
   std::vector<RTCScene> scenes;
   moab::EntityHandle sceneOffset;
+  // triangle orders of each scene's meshes, by scene index and geomID (empty
+  // unless spatial_order is set). Instances use their prototype's orders,
+  // through order_scene.
+  std::vector< std::vector<PrimOrder> > prim_orders;
+  std::vector<PrimOrder> g_prim_orders;
+  std::vector<unsigned> order_scene;
   
+  // returns whether the triangles have vertices of their own rather than
+  // the shared vertex buffer's
+  bool add_triangles_to_scene(RTCScene scene, moab::Interface* MBI, moab::Range &triangles_eh, int sense,
+			      std::vector<PrimOrder> &orders, std::vector< std::vector<Triangle> > *retained = NULL,
+			      const double offset[3] = NULL, const double motion[3] = NULL);
+  const std::vector<PrimOrder>* scene_orders(moab::EntityHandle volume);
+  RTCAlgorithmFlags algorithm_flags();
+  unsigned new_mesh(RTCScene scene, unsigned num_tris, std::vector<PrimOrder> &orders,
+		    const Vertex *verts = NULL, unsigned num_verts = 0, const Vertex *end_verts = NULL);
+  RTCScene new_instance_scene(RTCScene prototype, const float offset[3]);
+  void commit(RTCScene scene);
+
+  // variants and replicas: the rtc they were made from (NULL for a base),
+  // whose scenes, vertex buffer and orders a variant shares, and the scenes
+  // built by this one
+  rtc *base;
+  bool replica;
+  std::vector<bool> owned;
+  // vertex buffers of the translated or moving triangles
+  std::list< std::vector<Vertex> > moved_vertices;
+
+  // scene cache: the triangles of each scene by geomID, in Embree's order,
+  // kept to rebuild evicted scenes (only with a scene_budget)
+  class SceneUse;
+  std::vector< std::vector< std::vector<Triangle> > > scene_tris;
+  std::vector<int> instance_of; // prototype scene of an instance, -1 for none
+  std::vector< std::array<float,3> > instance_offsets;
+  std::vector< std::vector<unsigned> > scene_instances; // instances of each prototype
+  // whether each scene is built, the queries using it (those of an instance
+  // pin its prototype too) and when a query last used it. A query finding
+  // its scene built reads these without cache_mutex.
+  std::unique_ptr< std::atomic<bool>[] > resident;
+  std::unique_ptr< std::atomic<int>[] > scene_pins;
+  std::unique_ptr< std::atomic<unsigned long long>[] > last_use;
+  std::atomic<unsigned long long> use_clock;
+  // guards the building and deleting of this rtc's cached scenes
+  std::mutex cache_mutex;
+  // the cached scenes are made on a device of their own, whose memory
+  // monitor counts Embree's memory for this rtc alone
+  RTCDevice device;
+  std::atomic<long long> cache_bytes, cache_peak_bytes;
+  std::atomic<unsigned long long> cache_hits, cache_misses;
+  SceneCacheStats cache_stats; // rebuilds and evictions, under cache_mutex
+  static bool count_memory(void* owner, const ssize_t bytes, const bool post);
+  RTCScene new_scene();
+  RTCScene acquire_scene(unsigned index);
+  void release_scene(unsigned index);
+  void make_resident(unsigned index);
+  void build_instance(unsigned index);
+  bool evict_scene(unsigned index);
+  void enforce_budget();
+
+  // the scenes and the cache's device are owned by one rtc, which is never
+  // copied
+  rtc(const rtc&);
+  rtc& operator=(const rtc&);
+
   public:
+  rtc();
+  // a variant deletes the scenes it built, the base's are kept until shutdown
+  ~rtc();
   void *vertex_buffer_ptr;
   int vertex_buffer_size;
   std::vector<Vertex> vertices;
-  enum rf_type { RF, PIV };
+  // when set before create_vertex_map, vertices and the triangles of each
+  // surface are stored along a Morton curve for locality. Primitive IDs
+  // returned by the queries are still positions in the surface's Range.
+  bool spatial_order;
+  // when set before the scenes are created, they also accept 8-ray packets
+  bool packets;
+  // when set (in bytes) before init, scenes are deleted, least recently used
+  // first, to keep Embree's memory for this rtc's scenes under the budget and
+  // rebuilt when next fired at. 0 (the default) keeps every scene.
+  size_t scene_budget;
+  SceneCacheStats scene_cache_stats();
+  enum rf_type { RF, PIV, ALL, RIS };
   void set_offset(moab::Range &vols);
   void init();
   void create_scene(moab::EntityHandle vol);
   void commit_scene(moab::EntityHandle vol);
+  // gives vol a committed scene holding an instance of prototype's scene,
+  // translated by offset (vol = prototype + offset)
+  void create_instance(moab::EntityHandle vol, moab::EntityHandle prototype, const double offset[3]);
+  // copy-on-write variants of a committed base (which must keep every scene,
+  // i.e. have no scene_budget, and outlive its variants). A variant starts
+  // out sharing all of the base's scenes and vertex buffer; create_scene
+  // gives a volume its own scene and move_volume its own translated instance
+  // of the base's scene. The variant has no global scene.
+  rtc* create_variant();
+  bool is_variant() { return NULL != base && !replica; }
+  void move_volume(moab::EntityHandle vol, const double offset[3]);
+  // replicas (e.g. one per NUMA node) of a committed base without a
+  // scene_budget: a copy of its vertex buffer and, once the caller has added
+  // every volume's triangles (create_scene, add_triangles, commit_scene) and
+  // called build_instances, of its scenes. Everything is built on the calling
+  // thread alone, so that first touch places the memory on its node.
+  rtc* create_replica();
+  void build_instances();
   void finalise_scene();
   void shutdown(); 
   rf_type ray_fire_type;
-  void create_vertex_map(moab::Interface* MBI);
-  void add_triangles(moab::Interface* MBI, moab::EntityHandle vol, moab::Range triangles_eh, int sense);
-  void ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_type filt_func, float tnear,  int &em_surf, float &dist_to_hit, float norm[3]);
-  bool point_in_vol(float coordinate[3], float dir[3]);
-  void get_all_intersections(float origin[3], float dir[3], std::vector<int> &surfaces,
-			     std::vector<float> &distances);
+  // the vertex buffer holds verts, or every vertex of the mesh if NULL
+  void create_vertex_map(moab::Interface* MBI, const moab::Range* verts = NULL);
+  // with an offset, the triangles are translated by it into a vertex buffer
+  // of their own. With a motion, they move by it over the ray times 0 to 1
+  // (Embree motion blur), starting from their translated positions.
+  void add_triangles(moab::Interface* MBI, moab::EntityHandle vol, moab::Range triangles_eh, int sense,
+		     const double offset[3] = NULL, const double motion[3] = NULL);
+  // the global scene holds every surface of the model once, in its forward sense
+  void create_global_scene();
+  void add_global_triangles(moab::Interface* MBI, moab::Range triangles_eh);
+  void commit_global_scene();
+  bool have_global_scene() { return g_scene_ready.load(std::memory_order_acquire); }
+  // the queries take the ray's time in [0,1], which places moving triangles
+  void ray_fire(moab::EntityHandle volume, float origin[3], float dir[3], rf_type filt_func, float tnear,  int &em_surf, float &dist_to_hit, float norm[3], float tfar = 1.0e38, int orientation = 1, int *em_prim = NULL, float bary[2] = NULL, float time = 0.0f);
+  // fires the lanes of valid (nonzero for a ray, 0 for none) as one packet of RF
+  // rays at their times (0 if NULL); surf is the geomID hit by each lane (-1
+  // for none) and dist its distance. As for ray_fire, a lane that hits nothing
+  // ahead gets the surface right behind its origin at distance 0, if any.
+  void ray_fire8(moab::EntityHandle volume, const int valid[8], const float org[][3], const float dir[][3],
+		 float tnear, const float tfar[8], int orientation, int surf[8], float dist[8],
+		 const float time[8] = NULL);
+  // whether a point is inside the model, from the hits of the global scene
+  // behind it; false, leaving inside unset, if the global scene is not built
+  bool point_in_vol(float coordinate[3], float dir[3], bool &inside);
+  // the volume 0 means the global scene, which must have been built
+  unsigned get_all_intersections(moab::EntityHandle volume, const float origin[3], const float dir[3],
+				 RayHit* hits, unsigned max_hits, float tnear = 0.0f, float tfar = 1.0e38,
+				 int orientation = 0, float time = 0.0f);
 
   void psuedo_ris( moab::EntityHandle vol, 
-		   std::vector<double> &distances_out, 
-		   std::vector<int> &surfs_out, 
-		   std::vector<std::array<double,3> > &tri_norms_out, 
+		   RISHits &hits_out,
 		   const double ray_origin[3], 
 		   const double unit_ray_dir[3], 
 		   double nonneg_ray_len, 
-		   double neg_ray_len);
+		   double neg_ray_len,
+		   int orientation = 1,
+		   const unsigned* skip = NULL,
+		   unsigned num_skip = 0,
+		   double skip_tol = 0,
+		   float time = 0.0f);
 
 
 };
@@ -0,0 +1,142 @@
+#include "domain_decomp.hpp"
+
+#include <vector>
+#include <iostream>
+#include <string.h>
+#include <math.h>
+
+// tests partition_volumes and ParticleExchange; run with e.g. mpirun -np 4
+
+struct TestParticle { int src, dest, round, seq; };
+
+static int records_sent( int src, int dest, int round )
+{
+  return ( src + 2*dest + round ) % 5;
+}
+
+// a row of volumes along x with growing costs must be split into contiguous
+// runs of nearly equal cost
+int test_partition( int num_ranks )
+{
+  const int num_vols = 100;
+  std::vector<VolumeCost> vols( num_vols );
+  double total = 0.0;
+  for (int i = 0; i < num_vols; ++i) {
+    VolumeCost &vol = vols[i];
+    vol.id = i+1;
+    vol.cost = 1.0 + i;
+    vol.lo[0] = i;     vol.lo[1] = vol.lo[2] = 0.0;
+    vol.hi[0] = i+1.0; vol.hi[1] = vol.hi[2] = 1.0;
+    total += vol.cost;
+  }
+
+  std::vector<int> owners;
+  partition_volumes( vols, num_ranks, owners );
+
+  std::vector<double> rank_cost( num_ranks, 0.0 );
+  for (int i = 0; i < num_vols; ++i) {
+    if (owners[i] < 0 || owners[i] >= num_ranks || ( i && owners[i] < owners[i-1] )) {
+      std::cerr << "ERROR: volume " << i+1 << " has owner " << owners[i] << std::endl;
+      return 1;
+    }
+    rank_cost[owners[i]] += vols[i].cost;
+  }
+  for (int r = 0; r < num_ranks; ++r) {
+    if (fabs( rank_cost[r] - total/num_ranks ) > vols.back().cost) {
+      std::cerr << "ERROR: rank " << r << " has cost " << rank_cost[r]
+                << " of " << total << std::endl;
+      return 1;
+    }
+  }
+
+  // the halo of the first rank's domain reaches one volume past it
+  std::vector<int> ids;
+  domain_volumes( vols, owners, 0, 0.5, ids );
+  int num_owned = 0;
+  while (num_owned < num_vols && 0 == owners[num_owned])
+    num_owned++;
+  if (int(ids.size()) != num_owned + ( num_ranks > 1 ? 1 : 0 )) {
+    std::cerr << "ERROR: rank 0 needs " << ids.size() << " volumes, expected "
+              << num_owned + 1 << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+int test_exchange( MPI_Comm comm )
+{
+  int rank, num_ranks;
+  MPI_Comm_rank( comm, &rank );
+  MPI_Comm_size( comm, &num_ranks );
+
+  // a small buffer so that some records go out before the exchange
+  ParticleExchange exchange( comm, sizeof(TestParticle), 3 );
+  const int num_rounds = 4;
+  for (int round = 0; round < num_rounds; ++round) {
+    for (int dest = 0; dest < num_ranks; ++dest)
+      for (int k = 0; k < records_sent( rank, dest, round ); ++k) {
+        TestParticle p = { rank, dest, round, k };
+        exchange.send( dest, &p );
+      }
+
+    std::vector<char> received;
+    long long total = exchange.exchange( received );
+
+    long long expected_total = 0;
+    std::vector<int> next_seq( num_ranks, 0 );
+    for (int src = 0; src < num_ranks; ++src)
+      for (int dest = 0; dest < num_ranks; ++dest)
+        expected_total += records_sent( src, dest, round );
+    if (total != expected_total) {
+      std::cerr << "ERROR: round " << round << " exchanged " << total
+                << " records, expected " << expected_total << std::endl;
+      return 1;
+    }
+
+    // records from each rank arrive in the order they were sent
+    for (size_t i = 0; i + sizeof(TestParticle) <= received.size(); i += sizeof(TestParticle)) {
+      TestParticle p;
+      memcpy( &p, &received[i], sizeof(p) );
+      if (p.dest != rank || p.round != round || p.seq != next_seq[p.src]++) {
+        std::cerr << "ERROR: rank " << rank << " received an unexpected record" << std::endl;
+        return 1;
+      }
+    }
+    for (int src = 0; src < num_ranks; ++src)
+      if (next_seq[src] != records_sent( src, rank, round )) {
+        std::cerr << "ERROR: rank " << rank << " received " << next_seq[src]
+                  << " records from rank " << src << " in round " << round << std::endl;
+        return 1;
+      }
+  }
+
+  // with nothing sent the exchange reports that transport is over
+  std::vector<char> received;
+  if (0 != exchange.exchange( received ) || !received.empty()) {
+    std::cerr << "ERROR: an empty exchange received records" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+  int fail = MPI_Init( &argc, &argv );
+  if (fail) return fail;
+
+  int rank, num_ranks;
+  MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+  MPI_Comm_size( MPI_COMM_WORLD, &num_ranks );
+
+  int errors = test_partition( num_ranks ) + test_exchange( MPI_COMM_WORLD );
+  int total_errors = 0;
+  MPI_Allreduce( &errors, &total_errors, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD );
+  if (0 == rank)
+    std::cout << ( total_errors ? "FAILED" : "passed" ) << " on " << num_ranks
+              << " ranks" << std::endl;
+
+  MPI_Finalize();
+  return total_errors;
+}
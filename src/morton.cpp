@@ -0,0 +1,28 @@
+#include "morton.hpp"
+
+#include <algorithm>
+
+/* spreads the low 21 bits of x out to every third bit */
+static unsigned long long spread_bits(unsigned long long x)
+{
+  x &= 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffffULL;
+  x = (x | x << 16) & 0x1f0000ff0000ffULL;
+  x = (x | x << 8)  & 0x100f00f00f00f00fULL;
+  x = (x | x << 4)  & 0x10c30c30c30c30c3ULL;
+  x = (x | x << 2)  & 0x1249249249249249ULL;
+  return x;
+}
+
+/* position of a point along the Morton curve through the box [lo, lo+size] */
+unsigned long long morton_code(const float pt[3], const float lo[3], const float size[3])
+{
+  unsigned long long code = 0;
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+      float scaled = ( 0.0f < size[i] ) ? ( pt[i] - lo[i] ) / size[i] : 0.0f;
+      unsigned long long cell = (unsigned long long)( std::min( std::max( scaled, 0.0f ), 1.0f ) * 2097151.0f );
+      code |= spread_bits(cell) << i;
+    }
+  return code;
+}
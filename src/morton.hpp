@@ -0,0 +1,11 @@
+#ifndef MORTON_HPP
+#define MORTON_HPP
+
+/* Morton (Z-order) codes, used to order triangles and vertices for the
+   Embree scenes and volumes for the domain decomposition. Kept apart from
+   embree.hpp so that code without Embree can use them. */
+
+// position of a point along the Morton curve through the box [lo, lo+size]
+unsigned long long morton_code(const float pt[3], const float lo[3], const float size[3]);
+
+#endif
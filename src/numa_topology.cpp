@@ -0,0 +1,120 @@
+#include "numa_topology.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+/* the node the calling thread was pinned to by pin_thread, -1 if none; a
+   pinned thread stays on its node, so its queries need not ask the kernel */
+static thread_local int pinned_node = -1;
+
+/* appends the CPUs of a list such as "0-3,8-11" */
+static void parse_cpu_list(const char *list, std::vector<int> &cpus)
+{
+  const char *p = list;
+  while ( *p >= '0' && *p <= '9' )
+    {
+      char *end;
+      int first = strtol( p, &end, 10 ), last = first;
+      if ( '-' == *end )
+	last = strtol( end+1, &end, 10 );
+      for ( int cpu = first; cpu <= last; cpu++ )
+	cpus.push_back( cpu );
+      p = ( ',' == *end ) ? end+1 : end;
+    }
+}
+
+NumaTopology::NumaTopology()
+{
+#ifdef __linux__
+  // the node directories, which need not be numbered contiguously
+  std::vector<int> node_ids;
+  DIR *dir = opendir( "/sys/devices/system/node" );
+  if ( dir )
+    {
+      struct dirent *entry;
+      while ( ( entry = readdir( dir ) ) )
+	{
+	  int id;
+	  char rest;
+	  if ( 1 == sscanf( entry->d_name, "node%d%c", &id, &rest ) )
+	    node_ids.push_back( id );
+	}
+      closedir( dir );
+    }
+  std::sort( node_ids.begin(), node_ids.end() );
+
+  for ( unsigned i = 0; i < node_ids.size(); i++ )
+    {
+      char path[128], list[4096];
+      snprintf( path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node_ids[i] );
+      FILE *file = fopen( path, "r" );
+      if ( !file )
+	continue;
+      std::vector<int> cpus;
+      if ( fgets( list, sizeof(list), file ) )
+	parse_cpu_list( list, cpus );
+      fclose( file );
+      // nodes with memory but no CPUs run no queries
+      if ( !cpus.empty() )
+	node_cpus.push_back( cpus );
+    }
+#endif
+
+  if ( node_cpus.empty() )
+    {
+      long num_cpus = std::max( sysconf( _SC_NPROCESSORS_CONF ), 1L );
+      node_cpus.resize( 1 );
+      for ( int cpu = 0; cpu < num_cpus; cpu++ )
+	node_cpus[0].push_back( cpu );
+    }
+
+  for ( int node = 0; node < num_nodes(); node++ )
+    for ( unsigned i = 0; i < node_cpus[node].size(); i++ )
+      {
+	int cpu = node_cpus[node][i];
+	if ( cpu >= (int)cpu_nodes.size() )
+	  cpu_nodes.resize( cpu+1, -1 );
+	cpu_nodes[cpu] = node;
+      }
+}
+
+int NumaTopology::node_of_cpu(int cpu) const
+{
+  return ( cpu >= 0 && cpu < (int)cpu_nodes.size() ) ? cpu_nodes[cpu] : -1;
+}
+
+int NumaTopology::current_node() const
+{
+  if ( pinned_node >= 0 )
+    return pinned_node;
+#ifdef __linux__
+  return node_of_cpu( sched_getcpu() );
+#else
+  return -1;
+#endif
+}
+
+bool NumaTopology::pin_thread(int node) const
+{
+#ifdef __linux__
+  if ( node < 0 || node >= num_nodes() )
+    return false;
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  for ( unsigned i = 0; i < node_cpus[node].size(); i++ )
+    if ( node_cpus[node][i] < CPU_SETSIZE )
+      CPU_SET( node_cpus[node][i], &set );
+  if ( 0 != sched_setaffinity( 0, sizeof(set), &set ) )
+    return false;
+  pinned_node = node;
+  return true;
+#else
+  return false;
+#endif
+}
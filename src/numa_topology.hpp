@@ -0,0 +1,33 @@
+#ifndef NUMA_TOPOLOGY_HPP
+#define NUMA_TOPOLOGY_HPP
+
+#include <vector>
+
+/* The NUMA nodes of the machine and the CPUs on each, read from
+   /sys/devices/system/node on Linux. Elsewhere, or without that information,
+   there is a single node holding every CPU.
+
+   DagMC::set_numa_replication builds a copy of the scenes on each node with
+   a thread pinned there, so that first touch places the memory on that node,
+   and routes each query to the copy of the node its thread is running on. */
+class NumaTopology {
+  public:
+  NumaTopology();
+
+  int num_nodes() const { return node_cpus.size(); }
+  const std::vector<int>& cpus(int node) const { return node_cpus[node]; }
+  // the node of a CPU, -1 if it is not known
+  int node_of_cpu(int cpu) const;
+  // the node the calling thread is running on, -1 if it is not known; the
+  // node of a thread pinned with pin_thread is remembered, not looked up
+  int current_node() const;
+  // restricts the calling thread to the CPUs of node, false on failure;
+  // query threads pinned this way skip the per-query CPU lookup
+  bool pin_thread(int node) const;
+
+  private:
+  std::vector< std::vector<int> > node_cpus;
+  std::vector<int> cpu_nodes;
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include "phase_profiler.hpp"
+
+#include <iomanip>
+#include <cstdio>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* resident memory of the process in kilobytes; the peak where the current
+   value is not available */
+static long resident_kb()
+{
+#ifdef __linux__
+  FILE *statm = fopen( "/proc/self/statm", "r" );
+  if ( statm )
+    {
+      long pages_total, pages_resident;
+      int count = fscanf( statm, "%ld %ld", &pages_total, &pages_resident );
+      fclose( statm );
+      if ( 2 == count )
+	return pages_resident * ( sysconf(_SC_PAGESIZE) / 1024 );
+    }
+#endif
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+void PhaseProfiler::begin(const char *name, int id)
+{
+  Phase phase;
+  phase.name = name;
+  phase.id = id;
+  phase.parent = current;
+  phase.depth = ( current < 0 ) ? 0 : phases[current].depth + 1;
+  phase.wall = phase.cpu = 0.0;
+  phase.rss_start = resident_kb();
+  phase.rss_delta = 0;
+  phase.cpu_start = std::clock();
+  phase.wall_start = std::chrono::steady_clock::now();
+  phases.push_back( phase );
+  current = phases.size() - 1;
+}
+
+void PhaseProfiler::end()
+{
+  if ( current < 0 )
+    return;
+  Phase &phase = phases[current];
+  phase.wall = std::chrono::duration<double>( std::chrono::steady_clock::now() - phase.wall_start ).count();
+  phase.cpu = double( std::clock() - phase.cpu_start ) / CLOCKS_PER_SEC;
+  phase.rss_delta = resident_kb() - phase.rss_start;
+  current = phase.parent;
+}
+
+void PhaseProfiler::report(std::ostream &str, bool json) const
+{
+  if ( json )
+    {
+      std::vector< std::vector<int> > children( phases.size() + 1 );
+      for ( unsigned i = 0; i < phases.size(); i++ )
+	children[ phases[i].parent + 1 ].push_back( i );
+
+      str << "[";
+      for ( unsigned i = 0; i < children[0].size(); i++ )
+	{
+	  if ( i ) str << ",";
+	  report_json( str, children[0][i], children );
+	}
+      str << "]" << std::endl;
+      return;
+    }
+
+  std::ios::fmtflags flags = str.flags();
+  str << std::left << std::setw(40) << "phase" << std::right << std::setw(12) << "wall (s)"
+      << std::setw(12) << "cpu (s)" << std::setw(16) << "rss delta (KB)" << std::endl;
+  str << std::fixed << std::setprecision(4);
+  for ( unsigned i = 0; i < phases.size(); i++ )
+    {
+      const Phase &phase = phases[i];
+      std::string label = std::string( 2*phase.depth, ' ' ) + phase.name;
+      if ( -1 != phase.id )
+	label += " " + std::to_string( phase.id );
+      str << std::left << std::setw(40) << label << std::right << std::setw(12) << phase.wall
+	  << std::setw(12) << phase.cpu << std::setw(16) << std::showpos << phase.rss_delta
+	  << std::noshowpos << std::endl;
+    }
+  str.flags( flags );
+}
+
+void PhaseProfiler::report_json(std::ostream &str, int index, const std::vector< std::vector<int> > &children) const
+{
+  const Phase &phase = phases[index];
+  str << "{\"name\":\"" << phase.name << "\"";
+  if ( -1 != phase.id )
+    str << ",\"id\":" << phase.id;
+  str << ",\"wall\":" << phase.wall << ",\"cpu\":" << phase.cpu
+      << ",\"rss_delta_kb\":" << phase.rss_delta;
+  const std::vector<int> &kids = children[index + 1];
+  if ( !kids.empty() )
+    {
+      str << ",\"children\":[";
+      for ( unsigned i = 0; i < kids.size(); i++ )
+	{
+	  if ( i ) str << ",";
+	  report_json( str, kids[i], children );
+	}
+      str << "]";
+    }
+  str << "}";
+}
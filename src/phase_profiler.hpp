@@ -0,0 +1,68 @@
+#ifndef PHASE_PROFILER_HPP
+#define PHASE_PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <chrono>
+#include <ctime>
+
+/* Tree of timed phases, e.g. of DagMC's startup.
+
+   Each phase records its wall time, the process CPU time (all threads) and
+   the change in resident memory while it ran. Phases begun while another is
+   running are its children. Recording does nothing until enable() is
+   called, and phases are expected to come from a single thread. */
+class PhaseProfiler {
+  public:
+  PhaseProfiler() : current(-1), enabled(false) {}
+
+  void enable(bool on = true) { enabled = on; }
+  bool is_enabled() const { return enabled; }
+  // forgets every phase recorded so far
+  void clear() { phases.clear(); current = -1; }
+
+  // starts a phase named name, with id (e.g. a volume ID) if it is not -1
+  void begin(const char *name, int id = -1);
+  // ends the phase begun last
+  void end();
+
+  // writes the phases as an indented table, or as a JSON array of trees
+  void report(std::ostream &str, bool json = false) const;
+
+  private:
+  struct Phase {
+    std::string name;
+    int id;
+    int parent;
+    unsigned depth;
+    double wall, cpu;
+    long rss_start, rss_delta; // kilobytes
+    std::chrono::steady_clock::time_point wall_start;
+    std::clock_t cpu_start;
+  };
+
+  std::vector<Phase> phases; // in the order they began
+  int current;
+  bool enabled;
+
+  void report_json(std::ostream &str, int phase, const std::vector< std::vector<int> > &children) const;
+};
+
+// times the enclosing scope as a phase of profiler
+class PhaseScope {
+  public:
+  PhaseScope(PhaseProfiler &profiler_in, const char *name, int id = -1)
+    : profiler(profiler_in), on(profiler_in.is_enabled())
+  { if ( on ) profiler.begin(name, id); }
+  ~PhaseScope() { if ( on ) profiler.end(); }
+
+  private:
+  PhaseProfiler &profiler;
+  bool on;
+
+  PhaseScope(const PhaseScope&);
+  PhaseScope& operator=(const PhaseScope&);
+};
+
+#endif
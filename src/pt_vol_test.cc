@@ -2,12 +2,17 @@
 #include "moab/Core.hpp"
 #include "DagMC.hpp"
 #include "MBTagConventions.hpp"
+#include "bulk_input.hpp"
 
 #include <vector>
 #include <iostream>
 #include <math.h>
 #include <limits>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
 
 #define CHKERR if (MB_SUCCESS != rval) return rval
 
@@ -43,15 +48,105 @@ ErrorCode test_pt_volume_slow(DagMC &dagmc, int volID, double xxx, double yyy, d
 
 }
 
+static void test_pt_volume_range(DagMC *dagmc, EntityHandle vol, const BulkInput *input,
+				 size_t begin, size_t end, int *results)
+{
+  for (size_t i = begin; i < end; ++i) {
+    const double *row = input->row(i);
+    if (MB_SUCCESS != dagmc->point_in_volume( vol, row, results[i], row+3 ))
+      results[i] = -2;
+  }
+}
+
+// tests every point of points_file against volume volID with num_threads
+// threads, writing one int32 result per point to output_file
+int test_pt_volume_bulk(DagMC &dagmc, int volID, const char *points_file,
+			const char *output_file, int num_threads)
+{
+  EntityHandle vol = dagmc.entity_by_id(3,volID);
+  if (0 == vol) {
+    std::cerr << "Problem getting volume " << volID << std::endl;
+    return 2;
+  }
+
+  BulkInput input;
+  if (!input.open( points_file, 6, 3 ))
+    return 2;
+  const size_t num_points = input.size();
+  std::vector<int> results( num_points );
+  num_threads = std::max( num_threads, 1 );
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if (1 == num_threads || num_points < 2) {
+    test_pt_volume_range( &dagmc, vol, &input, 0, num_points, results.data() );
+  }
+  else {
+    std::vector<std::thread> threads;
+    size_t chunk = ( num_points + num_threads - 1 ) / num_threads;
+    for (size_t begin = 0; begin < num_points; begin += chunk)
+      threads.push_back( std::thread( test_pt_volume_range, &dagmc, vol, &input, begin,
+				      std::min( begin+chunk, num_points ), results.data() ) );
+    for (unsigned t = 0; t < threads.size(); ++t)
+      threads[t].join();
+  }
+  double time = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+  size_t inside = 0, failed = 0;
+  for (size_t i = 0; i < num_points; ++i) {
+    if (1 == results[i]) inside++;
+    if (-2 == results[i]) failed++;
+  }
+  std::cout << "Tested " << num_points << " points in " << time << " s ("
+	    << ( time > 0 ? num_points/time : 0.0 ) << " points/s) on "
+	    << num_threads << " thread(s), " << inside << " inside volume " << volID
+	    << std::endl;
+
+  FILE *out = fopen( output_file, "wb" );
+  if (!out || ( num_points && num_points != fwrite( results.data(), sizeof(int), num_points, out ) )) {
+    std::cerr << "Failed to write '" << output_file << "'" << std::endl;
+    if (out) fclose( out );
+    return 2;
+  }
+  fclose( out );
+
+  if (failed) {
+    std::cerr << failed << " points failed to be tested." << std::endl;
+    return 3;
+  }
+  return 0;
+}
+
 int main( int argc, char* argv[] )
 {
   ErrorCode rval;
 
-  if (argc != 6 && argc != 9) {
+  bool bulk = ( argc == 6 || argc == 7 ) && 0 == strcmp( argv[3], "-F" );
+  if (argc != 6 && argc != 9 && !bulk) {
     std::cerr << "Usage: " << argv[0] << " <mesh_filename> "
-              << " <vol_id> <xxx> <yyy> <zzz> [<uuu> <vvv> <www>]" << std::endl;
+              << " <vol_id> <xxx> <yyy> <zzz> [<uuu> <vvv> <www>]" << std::endl
+	      << "       " << argv[0] << " <mesh_filename> "
+	      << " <vol_id> -F <points_file> <output_file> [<threads>]" << std::endl
+	      << "  points_file holds x y z [u v w] per point, as binary doubles (all six)" << std::endl
+	      << "  or as text if its name ends in .csv or .txt.  output_file receives one" << std::endl
+	      << "  int32 per point: 1 inside, 0 outside, -1 on the boundary, -2 failed." << std::endl;
     return 1;
   }
+
+  if (bulk) {
+    DagMC& dagmc = *DagMC::instance();
+    rval = dagmc.load_file( argv[1], 0 );
+    if (MB_SUCCESS != rval) {
+      std::cerr << "Failed to load file." << std::endl;
+      return 2;
+    }
+    rval = dagmc.init_OBBTree( );
+    if (MB_SUCCESS != rval) {
+      std::cerr << "Failed to initialize DagMC." << std::endl;
+      return 2;
+    }
+    return test_pt_volume_bulk( dagmc, atoi(argv[2]), argv[4], argv[5],
+				argc > 6 ? atoi(argv[6]) : 1 );
+  }
   
   char* filename = argv[1];
   int volID = atoi(argv[2]);
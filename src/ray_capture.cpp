@@ -0,0 +1,86 @@
+#include "ray_capture.hpp"
+
+#include <cstring>
+#include <cstdio>
+#include <mutex>
+#include <set>
+#include <vector>
+
+// records a thread buffers before writing them out
+static const size_t buffer_size = 4096;
+
+std::atomic<bool> QueryCapture::is_active(false);
+
+static std::mutex capture_mutex;
+static FILE *capture_file = NULL;
+
+struct CaptureBuffer;
+static std::set<CaptureBuffer*> capture_buffers;
+
+/* writes the records to the capture file, with capture_mutex held */
+static void write_records(std::vector<QueryRecord> &records)
+{
+  if ( capture_file && !records.empty() )
+    fwrite( &records[0], sizeof(QueryRecord), records.size(), capture_file );
+  records.clear();
+}
+
+struct CaptureBuffer {
+  std::vector<QueryRecord> records;
+
+  CaptureBuffer()
+  {
+    records.reserve(buffer_size);
+    std::lock_guard<std::mutex> lock(capture_mutex);
+    capture_buffers.insert(this);
+  }
+
+  ~CaptureBuffer()
+  {
+    std::lock_guard<std::mutex> lock(capture_mutex);
+    write_records(records);
+    capture_buffers.erase(this);
+  }
+};
+
+bool QueryCapture::start(const char *filename)
+{
+  std::lock_guard<std::mutex> lock(capture_mutex);
+  if ( capture_file )
+    fclose(capture_file);
+
+  capture_file = fopen(filename, "wb");
+  if ( !capture_file )
+    return false;
+
+  CaptureHeader header;
+  memcpy( header.magic, "EMDAGQRY", 8 );
+  header.version = version;
+  header.record_size = sizeof(QueryRecord);
+  fwrite( &header, sizeof(header), 1, capture_file );
+
+  is_active.store(true);
+  return true;
+}
+
+void QueryCapture::stop()
+{
+  std::lock_guard<std::mutex> lock(capture_mutex);
+  is_active.store(false);
+  for ( std::set<CaptureBuffer*>::iterator i = capture_buffers.begin(); i != capture_buffers.end(); ++i )
+    write_records( (*i)->records );
+  if ( capture_file )
+    fclose(capture_file);
+  capture_file = NULL;
+}
+
+void QueryCapture::record(const QueryRecord &rec)
+{
+  static thread_local CaptureBuffer buffer;
+  buffer.records.push_back(rec);
+  if ( buffer.records.size() >= buffer_size )
+    {
+      std::lock_guard<std::mutex> lock(capture_mutex);
+      write_records(buffer.records);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef RAY_CAPTURE_HPP
+#define RAY_CAPTURE_HPP
+
+#include <stdint.h>
+#include <atomic>
+
+/* Capture of geometry queries to a binary file, for replay by ray_replay.
+
+   The file is a CaptureHeader followed by fixed size QueryRecords in native
+   byte order. Each thread appends records to its own buffer without locking;
+   a full buffer is written out under a lock, as are all the buffers when the
+   capture stops and a buffer's remaining records when its thread exits. */
+
+enum QueryType { QUERY_RAY_FIRE = 0, QUERY_POINT_IN_VOLUME = 1 };
+
+struct CaptureHeader {
+  char magic[8];        // "EMDAGQRY"
+  uint32_t version;
+  uint32_t record_size; // sizeof(QueryRecord)
+};
+
+struct QueryRecord {
+  uint32_t type;        // QueryType
+  int32_t orientation;  // ray orientation of a ray fire
+  uint64_t volume;      // volume handle
+  double point[3];
+  double dir[3];        // direction given by the caller (zero if none)
+  double dist_limit;    // distance limit of a ray fire
+  uint64_t surf;        // ray fire result: surface hit (0 for none)
+  double dist;          // ray fire result: distance to it
+  int32_t result;       // point_in_volume result
+  int32_t padding;
+};
+
+class QueryCapture {
+  public:
+  static const uint32_t version = 1;
+
+  // starts writing records to filename, false if it cannot be opened
+  static bool start(const char *filename);
+  // writes out every thread's buffer and closes the file; no queries may
+  // be running on other threads while this is called
+  static void stop();
+  static bool active() { return is_active.load(std::memory_order_relaxed); }
+  // appends a record to the calling thread's buffer
+  static void record(const QueryRecord &rec);
+
+  private:
+  static std::atomic<bool> is_active;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include "DagMC.hpp"
 #include "MBTagConventions.hpp"
 #include "moab/CartVect.hpp"
+#include "bulk_input.hpp"
 
 #include <vector>
 #include <iostream>
@@ -11,11 +12,14 @@
 #include <limits>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
 #include <cfloat>
+#include <thread>
+#include <chrono>
 #if !defined(_MSC_VER) && !defined(__MINGW32__)
 #include <sys/resource.h>
 #endif
@@ -67,9 +71,22 @@ static bool do_stat_report = false;
 static bool do_trv_stats   = false;
 static double location_az = 2.0 * PI;
 static double direction_az = location_az;
+static double dist_limit = 0;
+static double overlap_thickness = 0;
+static bool spatial_order = false;
+static int batch_size = 0;
+static double scene_budget_mb = 0; // Embree memory budget of the scene cache, 0 for none
+static bool release_mesh = false;     // free the MOAB mesh once the scenes are built
+static double packet_utilization = 0; // mean fraction of packet lanes used by batched rays
 static const char* pyfile = NULL;
+static const char* capture_file = NULL;
+static const char* ray_file = NULL;    // rays to fire in bulk (-F)
+static const char* result_file = NULL; // binary results of the bulk rays (-o)
+static int num_threads = 1;
+static const char* profile_format = NULL; // report startup phases as text or json (-P)
 
 static int random_rays_missed = 0; // count of random rays that did not hit a surface
+static int random_rays_limited = 0; // count of random rays that hit nothing within dist_limit
 
 /* Most of the argument handling code was stolen/adapted from MOAB/test/obb/obb_test.cpp */
 static void usage( const char* error, const char* opt, const char* name = "ray_fire_test" )
@@ -106,6 +123,19 @@ static void usage( const char* error, const char* opt, const char* name = "ray_f
     str << "-L <real>  if present, limit random ray Location to between +-<value> degrees" << std::endl;
     str << "-D <real>  if present, limit random ray Direction to between +-<value> degrees" << std::endl;
     str << "           (unused if random ray radius < 0)" << std::endl;
+    str << "-l <real>  if present, limit ray fires to this distance (e.g. a collision distance)" << std::endl;
+    str << "-O <real>  if present, fire rays in overlap-tolerant mode with this overlap thickness" << std::endl;
+    str << "-M  store vertices and triangles in Morton order" << std::endl;
+    str << "-b <real>  keep Embree's memory under this many MB, rebuilding evicted scenes on demand" << std::endl;
+    str << "-R  free the MOAB mesh after initialization (no OBB tree statistics)" << std::endl;
+    str << "-B <int>   fire random rays in batches of this size as sorted 8-ray packets" << std::endl;
+    str << "-F <filename>  Fire the rays in this file (x y z u v w per ray, binary doubles," << std::endl;
+    str << "           or text if the name ends in .csv or .txt).  -F implies -n 0" << std::endl;
+    str << "-o <filename>  write the results of the -F rays as binary (int64 surface id, 0 for" << std::endl;
+    str << "           none, then double distance per ray)" << std::endl;
+    str << "-T <int>   number of threads firing the -F rays (default 1)" << std::endl;
+    str << "-P <text|json>  time the startup phases and report them in this format" << std::endl;
+    str << "-C <filename>  if present, capture the queries to this file for ray_replay" << std::endl;
     str << "-p <filename>  if present, save parameters and results to a python dictionary" << std::endl;
   }
 
@@ -180,6 +210,75 @@ static void parse_ray( int& i, int argc, char* argv[] )
 }
 
 
+// result of a ray fired from a -F file, as written to the -o file
+struct BulkRayResult { long long surf_id; double dist; };
+
+static void fire_ray_range( DagMC* dagmc, EntityHandle vol, const BulkInput* input,
+                            size_t begin, size_t end, BulkRayResult* results )
+{
+  for( size_t i = begin; i < end; ++i ){
+    const double* ray = input->row( i );
+    EntityHandle surf;
+    double dist;
+    if( MB_SUCCESS != dagmc->ray_fire( vol, ray, ray+3, surf, dist, NULL, dist_limit ) ){
+      surf = 0;
+      dist = -1;
+    }
+    results[i].surf_id = surf ? dagmc->id_by_index( 2, dagmc->index_by_handle( surf ) ) : 0;
+    results[i].dist = dist;
+  }
+}
+
+static int fire_bulk_rays( DagMC& dagmc, EntityHandle vol )
+{
+  BulkInput input;
+  if( !input.open( ray_file, 6, 6 ) ){
+    return 1;
+  }
+  const size_t num_rays = input.size();
+  std::vector<BulkRayResult> results( num_rays );
+  int threads_used = std::max( 1, num_threads );
+
+  std::cout << "Firing " << num_rays << " rays from " << ray_file << " at volume "
+            << vol_index << " on " << threads_used << " thread(s)..." << std::flush;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if( 1 == threads_used || num_rays < 2 ){
+    fire_ray_range( &dagmc, vol, &input, 0, num_rays, results.data() );
+  }
+  else {
+    std::vector<std::thread> threads;
+    size_t chunk = ( num_rays + threads_used - 1 ) / threads_used;
+    for( size_t begin = 0; begin < num_rays; begin += chunk ){
+      threads.push_back( std::thread( fire_ray_range, &dagmc, vol, &input, begin,
+                                      std::min( begin+chunk, num_rays ), results.data() ) );
+    }
+    for( unsigned t = 0; t < threads.size(); ++t ){
+      threads[t].join();
+    }
+  }
+  double time = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  std::cout << " done." << std::endl;
+
+  size_t missed = 0;
+  for( size_t i = 0; i < num_rays; ++i ){
+    if( 0 == results[i].surf_id ){ missed++; }
+  }
+  std::cout << "Bulk rays: " << num_rays << " in " << time << " s ("
+            << ( time > 0 ? num_rays/time : 0.0 ) << " rays/s), " << missed
+            << " without a hit" << std::endl;
+
+  if( result_file ){
+    FILE* out = fopen( result_file, "wb" );
+    if( !out || ( num_rays && num_rays != fwrite( results.data(), sizeof(BulkRayResult), num_rays, out ) ) ){
+      std::cerr << "Failed to write '" << result_file << "'" << std::endl;
+      if( out ){ fclose( out ); }
+      return 1;
+    }
+    fclose( out );
+  }
+  return 0;
+}
+
 int main( int argc, char* argv[] )
 {
 
@@ -223,6 +322,37 @@ int main( int argc, char* argv[] )
         case 'D':
           direction_az = get_double_option( i, argc, argv ) * (PI / 180.0);
           break;        
+        case 'l':
+          dist_limit = get_double_option( i, argc, argv );
+          break;
+        case 'O':
+          overlap_thickness = get_double_option( i, argc, argv );
+          break;
+        case 'M': spatial_order = true; break;
+        case 'R': release_mesh = true;  break;
+        case 'b':
+          scene_budget_mb = get_double_option( i, argc, argv );
+          break;
+        case 'B':
+          batch_size = get_int_option( i, argc, argv );
+          break;
+        case 'F':
+          ray_file = get_option( i, argc, argv );
+          break;
+        case 'o':
+          result_file = get_option( i, argc, argv );
+          break;
+        case 'T':
+          num_threads = get_int_option( i, argc, argv );
+          break;
+        case 'P':
+          profile_format = get_option( i, argc, argv );
+          if( strcmp( profile_format, "text" ) && strcmp( profile_format, "json" ) )
+            usage( "Expected text or json following option", argv[i-1] );
+          break;
+        case 'C':
+          capture_file = get_option( i, argc, argv );
+          break;
         case 'p':
 	  pyfile = get_option( i, argc, argv );
 	  break;
@@ -240,6 +370,10 @@ int main( int argc, char* argv[] )
   if( !filename ){
     usage("No filename specified", 0, argv[0] );
   }
+  // whatever -n was given, before or after it
+  if( ray_file ){
+    num_random_rays = 0;
+  }
      
   ErrorCode rval;
   EntityHandle surf = 0, vol = 0;
@@ -251,24 +385,48 @@ int main( int argc, char* argv[] )
   /* Initialize DAGMC and find the appropriate volume */
   std::cout << "Initializing DagMC, facet_tol = " << facet_tol << std::endl;
   DagMC& dagmc = *DagMC::instance();
+  dagmc.profiler.enable( profile_format != NULL );
   rval = dagmc.load_file( filename, facet_tol );
   if(MB_SUCCESS != rval) {
     std::cerr << "Failed to load file '" << filename << "'" << std::endl;
     return 2;
   }
   
+  dagmc.RTC->spatial_order = spatial_order;
+  dagmc.RTC->packets = batch_size > 0;
+  dagmc.RTC->scene_budget = size_t( scene_budget_mb * 1024 * 1024 );
   rval = dagmc.init_OBBTree( );
   if(MB_SUCCESS != rval) {
     std::cerr << "Failed to initialize DagMC." << std::endl;
     return 2;
   }
   
+  if( release_mesh ){
+    rval = dagmc.release_mesh();
+    if(MB_SUCCESS != rval) {
+      std::cerr << "Failed to release the mesh." << std::endl;
+      return 2;
+    }
+  }
+
+  if( profile_format ){
+    dagmc.profiler.report( std::cout, 0 == strcmp( profile_format, "json" ) );
+  }
+
+  if( overlap_thickness > 0 ){
+    dagmc.set_overlap_thickness( overlap_thickness );
+  }
+
   vol = dagmc.entity_by_id(3, vol_index);
   if(0 == vol) {
     std::cerr << "Problem getting volume " << vol_index << std::endl;
     return 2;
   }
 
+  if( capture_file && MB_SUCCESS != dagmc.start_capture( capture_file ) ){
+    return 2;
+  }
+
   /* Fire any rays specified with -f flag */
   if( rays.size() > 0 ){
     
@@ -279,12 +437,16 @@ int main( int argc, char* argv[] )
       std::cout << " Ray: point = " << ray.p << " dir = " << ray.v << std::endl;
 
       // added ray orientation
-      rval = dagmc.ray_fire( vol, ray.p.array(), ray.v.array(), surf, dist, NULL, 0, 1, trv_stats );
+      rval = dagmc.ray_fire( vol, ray.p.array(), ray.v.array(), surf, dist, NULL, dist_limit, 1, trv_stats );
 
       if(MB_SUCCESS != rval) {
         std::cerr << "ERROR: ray_fire() failed!" << std::endl;
         return 2;
       }      
+      if(0 == surf && dist_limit > 0) {
+        std::cout << "       hits no surface within dist=" << dist_limit << std::endl;
+        continue;
+      }
       if(0 == surf) {
         std::cerr << "ERROR: Ray finds no surface.  Particle is lost." << std::endl;
         // might as well keep going here, in case other user specified rays were given
@@ -298,6 +460,11 @@ int main( int argc, char* argv[] )
   }
 
 
+  /* Fire any rays in the -F file, spread over threads */
+  if( ray_file && fire_bulk_rays( dagmc, vol ) ){
+    return 2;
+  }
+
   /* Fire and time random rays */
   if( num_random_rays > 0 ){
     std::cout << "Firing " << num_random_rays 
@@ -314,6 +481,12 @@ int main( int argc, char* argv[] )
 #ifdef DEBUG
   double uavg = 0.0, vavg = 0.0, wavg = 0.0;
 #endif
+
+  // storage for batched rays
+  std::vector<EntityHandle> batch_vols( std::max(batch_size, 0), vol ), batch_surfs( batch_vols.size() );
+  std::vector<double> batch_starts( 3*batch_vols.size() ), batch_dirs( 3*batch_vols.size() ),
+    batch_dists( batch_vols.size() );
+  int batch_count = 0, num_batches = 0;
   
   for (int j = 0; j < num_random_rays; j++) {
     RNDVEC(uvw, location_az);
@@ -328,13 +501,45 @@ int main( int argc, char* argv[] )
               << " " << uvw << " " << uvw%uvw << std::endl;
     uavg += uvw[0]; vavg += uvw[1]; wavg += uvw[2];
 #endif
+    if( batch_size > 0 ){
+      // queue the ray, firing the batch once it is full or the last ray is in
+      std::copy( xyz.array(), xyz.array()+3, &batch_starts[3*batch_count] );
+      std::copy( uvw.array(), uvw.array()+3, &batch_dirs[3*batch_count] );
+      if( ++batch_count < batch_size && j+1 < num_random_rays )
+        continue;
+
+      double utilization;
+      dagmc.ray_fire_batch( batch_count, &batch_vols[0], &batch_starts[0], &batch_dirs[0],
+                            &batch_surfs[0], &batch_dists[0], dist_limit, 1, &utilization );
+      packet_utilization += utilization;
+      num_batches++;
+      for( int k = 0; k < batch_count; k++ ){
+        if( batch_surfs[k] == 0 && dist_limit > 0 ){ random_rays_limited++; }
+        else if( batch_surfs[k] == 0){ random_rays_missed++; }
+      }
+      batch_count = 0;
+      continue;
+    }
+
     // added ray orientation
-    dagmc.ray_fire(vol, xyz.array(), uvw.array(), surf, dist, NULL, 0, 1, trv_stats );
+    dagmc.ray_fire(vol, xyz.array(), uvw.array(), surf, dist, NULL, dist_limit, 1, trv_stats );
 
-    if( surf == 0){ random_rays_missed++; }
+    if( surf == 0 && dist_limit > 0 ){ random_rays_limited++; }
+    else if( surf == 0){ random_rays_missed++; }
 
   }
+  if( num_batches )
+    packet_utilization /= num_batches;
   get_time_mem(ttime2, utime2, stime2, tmem1);
+  if( capture_file ){
+    dagmc.stop_capture();
+  }
+  if( scene_budget_mb > 0 ){
+    SceneCacheStats stats = dagmc.RTC->scene_cache_stats();
+    std::cout << "Scene cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+              << stats.rebuilds << " rebuilds, " << stats.evictions << " evictions, peak "
+              << stats.peak_bytes / (1024.0*1024.0) << " MB" << std::endl;
+  }
   double timewith = ttime2 - ttime1;
 
   srand(randseed); // reseed to generate the same values as before
@@ -357,16 +562,34 @@ int main( int argc, char* argv[] )
   if( random_rays_missed ){
     std::cout << "Warning: " << random_rays_missed << " random rays did not hit the target volume" << std::endl;
   }
+
+  if( dist_limit > 0 ){
+    std::cout << random_rays_limited << " random rays hit no surface within the distance limit of "
+              << dist_limit << std::endl;
+  }
   
   if( num_random_rays > 0 ){
     std::cout << "Total time per ray fire: " << timewith/num_random_rays 
 	      << " sec" << std::endl;
     std::cout << "Estimated time per call (excluding ray generation): " 
 	      << (timewith - timewithout) / num_random_rays << " sec" << std::endl;
+    if( timewith - timewithout > 0 )
+      std::cout << "Estimated throughput (excluding ray generation): "
+                << num_random_rays / (timewith - timewithout) << " rays/sec" << std::endl;
+    if( batch_size > 0 )
+      std::cout << "Packet utilization: " << 100.0*packet_utilization << "% of lanes" << std::endl;
   }
   std::cout << "Program memory used: " 
             << tmem2 << " bytes (" << tmem2/(1024*1024) << " MB)" << std::endl;
 
+  if( release_mesh ){
+    if( do_trv_stats ){
+      std::cout << "Traversal statistics:" << std::endl;
+      trv_stats->print( std::cout );
+    }
+    return 0;
+  }
+
   /* Gather OBB tree stats and make final reports */
   EntityHandle root;
   ErrorCode result = dagmc.get_root(vol, root);
@@ -548,6 +771,12 @@ void dump_pyfile( char* filename, double timewith, double timewithout, double tm
 
   DICT_VAL(num_random_rays);
   DICT_VAL(random_rays_missed);
+  DICT_VAL(dist_limit);
+  DICT_VAL(random_rays_limited);
+  DICT_VAL(overlap_thickness);
+  DICT_VAL(spatial_order);
+  DICT_VAL(batch_size);
+  DICT_VAL(packet_utilization);
   if( num_random_rays > 0 ){
     DICT_VAL(randseed);
     DICT_VAL(timewith);
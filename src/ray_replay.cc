@@ -0,0 +1,227 @@
+#include "moab/Interface.hpp"
+#include "moab/Core.hpp"
+#include "DagMC.hpp"
+#include "ray_capture.hpp"
+
+#include <vector>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace moab;
+
+/* Replays the queries captured by DagMC::start_capture against a geometry,
+   which must be the file the capture was made with so that the volume
+   handles match.  Each query is repeated without a ray history, so results
+   of rays that had one may differ from the captured ones; the count of such
+   differences is reported as a diagnostic.
+
+   With -N the queries are replayed twice, first with a single copy of the
+   scenes and then with a copy on each NUMA node, the threads being spread
+   over the nodes in both runs. */
+
+static double facet_tol = 1e-4;
+static int num_threads = 1;
+static double overlap_thickness = 0;
+static bool compare_numa = false;
+
+static void usage( const char* error, const char* name = "ray_replay" )
+{
+  std::ostream& str = error ? std::cerr : std::cout;
+  if (error)
+    str << error << std::endl;
+  str << "Usage: " << name << " [options] geometry_file capture_file" << std::endl;
+  str << "-h  print this help" << std::endl;
+  str << "-t <real>  specify faceting tolerance (default 1e-4)" << std::endl;
+  str << "-T <int>   number of threads replaying the queries (default 1)" << std::endl;
+  str << "-O <real>  if present, replay in overlap-tolerant mode with this overlap thickness" << std::endl;
+  str << "-N  compare a single copy of the scenes with a copy on each NUMA node" << std::endl;
+  exit( error ? 1 : 0 );
+}
+
+// replays records [begin, end), counting the results that differ from the capture
+static void replay( DagMC* dagmc, const QueryRecord* records, size_t begin, size_t end,
+                    size_t* mismatches, size_t* failures )
+{
+  for (size_t i = begin; i < end; ++i) {
+    const QueryRecord &rec = records[i];
+    ErrorCode rval;
+    bool same;
+    if (QUERY_RAY_FIRE == rec.type) {
+      EntityHandle surf;
+      double dist;
+      rval = dagmc->ray_fire( rec.volume, rec.point, rec.dir, surf, dist, NULL,
+                              rec.dist_limit, rec.orientation );
+      same = surf == rec.surf && ( 0 == surf || fabs(dist - rec.dist) <= 1e-6*(1.0 + fabs(dist)) );
+    }
+    else {
+      int result;
+      rval = dagmc->point_in_volume( rec.volume, rec.point, result, rec.dir );
+      same = result == rec.result;
+    }
+    if (MB_SUCCESS != rval)
+      ++*failures;
+    else if (!same)
+      ++*mismatches;
+  }
+}
+
+// replays records [begin, end) on a thread pinned to node
+static void replay_on_node( const NumaTopology* topology, int node, DagMC* dagmc,
+                            const QueryRecord* records, size_t begin, size_t end,
+                            size_t* mismatches, size_t* failures )
+{
+  topology->pin_thread( node );
+  replay( dagmc, records, begin, end, mismatches, failures );
+}
+
+// replays every record on num_threads threads, spread over the NUMA nodes if
+// pinned, returning the time taken
+static double replay_all( DagMC& dagmc, const QueryRecord* records, size_t num_records,
+                          bool pinned, size_t& num_mismatches, size_t& num_failures )
+{
+  std::vector<size_t> mismatches( num_threads, 0 ), failures( num_threads, 0 );
+  const NumaTopology& topology = dagmc.numa_topology();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if (1 == num_threads && !pinned) {
+    replay( &dagmc, records, 0, num_records, &mismatches[0], &failures[0] );
+  }
+  else {
+    std::vector<std::thread> threads;
+    size_t chunk = ( num_records + num_threads - 1 ) / num_threads;
+    for (int t = 0; t < num_threads; ++t) {
+      size_t begin = std::min( t*chunk, num_records );
+      if (pinned)
+        threads.push_back( std::thread( replay_on_node, &topology, t % topology.num_nodes(),
+                                        &dagmc, records, begin, std::min( begin+chunk, num_records ),
+                                        &mismatches[t], &failures[t] ) );
+      else
+        threads.push_back( std::thread( replay, &dagmc, records, begin,
+                                        std::min( begin+chunk, num_records ),
+                                        &mismatches[t], &failures[t] ) );
+    }
+    for (unsigned t = 0; t < threads.size(); ++t)
+      threads[t].join();
+  }
+  double time = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+  num_mismatches = num_failures = 0;
+  for (int t = 0; t < num_threads; ++t) {
+    num_mismatches += mismatches[t];
+    num_failures += failures[t];
+  }
+  return time;
+}
+
+int main( int argc, char* argv[] )
+{
+  const char* filenames[2] = { NULL, NULL };
+  int num_files = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] == '-' && argv[i][1] && !argv[i][2]) {
+      if ('h' == argv[i][1])
+        usage( 0, argv[0] );
+      if ('N' == argv[i][1]) {
+        compare_numa = true;
+        continue;
+      }
+      if (++i == argc)
+        usage( "Expected argument following option", argv[0] );
+      switch (argv[i-1][1]) {
+        case 't': facet_tol = atof( argv[i] );         break;
+        case 'T': num_threads = atoi( argv[i] );       break;
+        case 'O': overlap_thickness = atof( argv[i] ); break;
+        default:  usage( "Invalid option", argv[0] );  break;
+      }
+    }
+    else if (num_files < 2) {
+      filenames[num_files++] = argv[i];
+    }
+    else {
+      usage( "Unexpected parameter", argv[0] );
+    }
+  }
+  if (num_files != 2)
+    usage( "Expected a geometry file and a capture file", argv[0] );
+  if (num_threads < 1)
+    num_threads = 1;
+
+  // map the capture and check that it was written by this version
+  int fd = open( filenames[1], O_RDONLY );
+  struct stat st;
+  if (fd < 0 || fstat( fd, &st ) || size_t(st.st_size) < sizeof(CaptureHeader)) {
+    std::cerr << "Failed to read capture file '" << filenames[1] << "'" << std::endl;
+    return 2;
+  }
+  void* map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if (MAP_FAILED == map) {
+    std::cerr << "Failed to map capture file '" << filenames[1] << "'" << std::endl;
+    return 2;
+  }
+  const CaptureHeader* header = static_cast<const CaptureHeader*>(map);
+  if (memcmp( header->magic, "EMDAGQRY", 8 ) || QueryCapture::version != header->version ||
+      sizeof(QueryRecord) != header->record_size) {
+    std::cerr << "'" << filenames[1] << "' is not a capture of this version" << std::endl;
+    return 2;
+  }
+  const QueryRecord* records = reinterpret_cast<const QueryRecord*>( header+1 );
+  const size_t num_records = ( st.st_size - sizeof(CaptureHeader) ) / sizeof(QueryRecord);
+  madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+  DagMC& dagmc = *DagMC::instance();
+  ErrorCode rval = dagmc.load_file( filenames[0], facet_tol );
+  if (MB_SUCCESS != rval) {
+    std::cerr << "Failed to load file '" << filenames[0] << "'" << std::endl;
+    return 2;
+  }
+  rval = dagmc.init_OBBTree();
+  if (MB_SUCCESS != rval) {
+    std::cerr << "Failed to initialize DagMC." << std::endl;
+    return 2;
+  }
+  if (overlap_thickness > 0)
+    dagmc.set_overlap_thickness( overlap_thickness );
+
+  std::cout << "Replaying " << num_records << " queries on " << num_threads
+            << " thread(s)..." << std::flush;
+
+  size_t num_mismatches, num_failures;
+  double time = replay_all( dagmc, records, num_records, compare_numa,
+                            num_mismatches, num_failures );
+  std::cout << " done." << std::endl;
+
+  if (compare_numa) {
+    std::cout << "Single copy of the scenes: " << time << " s, "
+              << ( time > 0 ? num_records/time : 0.0 ) << " queries per second" << std::endl;
+    rval = dagmc.set_numa_replication( true );
+    if (MB_SUCCESS != rval) {
+      std::cerr << "Failed to copy the scenes to the NUMA nodes." << std::endl;
+      return 2;
+    }
+    double single_time = time;
+    std::cout << "Replaying on " << dagmc.numa_topology().num_nodes()
+              << " NUMA node(s)..." << std::flush;
+    time = replay_all( dagmc, records, num_records, true, num_mismatches, num_failures );
+    std::cout << " done." << std::endl;
+    std::cout << "Copy on each NUMA node: " << time << " s, "
+              << ( time > 0 ? num_records/time : 0.0 ) << " queries per second" << std::endl;
+    std::cout << "Speedup: " << ( time > 0 ? single_time/time : 0.0 ) << std::endl;
+  }
+
+  std::cout << "Total time: " << time << " s" << std::endl;
+  std::cout << "Queries per second: " << ( time > 0 ? num_records/time : 0.0 ) << std::endl;
+  std::cout << "Results differing from the capture: " << num_mismatches << std::endl;
+  if (num_failures)
+    std::cout << "Failed queries: " << num_failures << std::endl;
+
+  munmap( map, st.st_size );
+  return 0;
+}
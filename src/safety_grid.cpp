@@ -0,0 +1,203 @@
+#include "safety_grid.hpp"
+
+#include <algorithm>
+#include <thread>
+#include <math.h>
+
+// squared distance of a voxel not yet reached by the transform
+static const float far_dist2 = 1.0e30f;
+
+/* exact 1D squared distance transform of a line of voxels (Felzenszwalb and
+   Huttenlocher), as the lower envelope of the parabolas rooted at the voxels
+   with a finite value. v and z hold n and n+1 entries of scratch space. */
+static void edt_line(const double *f, double *d, int n, int *v, double *z)
+{
+  int k = -1;
+  for ( int q = 0; q < n; q++ )
+    {
+      if ( f[q] >= far_dist2 )
+	continue;
+      double s = -HUGE_VAL;
+      while ( k >= 0 )
+	{
+	  s = ( (f[q] + double(q)*q) - (f[v[k]] + double(v[k])*v[k]) ) / ( 2.0*(q - v[k]) );
+	  if ( s > z[k] )
+	    break;
+	  k--;
+	}
+      if ( k < 0 )
+	s = -HUGE_VAL;
+      k++;
+      v[k] = q;
+      z[k] = s;
+      z[k+1] = HUGE_VAL;
+    }
+
+  if ( k < 0 )
+    {
+      std::fill( d, d+n, double(far_dist2) );
+      return;
+    }
+
+  k = 0;
+  for ( int q = 0; q < n; q++ )
+    {
+      while ( z[k+1] < q )
+	k++;
+      d[q] = double(q - v[k])*(q - v[k]) + f[v[k]];
+    }
+}
+
+/* transforms lines [begin, end) of the grid along one axis */
+static void edt_lines(float *dist2, const int *dims, int axis, unsigned begin, unsigned end)
+{
+  const int n = dims[axis];
+  const size_t stride = ( 0 == axis ) ? 1 : ( 1 == axis ) ? dims[0] : size_t(dims[0])*dims[1];
+  std::vector<double> f(n), d(n), z(n+1);
+  std::vector<int> v(n);
+
+  for ( unsigned line = begin; line < end; line++ )
+    {
+      size_t base;
+      if ( 0 == axis )
+	base = size_t(line)*dims[0];
+      else if ( 1 == axis )
+	base = ( line % dims[0] ) + size_t(line / dims[0])*dims[0]*dims[1];
+      else
+	base = line;
+
+      for ( int i = 0; i < n; i++ )
+	f[i] = dist2[base + i*stride];
+      edt_line( &f[0], &d[0], n, &v[0], &z[0] );
+      for ( int i = 0; i < n; i++ )
+	dist2[base + i*stride] = float( std::min( d[i], double(far_dist2) ) );
+    }
+}
+
+SafetyGrid::SafetyGrid(const std::vector<double> &tris, size_t max_bytes, unsigned num_threads) : h(0.0)
+{
+  dims[0] = dims[1] = dims[2] = 0;
+  origin[0] = origin[1] = origin[2] = 0.0;
+  unsigned num_tris = tris.size()/9;
+  if ( 0 == num_tris )
+    return;
+
+  double lo[3], hi[3];
+  for ( unsigned j = 0; j < 3; j++ )
+    lo[j] = hi[j] = tris[j];
+  for ( size_t i = 0; i < tris.size(); i++ )
+    {
+      lo[i%3] = std::min( lo[i%3], tris[i] );
+      hi[i%3] = std::max( hi[i%3], tris[i] );
+    }
+
+  // the largest grid of cubic voxels that fits in the budget
+  size_t max_cells = std::max( max_bytes/sizeof(float), size_t(1) );
+  double extent[3], longest = 0.0;
+  for ( unsigned j = 0; j < 3; j++ )
+    {
+      extent[j] = hi[j] - lo[j];
+      longest = std::max( longest, extent[j] );
+    }
+  if ( 0.0 == longest )
+    return;
+  double box = 1.0;
+  for ( unsigned j = 0; j < 3; j++ )
+    box *= std::max( extent[j], 1.0e-6*longest );
+  h = cbrt( box / max_cells );
+  for ( ;; )
+    {
+      size_t num_cells = 1;
+      for ( unsigned j = 0; j < 3; j++ )
+	{
+	  dims[j] = int( extent[j]/h ) + 1;
+	  num_cells *= dims[j];
+	}
+      if ( num_cells <= max_cells )
+	break;
+      h *= 1.05;
+    }
+  std::copy( lo, lo+3, origin );
+
+  // mark every voxel overlapped by a triangle's bounding box
+  const size_t num_cells = size_t(dims[0])*dims[1]*dims[2];
+  std::vector<float> dist2( num_cells, far_dist2 );
+  for ( unsigned t = 0; t < num_tris; t++ )
+    {
+      const double *p = &tris[9*t];
+      int first[3], last[3];
+      for ( unsigned j = 0; j < 3; j++ )
+	{
+	  double tlo = std::min( p[j], std::min( p[3+j], p[6+j] ) );
+	  double thi = std::max( p[j], std::max( p[3+j], p[6+j] ) );
+	  first[j] = std::min( int( (tlo-origin[j])/h ), dims[j]-1 );
+	  last[j] = std::min( int( (thi-origin[j])/h ), dims[j]-1 );
+	}
+      for ( int k = first[2]; k <= last[2]; k++ )
+	for ( int j = first[1]; j <= last[1]; j++ )
+	  for ( int i = first[0]; i <= last[0]; i++ )
+	    dist2[i + size_t(dims[0])*(j + size_t(dims[1])*k)] = 0.0f;
+    }
+
+  distance_transform( dist2, num_threads );
+
+  // convert to a bound on the distance from the voxel center
+  const double half_diagonal = 0.5*sqrt(3.0)*h;
+  bounds.resize( num_cells );
+  for ( size_t i = 0; i < num_cells; i++ )
+    {
+      double b = h*sqrt( double(dist2[i]) ) - half_diagonal;
+      float f = float(b);
+      if ( double(f) > b )
+	f = nextafterf( f, -HUGE_VALF );
+      bounds[i] = f;
+    }
+}
+
+void SafetyGrid::distance_transform(std::vector<float> &dist2, unsigned num_threads)
+{
+  if ( 0 == num_threads )
+    num_threads = std::thread::hardware_concurrency();
+  num_threads = std::max( num_threads, 1u );
+
+  // the transform is separable: one pass of independent lines per axis
+  for ( int axis = 0; axis < 3; axis++ )
+    {
+      unsigned num_lines = dist2.size() / dims[axis];
+      unsigned threads_used = std::min( num_threads, num_lines );
+      if ( threads_used <= 1 )
+	{
+	  edt_lines( &dist2[0], dims, axis, 0, num_lines );
+	  continue;
+	}
+
+      std::vector<std::thread> threads;
+      unsigned chunk = ( num_lines + threads_used - 1 ) / threads_used;
+      for ( unsigned begin = 0; begin < num_lines; begin += chunk )
+	threads.push_back( std::thread( edt_lines, &dist2[0], dims, axis, begin,
+					std::min( begin+chunk, num_lines ) ) );
+      for ( unsigned i = 0; i < threads.size(); i++ )
+	threads[i].join();
+    }
+}
+
+double SafetyGrid::lower_bound(const double pt[3]) const
+{
+  if ( bounds.empty() )
+    return 0.0;
+
+  int idx[3];
+  double offset2 = 0.0;
+  for ( unsigned j = 0; j < 3; j++ )
+    {
+      double x = ( pt[j] - origin[j] ) / h;
+      if ( !( x >= 0.0 && x < dims[j] ) )
+	return 0.0;
+      idx[j] = int(x);
+      double from_center = ( x - idx[j] - 0.5 )*h;
+      offset2 += from_center*from_center;
+    }
+
+  double b = bounds[idx[0] + size_t(dims[0])*(idx[1] + size_t(dims[1])*idx[2])] - sqrt(offset2);
+  return ( b > 0.0 ) ? b : 0.0;
+}
@@ -0,0 +1,40 @@
+#ifndef SAFETY_GRID_HPP
+#define SAFETY_GRID_HPP
+
+#include <vector>
+#include <cstddef>
+
+/* Conservative distance to a triangulated surface, looked up in O(1).
+
+   The surface's bounding box is divided into cubic voxels, as many as fit in
+   a memory budget. Every voxel touched by a triangle's bounding box is marked
+   and an exact Euclidean distance transform gives, for each voxel, the
+   distance between its center and the nearest marked voxel's center. As no
+   triangle lies outside the marked voxels, that distance less the voxel
+   diagonal bounds the distance from anywhere in the voxel to the surface.
+   Near the surface and outside the grid the bound is 0, and the caller is
+   expected to fall back to an exact query. */
+class SafetyGrid {
+  public:
+  // tris holds 9 coordinates (v0, v1, v2) per triangle; the grid uses at most
+  // max_bytes and is built by num_threads threads (0 for one per hardware thread)
+  SafetyGrid(const std::vector<double> &tris, size_t max_bytes, unsigned num_threads = 0);
+
+  // lower bound on the distance from pt to the nearest triangle, 0 if unknown
+  double lower_bound(const double pt[3]) const;
+
+  double voxel_size() const { return h; }
+  size_t memory() const { return bounds.size()*sizeof(float); }
+
+  private:
+  double origin[3];
+  double h;
+  int dims[3];
+  // distance from each voxel's center to the surface, less half the voxel
+  // diagonal, rounded down; x varies fastest
+  std::vector<float> bounds;
+
+  void distance_transform(std::vector<float> &dist2, unsigned num_threads);
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include "MBTagConventions.hpp"
 #include "moab/Range.hpp"
 #include "moab/CartVect.hpp"
+#include "ray_capture.hpp"
 
 #ifdef USE_MPI
 #include "moab_mpi.h"
@@ -15,6 +16,7 @@
 #include <limits>
 #include <algorithm>
 #include <stdio.h> // for remove()
+#include <string.h>
 
 #define CHKERR if (MB_SUCCESS != rval) return rval
 
@@ -29,14 +31,53 @@ ErrorCode write_geometry( const char* output_file_name );
 
 ErrorCode test_ray_fire( DagMC& );
 
+ErrorCode test_ray_fire_dist_limit( DagMC& );
+
+ErrorCode test_ray_fire_batch( DagMC& );
+
+ErrorCode test_ray_fire_shared_edge( DagMC& );
+
+ErrorCode test_ray_fire_orientation( DagMC& );
+
+ErrorCode test_query_capture( DagMC& );
+
+ErrorCode test_ray_intersections( DagMC& );
+
+ErrorCode test_get_angle_history( DagMC& );
+
 ErrorCode test_point_in_volume( DagMC& );
 
+ErrorCode test_points_in_volume_slow( DagMC& );
+
+ErrorCode test_safety_distance( DagMC& );
+
+ErrorCode test_find_volume( DagMC& );
+
 ErrorCode test_measure_volume( DagMC& );
 
 ErrorCode test_measure_area( DagMC& );
 
 ErrorCode test_surface_sense( DagMC& );
 
+ErrorCode test_variant( DagMC& );
+
+ErrorCode test_volume_motion( DagMC& );
+ErrorCode test_numa_replication( DagMC& );
+
+ErrorCode test_release_mesh( DagMC& );
+
+// Create file containing two 2x2x2 cubes, volume 1 centered at the
+// origin and volume 2, a translated copy of it, centered at (4,0,0).
+// Volume 1 is in the group "mat_5_rho_2.7_imp_n/2" and surface 1 in the
+// group "tally_4"; volume 2 and the other surfaces have no properties.
+ErrorCode instance_write_geometry( const char* output_file_name );
+ErrorCode reload_geometry( DagMC&, ErrorCode (*write_geom)( const char* ) );
+ErrorCode test_instancing( DagMC& );
+ErrorCode test_property_tables( DagMC& );
+ErrorCode test_property_index( DagMC& );
+ErrorCode test_load_volumes( DagMC& );
+ErrorCode test_scene_cache( DagMC& );
+
 ErrorCode overlap_write_geometry( const char* output_file_name );
 ErrorCode overlap_test_ray_fire( DagMC& );
 ErrorCode overlap_test_point_in_volume( DagMC& );
@@ -278,6 +319,160 @@ ErrorCode overlap_write_geometry( const char* output_file_name )
   return MB_SUCCESS;
 }
 
+ErrorCode instance_write_geometry( const char* output_file_name )
+{
+  ErrorCode rval;
+  Core moab_instance;
+  Interface& moab = moab_instance;
+
+  const double coords[] = {
+    1, -1, -1,
+    1,  1, -1,
+   -1,  1, -1,
+   -1, -1, -1,
+    1, -1,  1,
+    1,  1,  1,
+   -1,  1,  1,
+   -1, -1,  1 };
+  const int connectivity[] = {
+    0, 3, 1,  3, 2, 1, // -Z
+    0, 1, 4,  5, 4, 1, // +X
+    1, 2, 6,  6, 5, 1, // +Y
+    6, 2, 3,  7, 6, 3, // -X
+    0, 4, 3,  7, 3, 4, // -Y
+    4, 5, 6,  6, 7, 4};// +Z
+  const double shift[] = { 0.0, 4.0 };
+
+  const unsigned tris_per_surf = 2;
+  const unsigned num_cubes = 2;
+  const unsigned verts_per_cube = sizeof(coords) / (3*sizeof(double));
+  const unsigned tris_per_cube = sizeof(connectivity) / (3*sizeof(int));
+  const unsigned surfs_per_cube = tris_per_cube / tris_per_surf;
+  const unsigned num_surfs = num_cubes*surfs_per_cube;
+
+  Tag dim_tag, id_tag, sense_tag;
+  rval = moab.tag_get_handle( GEOM_DIMENSION_TAG_NAME,
+                              1, MB_TYPE_INTEGER,
+                              dim_tag,
+                              MB_TAG_SPARSE|MB_TAG_CREAT );
+  CHKERR;
+  rval = moab.tag_get_handle( GLOBAL_ID_TAG_NAME,
+                              1, MB_TYPE_INTEGER,
+                              id_tag,
+                              MB_TAG_DENSE|MB_TAG_CREAT );
+  CHKERR;
+  rval = moab.tag_get_handle( "GEOM_SENSE_2",
+                              2, MB_TYPE_HANDLE,
+                              sense_tag,
+                              MB_TAG_SPARSE|MB_TAG_CREAT );
+  CHKERR;
+
+  // the cubes are made alike, so that the second is an instance of the first
+  EntityHandle surfs[num_surfs], vols[num_cubes];
+  for (unsigned c = 0; c < num_cubes; ++c) {
+    EntityHandle verts[verts_per_cube], tris[tris_per_cube];
+    for (unsigned i = 0; i < verts_per_cube; ++i) {
+      const double xyz[] = { coords[3*i] + shift[c], coords[3*i+1], coords[3*i+2] };
+      rval = moab.create_vertex( xyz, verts[i] );
+      CHKERR;
+    }
+    for (unsigned i = 0; i < tris_per_cube; ++i) {
+      const EntityHandle conn[] = { verts[connectivity[3*i  ]],
+                                    verts[connectivity[3*i+1]],
+                                    verts[connectivity[3*i+2]] };
+      rval = moab.create_element( MBTRI, conn, 3, tris[i] );
+      CHKERR;
+    }
+
+    rval = moab.create_meshset( MESHSET_SET, vols[c] );
+    CHKERR;
+    for (unsigned i = 0; i < surfs_per_cube; ++i) {
+      EntityHandle& surf = surfs[c*surfs_per_cube + i];
+      rval = moab.create_meshset( MESHSET_SET, surf );
+      CHKERR;
+      rval = moab.add_entities( surf, tris + i*tris_per_surf, tris_per_surf );
+      CHKERR;
+      rval = moab.add_parent_child( vols[c], surf );
+      CHKERR;
+      const EntityHandle senses[] = { vols[c], 0 };
+      rval = moab.tag_set_data( sense_tag, &surf, 1, senses );
+      CHKERR;
+    }
+  }
+
+  std::vector<int> dims( num_surfs, 2 );
+  rval = moab.tag_set_data( dim_tag, surfs, num_surfs, &dims[0] );
+  CHKERR;
+  std::vector<int> ids( num_surfs );
+  for (size_t i = 0; i < ids.size(); ++i) ids[i] = i+1;
+  rval = moab.tag_set_data( id_tag, surfs, num_surfs, &ids[0] );
+  CHKERR;
+
+  const int threes[] = { 3, 3 }, vol_ids[] = { 1, 2 };
+  rval = moab.tag_set_data( dim_tag, vols, num_cubes, threes );
+  CHKERR;
+  rval = moab.tag_set_data( id_tag, vols, num_cubes, vol_ids );
+  CHKERR;
+
+  // property groups
+  Tag name_tag, category_tag;
+  rval = moab.tag_get_handle( NAME_TAG_NAME, NAME_TAG_SIZE, MB_TYPE_OPAQUE,
+                              name_tag, MB_TAG_SPARSE|MB_TAG_CREAT );
+  CHKERR;
+  rval = moab.tag_get_handle( CATEGORY_TAG_NAME, CATEGORY_TAG_SIZE, MB_TYPE_OPAQUE,
+                              category_tag, MB_TAG_SPARSE|MB_TAG_CREAT );
+  CHKERR;
+  const char* group_names[] = { "mat_5_rho_2.7_imp_n/2", "tally_4" };
+  const EntityHandle group_members[] = { vols[0], surfs[0] };
+  for (unsigned i = 0; i < 2; ++i) {
+    EntityHandle group;
+    rval = moab.create_meshset( MESHSET_SET, group );
+    CHKERR;
+    rval = moab.add_entities( group, group_members + i, 1 );
+    CHKERR;
+    char name[NAME_TAG_SIZE] = { 0 }, category[CATEGORY_TAG_SIZE] = { 0 };
+    strcpy( name, group_names[i] );
+    strcpy( category, "Group" );
+    rval = moab.tag_set_data( name_tag, &group, 1, name );
+    CHKERR;
+    rval = moab.tag_set_data( category_tag, &group, 1, category );
+    CHKERR;
+  }
+
+  rval = moab.write_mesh( output_file_name );
+  CHKERR;
+
+  return MB_SUCCESS;
+}
+
+// loads the geometry of instance_write_geometry and parses its groups
+static ErrorCode load_property_geometry( DagMC& dagmc )
+{
+  ErrorCode rval = reload_geometry( dagmc, instance_write_geometry );
+  CHKERR;
+  std::vector<std::string> keywords;
+  keywords.push_back( "mat" );
+  keywords.push_back( "rho" );
+  keywords.push_back( "imp" );
+  keywords.push_back( "tally" );
+  return dagmc.parse_properties( keywords );
+}
+
+// replaces the loaded geometry with the one write_geom creates, for the
+// tests that need a geometry or settings of their own
+ErrorCode reload_geometry( DagMC& dagmc, ErrorCode (*write_geom)( const char* ) )
+{
+  const char* filename = "test_geom_reload.h5m";
+  ErrorCode rval = dagmc.moab_instance()->delete_mesh();
+  CHKERR;
+  rval = write_geom( filename );
+  if (MB_SUCCESS == rval)
+    rval = dagmc.load_file( filename, 0 );
+  remove( filename );
+  CHKERR;
+  return dagmc.init_OBBTree();
+}
+
 static bool run_test( std::string name, int argc, char* argv[] )
 {
   if (argc == 1)
@@ -330,10 +525,21 @@ int main( int argc, char* argv[] )
   
   int errors = 0;
   RUN_TEST( test_ray_fire );
+  RUN_TEST( test_ray_fire_dist_limit );
+  RUN_TEST( test_ray_fire_orientation );
+  RUN_TEST( test_ray_fire_shared_edge );
+  RUN_TEST( test_query_capture );
+  RUN_TEST( test_ray_intersections );
+  RUN_TEST( test_get_angle_history );
   RUN_TEST( test_point_in_volume );
+  RUN_TEST( test_points_in_volume_slow );
+  RUN_TEST( test_safety_distance );
+  RUN_TEST( test_find_volume );
   RUN_TEST( test_measure_volume );
   RUN_TEST( test_measure_area );
   RUN_TEST( test_surface_sense );
+  RUN_TEST( test_variant );
+  RUN_TEST( test_numa_replication );
  
   // change settings to use overlap-tolerant mode (arbitrary thickness)
   double overlap_thickness = 0.1;
@@ -341,6 +547,17 @@ int main( int argc, char* argv[] )
   RUN_TEST( test_ray_fire );
   RUN_TEST( test_point_in_volume );
 
+  // the tests below load geometries and settings of their own
+  dagmc.set_overlap_thickness( 0 );
+  RUN_TEST( test_release_mesh );
+  RUN_TEST( test_volume_motion );
+  RUN_TEST( test_ray_fire_batch );
+  RUN_TEST( test_instancing );
+  RUN_TEST( test_property_tables );
+  RUN_TEST( test_property_index );
+  RUN_TEST( test_load_volumes );
+  RUN_TEST( test_scene_cache );
+
   // clear moab and dagmc instance
   rval = dagmc.moab_instance()->delete_mesh();
   if (MB_SUCCESS != rval) {
@@ -356,7 +573,6 @@ int main( int argc, char* argv[] )
     return 1;
   }
   
-  dagmc = *DagMC::instance();
   rval = dagmc.moab_instance()->load_file( filename );
   remove( filename );
   if (MB_SUCCESS != rval) {
@@ -417,6 +633,31 @@ ErrorCode test_surface_sense( DagMC& dagmc )
       return MB_FAILURE;
     }
   }
+
+  // the table init_OBBTree reads in bulk answers as the sense tag does
+  if (dagmc.em_surf_vols.empty()) {
+    std::cerr << "ERROR: the surface senses were not read in bulk" << std::endl;
+    return MB_FAILURE;
+  }
+  std::vector<int> table_senses, tag_senses;
+  std::vector<ErrorCode> table_rvals, tag_rvals;
+  const std::vector<EntityHandle> table = dagmc.em_surf_vols;
+  for (int pass = 0; pass < 2; ++pass) {
+    std::vector<int>& senses = pass ? tag_senses : table_senses;
+    std::vector<ErrorCode>& rvals = pass ? tag_rvals : table_rvals;
+    for (Range::iterator v = vols.begin(); v != vols.end(); ++v)
+      for (Range::iterator i = surfs.begin(); i != surfs.end(); ++i) {
+        int sense = 0;
+        rvals.push_back( dagmc.surface_sense( *v, *i, sense ) );
+        senses.push_back( sense );
+      }
+    dagmc.em_surf_vols.clear();
+  }
+  dagmc.em_surf_vols = table;
+  if (table_senses != tag_senses || table_rvals != tag_rvals) {
+    std::cerr << "ERROR: the bulk surface senses differ from the sense tag" << std::endl;
+    return MB_FAILURE;
+  }
   
   return MB_SUCCESS;
 }  
@@ -456,6 +697,31 @@ ErrorCode overlap_test_surface_sense( DagMC& dagmc )
       return MB_FAILURE;
     }
   }
+
+  // the table init_OBBTree reads in bulk answers as the sense tag does
+  if (dagmc.em_surf_vols.empty()) {
+    std::cerr << "ERROR: the surface senses were not read in bulk" << std::endl;
+    return MB_FAILURE;
+  }
+  std::vector<int> table_senses, tag_senses;
+  std::vector<ErrorCode> table_rvals, tag_rvals;
+  const std::vector<EntityHandle> table = dagmc.em_surf_vols;
+  for (int pass = 0; pass < 2; ++pass) {
+    std::vector<int>& senses = pass ? tag_senses : table_senses;
+    std::vector<ErrorCode>& rvals = pass ? tag_rvals : table_rvals;
+    for (Range::iterator v = vols.begin(); v != vols.end(); ++v)
+      for (Range::iterator i = surfs.begin(); i != surfs.end(); ++i) {
+        int sense = 0;
+        rvals.push_back( dagmc.surface_sense( *v, *i, sense ) );
+        senses.push_back( sense );
+      }
+    dagmc.em_surf_vols.clear();
+  }
+  dagmc.em_surf_vols = table;
+  if (table_senses != tag_senses || table_rvals != tag_rvals) {
+    std::cerr << "ERROR: the bulk surface senses differ from the sense tag" << std::endl;
+    return MB_FAILURE;
+  }
   
   return MB_SUCCESS;
 }  
@@ -757,129 +1023,553 @@ ErrorCode test_ray_fire( DagMC& dagmc )
   return MB_SUCCESS;
 }
 
-ErrorCode overlap_test_ray_fire( DagMC& dagmc )
+ErrorCode test_get_angle_history( DagMC& dagmc )
 {
-  // Glancing ray-triangle intersections are not valid exit intersections. 
-  // Piercing ray-triangle intersections are valid exit intersections.
-  // "0" destination surface implies that it is ambiguous.
-  const struct ray_fire tests[] = {
-    /*          ____________________
-                |                   |
-       -x <---  | region1 | overlap | region0 |   ---> +x
-                          |                   |
-                          ---------------------
-       -x <--- -1.0      0.0      0.01        1.0 ---> +x
-     surf_id:   10        4         8         2
-
-     The zero-distance advance would occur in the implicit volume between
-     these two regions---not in this volume.
-
-     src_srf origin               direction                 dest dist */
-    // numerical location on surface 1 of region0
-    { 4, { 1.0,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 2,  0.0   },
-    { 2, { 1.0,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  1.0   },
-    // numerical location inside region0
-    { 4, { 0.5,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 2,  0.5   },
-    { 2, { 0.5,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  0.5   },
-    // numerical location on surface 7 of region1
-    { 4, { 0.01, 0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  0.0   },
-    { 2, { 0.01, 0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  0.01  },
-    // numerical location inside overlap
-    { 10,{ 0.005,0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  0.005 },
-    { 2, { 0.005,0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  0.005 },
-    // numerical location on surface 3 of region0
-    { 10,{ 0.0,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  0.01  },
-    { 8, { 0.0,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  0.0   },
-    // numerical location inside region1
-    { 10,{-0.5,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  0.51  },
-    { 8, {-0.5,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 10, 0.5   },
-    // numerical location on surface 9 of region1
-    { 10,{-1.0,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  1.01  },
-    { 8, {-1.0,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 10, 0.0   }  };
+  // Rays that hit the +X face (surface 2) in a facet interior, on the edge
+  // between its two facets and from the implicit complement. The normal kept
+  // by the history must match the normal from the facets near the hit.
+  const struct { double origin[3]; double direction[3]; bool impl_compl; } tests[] = {
+    { { 0.5, 0.2, 0.0 }, {  1.0, 0.0, 0.0 }, false },
+    { { 0.5, 0.0, 0.0 }, {  1.0, 0.0, 0.0 }, false },
+    { { 2.0, 0.2, 0.0 }, { -1.0, 0.0, 0.0 }, true  } };
+  const double expected[] = { 1.0, 0.0, 0.0 };
 
   ErrorCode rval;
   Interface& moab = *dagmc.moab_instance();
 
   Tag dim_tag = dagmc.geom_tag();
-  Range surfs, vols;
-  const int two = 2, three = 3;
-  const void* ptrs[] = { &two, &three };
-  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, 
-                                            ptrs, 1, surfs );
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
   CHKERR;
-  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, 
-                                            ptrs+1, 1, vols );
+  const EntityHandle expected_surf = dagmc.entity_by_id( 2, 2 );
+
+  const int num_test = sizeof(tests) / sizeof(tests[0]);
+  for (int i = 0; i < num_test; ++i) {
+    EntityHandle vol = vols.front();
+    if (dagmc.is_implicit_complement( vol ) != tests[i].impl_compl)
+      vol = vols.back();
+
+    double dist;
+    EntityHandle result;
+    DagMC::RayHistory history;
+    rval = dagmc.ray_fire( vol, tests[i].origin, tests[i].direction, result, dist, &history );
+    CHKERR;
+    if (result != expected_surf) {
+      std::cerr << "ray_fire did not hit surface 2 in get_angle test " << i << std::endl;
+      return MB_FAILURE;
+    }
+
+    CartVect loc = CartVect(tests[i].origin) + (dist * CartVect(tests[i].direction));
+    double with_history[3], without_history[3];
+    rval = dagmc.get_angle( result, loc.array(), with_history, &history );
+    CHKERR;
+    rval = dagmc.get_angle( result, loc.array(), without_history );
+    CHKERR;
+    for (int j = 0; j < 3; ++j) {
+      if (fabs(with_history[j] - expected[j]) > 1e-6 ||
+          fabs(without_history[j] - expected[j]) > 1e-6) {
+        std::cerr << "get_angle test " << i << " failed, expected (1,0,0), got ("
+                  << with_history[0] << "," << with_history[1] << "," << with_history[2]
+                  << ") with history and (" << without_history[0] << ","
+                  << without_history[1] << "," << without_history[2]
+                  << ") without" << std::endl;
+        return MB_FAILURE;
+      }
+    }
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_ray_fire_batch( DagMC& dagmc )
+{
+  const unsigned num_rays = 20;
+
+  // the scenes take packets only if asked before they are built
+  dagmc.RTC->packets = true;
+  ErrorCode rval = reload_geometry( dagmc, write_geometry );
+  dagmc.RTC->packets = false;
   CHKERR;
-  
-  if (vols.size() != 2) {
-    std::cerr << "ERROR: Expected 2 volumes in input, found " << vols.size() 
-              << std::endl;
-    return MB_FAILURE;
+
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+  EntityHandle impl_compl = 0;
+  for (Range::iterator v = vols.begin(); v != vols.end(); ++v)
+    if (dagmc.is_implicit_complement( *v ))
+      impl_compl = *v;
+
+  // rays from inside the first volume in scattered directions, and every
+  // third one from above the cube in the implicit complement, so that the
+  // batch is sorted into packets of either volume
+  std::vector<EntityHandle> volumes( num_rays, vols.front() ), surfs( num_rays );
+  std::vector<double> starts( 3*num_rays ), dirs( 3*num_rays ), dists( num_rays );
+  for (unsigned i = 0; i < num_rays; ++i) {
+    double theta = 2.0*M_PI*i/num_rays, w = 1.0 - 2.0*(i+0.5)/num_rays;
+    starts[3*i] = 0.1*cos(theta);
+    starts[3*i+1] = 0.1*sin(theta);
+    starts[3*i+2] = -0.5;
+    dirs[3*i] = sqrt(1.0-w*w)*cos(3.0*theta);
+    dirs[3*i+1] = sqrt(1.0-w*w)*sin(3.0*theta);
+    dirs[3*i+2] = w;
+    if (2 == i%3) {
+      volumes[i] = impl_compl;
+      starts[3*i+2] = 3.0;
+      dirs[3*i+2] = -fabs( w );
+    }
   }
-  const unsigned num_surf = 12;
-  if (surfs.size() != num_surf) {
-    std::cerr << "ERROR: Expected " << num_surf << " surfaces in input, found " 
-              << surfs.size() << std::endl;
+
+  double utilization = 0.0;
+  rval = dagmc.ray_fire_batch( num_rays, &volumes[0], &starts[0], &dirs[0], &surfs[0], &dists[0],
+                               0, 1, &utilization );
+  CHKERR;
+  if (!(utilization > 0.0)) {
+    std::cerr << "ERROR: ray_fire_batch fired no packets" << std::endl;
     return MB_FAILURE;
   }
-  
-  int ids[num_surf];
-  rval = moab.tag_get_data( dagmc.id_tag(), surfs, ids );
-  CHKERR;
-  EntityHandle surf[num_surf];
-  std::copy( surfs.begin(), surfs.end(), surf );
-  
-  const int num_test = sizeof(tests) / sizeof(tests[0]);
-  for (int i = 0; i < num_test; ++i) {
-    int* ptr = std::find( ids, ids+num_surf, tests[i].prev_surf );
-    unsigned idx = ptr - ids;
-    if (idx >= num_surf) {
-      std::cerr << "Surface " << tests[i].prev_surf << " not found." << std::endl;
+
+  // each ray must find what ray_fire finds on its own
+  for (unsigned i = 0; i < num_rays; ++i) {
+    EntityHandle surf;
+    double dist;
+    rval = dagmc.ray_fire( volumes[i], &starts[3*i], &dirs[3*i], surf, dist );
+    CHKERR;
+    if (surf != surfs[i] || fabs(dist - dists[i]) > 1e-6) {
+      std::cerr << "ERROR testing ray_fire_batch[" << i << "]: expected surface "
+                << surf << " at " << dist << ", got " << surfs[i] << " at "
+                << dists[i] << std::endl;
       return MB_FAILURE;
     }
-    //const EntityHandle src_surf = surf[idx];
-    
-    ptr = std::find( ids, ids+num_surf, tests[i].hit_surf );
-    idx = ptr - ids;
-    if (idx >= num_surf) {
-      std::cerr << "Surface " << tests[i].hit_surf << " not found." << std::endl;
-      return MB_FAILURE;
+  }
+
+  // with the first volume moving 10 along x, each ray starts where the volume
+  // is at its own time; every other ray has overshot the -Z face it left
+  // through and must find it behind its origin
+  dagmc.RTC->packets = true;
+  dagmc.set_volume_motion( 1, CartVect( 10.0, 0.0, 0.0 ) );
+  rval = reload_geometry( dagmc, write_geometry );
+  dagmc.set_volume_motion( 1, CartVect( 0.0, 0.0, 0.0 ) );
+  dagmc.RTC->packets = false;
+  CHKERR;
+
+  const EntityHandle vol1 = dagmc.entity_by_id( 3, 1 );
+  std::vector<double> times( num_rays );
+  for (unsigned i = 0; i < num_rays; ++i) {
+    double theta = 2.0*M_PI*i/num_rays, w = 1.0 - 2.0*(i+0.5)/num_rays;
+    times[i] = double(i)/(num_rays-1);
+    volumes[i] = vol1;
+    starts[3*i] = 10.0*times[i] + 0.1*cos(theta);
+    starts[3*i+1] = 0.1*sin(theta);
+    starts[3*i+2] = -0.5;
+    dirs[3*i] = sqrt(1.0-w*w)*cos(3.0*theta);
+    dirs[3*i+1] = sqrt(1.0-w*w)*sin(3.0*theta);
+    dirs[3*i+2] = w;
+    if (1 == i%2) {
+      starts[3*i+2] = -1.0 - 1e-4;
+      dirs[3*i] = dirs[3*i+1] = 0.0;
+      dirs[3*i+2] = -1.0;
     }
-    const EntityHandle hit_surf = surf[idx];
+  }
 
+  rval = dagmc.ray_fire_batch( num_rays, &volumes[0], &starts[0], &dirs[0], &surfs[0], &dists[0],
+                               0, 1, NULL, &times[0] );
+  CHKERR;
+  for (unsigned i = 0; i < num_rays; ++i) {
+    EntityHandle surf;
     double dist;
-    EntityHandle result;
-    rval = dagmc.ray_fire( vols.front(), 
-                           tests[i].origin, tests[i].direction,
-                           result, dist );
-    
-    if (result != hit_surf || fabs(dist - tests[i].distance) > 1e-6) {
-      EntityHandle *p = std::find( surf, surf+6, result );
-      idx = p - surf;
-      int id = idx > num_surf-1 ? 0 : ids[idx];
-      
-      std::cerr << "Rayfire test failed for " << std::endl
-                << "\t ray from (" << tests[i].origin[0] 
-                << ", " << tests[i].origin[1] << ", "
-                << tests[i].origin[2] << ") going ["
-                << tests[i].direction[0] << ", " 
-                << tests[i].direction[1] << ", "
-                << tests[i].direction[2] << "]" << std::endl
-                << "\t Beginning on surface " << tests[i].prev_surf << std::endl
-                << "\t Expected to hit surface " << tests[i].hit_surf << " after " 
-                << tests[i].distance << " units." << std::endl
-                << "\t Actually hit surface " << id << " after " << dist << " units."
-                << std::endl;
+    rval = dagmc.ray_fire( volumes[i], &starts[3*i], &dirs[3*i], surf, dist, NULL, 0, 1, NULL, times[i] );
+    CHKERR;
+    if (0 == surfs[i] || surf != surfs[i] || fabs(dist - dists[i]) > 1e-6 ||
+        (1 == i%2 && (surfs[i] != dagmc.entity_by_id( 2, 1 ) || 0 != dists[i]))) {
+      std::cerr << "ERROR testing ray_fire_batch[" << i << "] at time " << times[i]
+                << ": expected surface " << surf << " at " << dist << ", got "
+                << surfs[i] << " at " << dists[i] << std::endl;
       return MB_FAILURE;
     }
   }
-  
+
   return MB_SUCCESS;
 }
 
-struct PointInVol { double coords[3]; int result; double dir[3]; };
-
-ErrorCode test_point_in_volume( DagMC& dagmc )
+ErrorCode test_ray_fire_shared_edge( DagMC& dagmc )
+{
+  // The -Z face (surface 1) is split into two triangles along the diagonal
+  // through (0,0,-1), and the four triangles of the concave +Z face (surface
+  // 6) meet at the vertex (0,0,0).  A ray that crossed either point is
+  // fired again from it with its history; the neighbouring triangles met at
+  // the same place must be skipped as the crossed one is, leaving no surface.
+  const double starts[][3] = { { 0.0, 0.0, -0.5 }, { 0.0, 0.0, -0.5 } };
+  const double dirs[][3] = { { 0.0, 0.0, -1.0 }, { 0.0, 0.0, 1.0 } };
+  const int surf_ids[] = { 1, 6 };
+  const char* where[] = { "shared edge", "shared vertex" };
+
+  ErrorCode rval;
+  const EntityHandle vol = dagmc.entity_by_id( 3, 1 );
+
+  // only the overlap-tolerant ray_fire skips the facets of the history
+  dagmc.set_overlap_thickness( 0.1 );
+  for (int i = 0; i < 2; ++i) {
+    DagMC::RayHistory history;
+    EntityHandle first, again;
+    double dist, again_dist;
+    rval = dagmc.ray_fire( vol, starts[i], dirs[i], first, dist, &history );
+    if (MB_SUCCESS != rval)
+      break;
+    const double on[] = { starts[i][0] + dist*dirs[i][0], starts[i][1] + dist*dirs[i][1],
+                          starts[i][2] + dist*dirs[i][2] };
+    rval = dagmc.ray_fire( vol, on, dirs[i], again, again_dist, &history );
+    if (MB_SUCCESS != rval)
+      break;
+    if (first != dagmc.entity_by_id( 2, surf_ids[i] ) || fabs( dist - 0.5 ) > 1e-6 || 0 != again) {
+      std::cerr << "ERROR: a ray from the " << where[i] << " of surface " << surf_ids[i]
+                << " hit surface " << ( again ? dagmc.get_entity_id( again ) : 0 ) << " at " << again_dist
+                << " after crossing it" << std::endl;
+      rval = MB_FAILURE;
+      break;
+    }
+  }
+  dagmc.set_overlap_thickness( 0 );
+
+  return rval;
+}
+
+ErrorCode test_ray_fire_dist_limit( DagMC& dagmc )
+{
+  // A ray from (0,0,-0.5) going -Z hits the -Z face (surface 1) after 0.5 units.
+  const double origin[] = { 0.0, 0.0, -0.5 };
+  const double direction[] = { 0.0, 0.0, -1.0 };
+  const double expected_dist = 0.5;
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+  const EntityHandle expected_surf = dagmc.entity_by_id( 2, 1 );
+
+  // a limit beyond the surface should not change the result
+  double dist;
+  EntityHandle result;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, result, dist, NULL, 1.0 );
+  CHKERR;
+  if (result != expected_surf || fabs(dist - expected_dist) > 1e-6) {
+    std::cerr << "ERROR: ray_fire with a distance limit of 1.0 expected to hit surface 1 after "
+              << expected_dist << " units.  Got a distance of " << dist << std::endl;
+    return MB_FAILURE;
+  }
+
+  // a limit short of the surface should report no hit, at the limit
+  const double limit = 0.25;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, result, dist, NULL, limit );
+  CHKERR;
+  if (0 != result || dist != limit) {
+    std::cerr << "ERROR: ray_fire with a distance limit of " << limit
+              << " expected no hit at the limit.  Got a distance of " << dist << std::endl;
+    return MB_FAILURE;
+  }
+
+  // a particle just past the surface it left through finds that surface at
+  // 0 with or without a limit, and one that just came in through it does not
+  const double past[] = { 0.3, 0.1, -1.0005 };
+  const double entered[] = { 0.3, 0.1, -0.9995 };
+  const double up[] = { 0.0, 0.0, 1.0 };
+  EntityHandle unlimited_result;
+  double unlimited_dist;
+  rval = dagmc.ray_fire( vols.front(), past, direction, unlimited_result, unlimited_dist );
+  CHKERR;
+  rval = dagmc.ray_fire( vols.front(), past, direction, result, dist, NULL, limit );
+  CHKERR;
+  if (unlimited_result != expected_surf || 0.0 != unlimited_dist ||
+      result != unlimited_result || dist != unlimited_dist) {
+    std::cerr << "ERROR: ray_fire from just past surface 1 got distances of "
+              << unlimited_dist << " unlimited and " << dist << " limited, expected 0" << std::endl;
+    return MB_FAILURE;
+  }
+  rval = dagmc.ray_fire( vols.front(), entered, up, result, dist, NULL, limit );
+  CHKERR;
+  if (0 != result || dist != limit) {
+    std::cerr << "ERROR: ray_fire just inside surface 1 found the surface behind it" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_query_capture( DagMC& dagmc )
+{
+  const char* filename = "test_geom_capture.tmp";
+  const double origin[] = { 0.0, 0.0, -0.5 };
+  const double direction[] = { 0.0, 0.0, -1.0 };
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+
+  // capture one query of each type
+  rval = dagmc.start_capture( filename );
+  CHKERR;
+  EntityHandle surf;
+  double dist;
+  int inside;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, surf, dist );
+  CHKERR;
+  rval = dagmc.point_in_volume( vols.front(), origin, inside );
+  CHKERR;
+  rval = dagmc.stop_capture();
+  CHKERR;
+
+  CaptureHeader header;
+  QueryRecord records[3];
+  FILE* file = fopen( filename, "rb" );
+  if (!file)
+    return MB_FAILURE;
+  size_t num_headers = fread( &header, sizeof(header), 1, file );
+  size_t num_records = fread( records, sizeof(QueryRecord), 3, file );
+  fclose( file );
+  remove( filename );
+
+  if (1 != num_headers || sizeof(QueryRecord) != header.record_size || 2 != num_records) {
+    std::cerr << "ERROR: expected a header and 2 records in the capture, got "
+              << num_records << " records" << std::endl;
+    return MB_FAILURE;
+  }
+  if (QUERY_RAY_FIRE != records[0].type || vols.front() != records[0].volume ||
+      surf != records[0].surf || dist != records[0].dist || origin[2] != records[0].point[2]) {
+    std::cerr << "ERROR: captured ray_fire does not match the query" << std::endl;
+    return MB_FAILURE;
+  }
+  if (QUERY_POINT_IN_VOLUME != records[1].type || inside != records[1].result) {
+    std::cerr << "ERROR: captured point_in_volume does not match the query" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_ray_fire_orientation( DagMC& dagmc )
+{
+  // A ray from (0.5,0,0.2) going -X leaves the volume through the concave
+  // +Z face (surface 6, plane z = x) after 0.3 units and re-enters it through
+  // the plane z = -x after 0.7 units.
+  const double origin[] = { 0.5, 0.0, 0.2 };
+  const double direction[] = { -1.0, 0.0, 0.0 };
+  const int orientations[] = { 1, -1 };
+  const double expected_dists[] = { 0.3, 0.7 };
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+  const EntityHandle expected_surf = dagmc.entity_by_id( 2, 6 );
+
+  for (int i = 0; i < 2; ++i) {
+    double dist;
+    EntityHandle result;
+    rval = dagmc.ray_fire( vols.front(), origin, direction, result, dist, NULL, 0,
+                           orientations[i] );
+    CHKERR;
+    if (result != expected_surf || fabs(dist - expected_dists[i]) > 1e-6) {
+      std::cerr << "ERROR: ray_fire with orientation " << orientations[i]
+                << " expected to hit surface 6 after " << expected_dists[i]
+                << " units.  Got a distance of " << dist << std::endl;
+      return MB_FAILURE;
+    }
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_ray_intersections( DagMC& dagmc )
+{
+  // A ray from (0.5,0,0.2) going -X crosses the concave +Z face (surface 6)
+  // at 0.3 and 0.7 units, then leaves through the -X face (surface 4) at 1.5.
+  const double origin[] = { 0.5, 0.0, 0.2 };
+  const double direction[] = { -1.0, 0.0, 0.0 };
+  const int expected_ids[] = { 6, 6, 4 };
+  const double expected_dists[] = { 0.3, 0.7, 1.5 };
+  const unsigned num_expected = 3;
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+
+  // fire at the volume, then at the whole model
+  const EntityHandle targets[] = { vols.front(), 0 };
+  for (int t = 0; t < 2; ++t) {
+    std::vector<double> dists;
+    std::vector<EntityHandle> surfs;
+    rval = dagmc.ray_intersections( targets[t], origin, direction, dists, surfs );
+    CHKERR;
+    if (dists.size() != num_expected) {
+      std::cerr << "ERROR: ray_intersections expected " << num_expected
+                << " hits, got " << dists.size() << std::endl;
+      return MB_FAILURE;
+    }
+    for (unsigned i = 0; i < num_expected; ++i) {
+      if (surfs[i] != dagmc.entity_by_id( 2, expected_ids[i] ) ||
+          fabs(dists[i] - expected_dists[i]) > 1e-6) {
+        std::cerr << "ERROR: ray_intersections hit " << i << " expected on surface "
+                  << expected_ids[i] << " after " << expected_dists[i]
+                  << " units.  Got a distance of " << dists[i] << std::endl;
+        return MB_FAILURE;
+      }
+    }
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode overlap_test_ray_fire( DagMC& dagmc )
+{
+  // Glancing ray-triangle intersections are not valid exit intersections. 
+  // Piercing ray-triangle intersections are valid exit intersections.
+  // "0" destination surface implies that it is ambiguous.
+  const struct ray_fire tests[] = {
+    /*          ____________________
+                |                   |
+       -x <---  | region1 | overlap | region0 |   ---> +x
+                          |                   |
+                          ---------------------
+       -x <--- -1.0      0.0      0.01        1.0 ---> +x
+     surf_id:   10        4         8         2
+
+     The zero-distance advance would occur in the implicit volume between
+     these two regions---not in this volume.
+
+     src_srf origin               direction                 dest dist */
+    // numerical location on surface 1 of region0
+    { 4, { 1.0,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 2,  0.0   },
+    { 2, { 1.0,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  1.0   },
+    // numerical location inside region0
+    { 4, { 0.5,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 2,  0.5   },
+    { 2, { 0.5,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  0.5   },
+    // numerical location on surface 7 of region1
+    { 4, { 0.01, 0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  0.0   },
+    { 2, { 0.01, 0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  0.01  },
+    // numerical location inside overlap
+    { 10,{ 0.005,0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  0.005 },
+    { 2, { 0.005,0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  0.005 },
+    // numerical location on surface 3 of region0
+    { 10,{ 0.0,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  0.01  },
+    { 8, { 0.0,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 4,  0.0   },
+    // numerical location inside region1
+    { 10,{-0.5,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  0.51  },
+    { 8, {-0.5,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 10, 0.5   },
+    // numerical location on surface 9 of region1
+    { 10,{-1.0,  0.0, 0.0 }, {  1.0, 0.0, 0.0 }            , 8,  1.01  },
+    { 8, {-1.0,  0.0, 0.0 }, { -1.0, 0.0, 0.0 }            , 10, 0.0   }  };
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range surfs, vols;
+  const int two = 2, three = 3;
+  const void* ptrs[] = { &two, &three };
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, 
+                                            ptrs, 1, surfs );
+  CHKERR;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, 
+                                            ptrs+1, 1, vols );
+  CHKERR;
+  
+  if (vols.size() != 2) {
+    std::cerr << "ERROR: Expected 2 volumes in input, found " << vols.size() 
+              << std::endl;
+    return MB_FAILURE;
+  }
+  const unsigned num_surf = 12;
+  if (surfs.size() != num_surf) {
+    std::cerr << "ERROR: Expected " << num_surf << " surfaces in input, found " 
+              << surfs.size() << std::endl;
+    return MB_FAILURE;
+  }
+  
+  int ids[num_surf];
+  rval = moab.tag_get_data( dagmc.id_tag(), surfs, ids );
+  CHKERR;
+  EntityHandle surf[num_surf];
+  std::copy( surfs.begin(), surfs.end(), surf );
+  
+  const int num_test = sizeof(tests) / sizeof(tests[0]);
+  for (int i = 0; i < num_test; ++i) {
+    int* ptr = std::find( ids, ids+num_surf, tests[i].prev_surf );
+    unsigned idx = ptr - ids;
+    if (idx >= num_surf) {
+      std::cerr << "Surface " << tests[i].prev_surf << " not found." << std::endl;
+      return MB_FAILURE;
+    }
+    //const EntityHandle src_surf = surf[idx];
+    
+    ptr = std::find( ids, ids+num_surf, tests[i].hit_surf );
+    idx = ptr - ids;
+    if (idx >= num_surf) {
+      std::cerr << "Surface " << tests[i].hit_surf << " not found." << std::endl;
+      return MB_FAILURE;
+    }
+    const EntityHandle hit_surf = surf[idx];
+
+    double dist;
+    EntityHandle result;
+    rval = dagmc.ray_fire( vols.front(), 
+                           tests[i].origin, tests[i].direction,
+                           result, dist );
+    
+    if (result != hit_surf || fabs(dist - tests[i].distance) > 1e-6) {
+      EntityHandle *p = std::find( surf, surf+6, result );
+      idx = p - surf;
+      int id = idx > num_surf-1 ? 0 : ids[idx];
+      
+      std::cerr << "Rayfire test failed for " << std::endl
+                << "\t ray from (" << tests[i].origin[0] 
+                << ", " << tests[i].origin[1] << ", "
+                << tests[i].origin[2] << ") going ["
+                << tests[i].direction[0] << ", " 
+                << tests[i].direction[1] << ", "
+                << tests[i].direction[2] << "]" << std::endl
+                << "\t Beginning on surface " << tests[i].prev_surf << std::endl
+                << "\t Expected to hit surface " << tests[i].hit_surf << " after " 
+                << tests[i].distance << " units." << std::endl
+                << "\t Actually hit surface " << id << " after " << dist << " units."
+                << std::endl;
+      return MB_FAILURE;
+    }
+  }
+  
+  return MB_SUCCESS;
+}
+
+struct PointInVol { double coords[3]; int result; double dir[3]; };
+
+ErrorCode test_point_in_volume( DagMC& dagmc )
 {
   const char* const NAME_ARR[] = { "Boundary", "Outside", "Inside" };
   const char* const* names = NAME_ARR + 1;
@@ -963,22 +1653,167 @@ ErrorCode test_point_in_volume( DagMC& dagmc )
   return MB_SUCCESS;
 }
 
-ErrorCode overlap_test_point_in_volume( DagMC& dagmc )
+ErrorCode test_points_in_volume_slow( DagMC& dagmc )
 {
-  const char* const NAME_ARR[] = { "Boundary", "Outside", "Inside" };
-  const char* const* names = NAME_ARR + 1;
-  const int INSIDE = 1, OUTSIDE = 0, BOUNDARY = -1;
-  const struct PointInVol tests[] = {
-    { { 0.5, 0.0, 0.5 }, INSIDE , { 0.0, 0.0, 0.0} },
-    { { 0.5, 0.0,-0.5 }, INSIDE , { 0.0, 0.0, 0.0} },
-    { { 0.5, 0.0, 0.0 }, INSIDE , { 0.0, 0.0, 0.0} },
-    { {-0.5, 0.0, 0.0 }, INSIDE , { 0.0, 0.0, 0.0} },
-    { { 0.5, 0.5, 0.0 }, INSIDE , { 0.0, 0.0, 0.0} },
-    { { 0.5,-0.5, 0.0 }, INSIDE , { 0.0, 0.0, 0.0} },
-    { { 1.1, 1.1, 1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
-    { {-1.1, 1.1, 1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
-    { {-1.1,-1.1, 1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
-    { { 1.1,-1.1, 1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
+  const int INSIDE = 1, OUTSIDE = 0;
+  const double coords[] = { 0.0, 0.0,-0.5,
+                            0.0, 0.0, 0.5,
+                            0.5, 0.0, 0.0,
+                            1.1, 1.1, 1.1 };
+  const int expected[] = { INSIDE, OUTSIDE, INSIDE, OUTSIDE };
+  const unsigned num_test = sizeof(expected) / sizeof(expected[0]);
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+  const EntityHandle vol = vols.front();
+
+  // the batch query must agree with the single point one, threaded or not
+  for (unsigned threads = 1; threads <= 2; ++threads) {
+    int results[num_test];
+    rval = dagmc.points_in_volume_slow( vol, num_test, coords, results, threads );
+    CHKERR;
+    for (unsigned i = 0; i < num_test; ++i) {
+      if (results[i] != expected[i]) {
+        std::cerr << "ERROR testing points_in_volume_slow[" << i << "] with "
+                  << threads << " thread(s): expected " << expected[i]
+                  << ", got " << results[i] << std::endl;
+        return MB_FAILURE;
+      }
+    }
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_safety_distance( DagMC& dagmc )
+{
+  const double coords[] = { 0.0, 0.0,-0.5,
+                            0.5, 0.0,-0.5,
+                            0.0, 0.0, 0.5,
+                            0.9, 0.9,-0.9,
+                            0.3,-0.2,-0.4 };
+  const unsigned num_test = sizeof(coords) / sizeof(coords[0]) / 3;
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+
+  rval = dagmc.build_safety_grids( 1024*1024 );
+  CHKERR;
+
+  // the safety distance is a lower bound on the exact one
+  for (Range::iterator v = vols.begin(); v != vols.end(); ++v) {
+    for (unsigned i = 0; i < num_test; ++i) {
+      double safety, exact;
+      rval = dagmc.safety_distance( *v, coords+3*i, safety );
+      CHKERR;
+      rval = dagmc.closest_to_location( *v, coords+3*i, exact );
+      CHKERR;
+      if (safety < 0.0 || safety > exact + 1e-12) {
+        std::cerr << "ERROR testing safety_distance[" << i << "]: got "
+                  << safety << ", exact distance is " << exact << std::endl;
+        return MB_FAILURE;
+      }
+    }
+  }
+
+  // the grid itself bounds a point 0.5 from the nearest wall, rather than
+  // leaving it to the exact query
+  const SafetyGrid* grid = dagmc.em_safety_grids[vols.front() - dagmc.em_scene_arr_offset];
+  if (!grid || !(grid->lower_bound( coords ) > 0.0)) {
+    std::cerr << "ERROR: the safety grid gives no bound at (0,0,-0.5)" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_find_volume( DagMC& dagmc )
+{
+  const double coords[] = { 0.0, 0.0,-0.5,
+                            0.5, 0.0, 0.0,
+                            0.0, 0.0, 0.5,
+                            0.0, 0.0, 2.0,
+                            0.9,-0.9, 0.9,
+                            0.5,-0.5,-2.0 };
+  const unsigned num_test = sizeof(coords) / sizeof(coords[0]) / 3;
+  const double dir[3] = { 1.0, 0.0, 0.0 };
+
+  ErrorCode rval;
+  EntityHandle expected[num_test];
+
+  // without a grid every volume is tested
+  dagmc.set_volume_grid( 0 );
+  rval = dagmc.build_volume_grid();
+  CHKERR;
+  for (unsigned i = 0; i < num_test; ++i) {
+    rval = dagmc.find_volume( coords+3*i, expected[i], dir );
+    if (MB_ENTITY_NOT_FOUND == rval)
+      expected[i] = 0;
+    else
+      CHKERR;
+  }
+
+  // (0,0,-0.5) is inside volume 1, (0,0,2) above the concave face and
+  // (0.5,-0.5,-2) below the cube are in the implicit complement
+  if (expected[0] != dagmc.entity_by_id( 3, 1 ) ||
+      !dagmc.is_implicit_complement( expected[3] ) ||
+      !dagmc.is_implicit_complement( expected[5] )) {
+    std::cerr << "ERROR: find_volume without a grid put known points in the wrong volumes" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // the grid must give the same volumes
+  dagmc.set_volume_grid( 8, 1024*1024 );
+  rval = dagmc.build_volume_grid();
+  CHKERR;
+  for (unsigned i = 0; i < num_test; ++i) {
+    EntityHandle vol;
+    rval = dagmc.find_volume( coords+3*i, vol, dir );
+    if (MB_ENTITY_NOT_FOUND == rval)
+      vol = 0;
+    else
+      CHKERR;
+    if (vol != expected[i]) {
+      std::cerr << "ERROR testing find_volume[" << i << "]: expected volume "
+                << expected[i] << ", got " << vol << std::endl;
+      return MB_FAILURE;
+    }
+  }
+
+  dagmc.set_volume_grid( 0 );
+  return dagmc.build_volume_grid();
+}
+
+ErrorCode overlap_test_point_in_volume( DagMC& dagmc )
+{
+  const char* const NAME_ARR[] = { "Boundary", "Outside", "Inside" };
+  const char* const* names = NAME_ARR + 1;
+  const int INSIDE = 1, OUTSIDE = 0, BOUNDARY = -1;
+  const struct PointInVol tests[] = {
+    { { 0.5, 0.0, 0.5 }, INSIDE , { 0.0, 0.0, 0.0} },
+    { { 0.5, 0.0,-0.5 }, INSIDE , { 0.0, 0.0, 0.0} },
+    { { 0.5, 0.0, 0.0 }, INSIDE , { 0.0, 0.0, 0.0} },
+    { {-0.5, 0.0, 0.0 }, INSIDE , { 0.0, 0.0, 0.0} },
+    { { 0.5, 0.5, 0.0 }, INSIDE , { 0.0, 0.0, 0.0} },
+    { { 0.5,-0.5, 0.0 }, INSIDE , { 0.0, 0.0, 0.0} },
+    { { 1.1, 1.1, 1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
+    { {-1.1, 1.1, 1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
+    { {-1.1,-1.1, 1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
+    { { 1.1,-1.1, 1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
     { { 1.1, 1.1,-1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
     { {-1.1, 1.1,-1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
     { {-1.1,-1.1,-1.1 }, OUTSIDE, { 0.0, 0.0, 0.0} },
@@ -1143,4 +1978,644 @@ ErrorCode overlap_test_tracking( DagMC& dagmc )
   return MB_SUCCESS;
 }
 
+ErrorCode test_variant( DagMC& dagmc )
+{
+  const double origin[] = { 0.0, 0.0, -0.5 };
+  const double moved_origin[] = { 10.0, 0.0, -0.5 };
+  const double direction[] = { 0.0, 0.0, -1.0 };
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+
+  EntityHandle base_surf;
+  double base_dist;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, base_surf, base_dist );
+  CHKERR;
+
+  // move the volume 10 along x
+  rtc* variant;
+  std::vector<int> ids( 1, dagmc.get_entity_id( vols.front() ) );
+  std::vector<CartVect> offsets( 1, CartVect( 10.0, 0.0, 0.0 ) );
+  rval = dagmc.create_variant( ids, offsets, variant );
+  CHKERR;
+
+  // the variant sees the volume at its new place
+  rval = dagmc.use_variant( variant );
+  CHKERR;
+  EntityHandle surf;
+  double dist;
+  int inside;
+  rval = dagmc.ray_fire( vols.front(), moved_origin, direction, surf, dist );
+  if (MB_SUCCESS == rval)
+    rval = dagmc.point_in_volume( vols.front(), moved_origin, inside );
+  // and cannot be deleted while this thread uses it
+  bool deleted = MB_SUCCESS == dagmc.delete_variant( variant );
+  dagmc.use_variant( NULL );
+  if (deleted) {
+    std::cerr << "ERROR: the variant in use was deleted" << std::endl;
+    return MB_FAILURE;
+  }
+  if (MB_SUCCESS != rval) {
+    dagmc.delete_variant( variant );
+    return rval;
+  }
+  if (surf != base_surf || fabs( dist - base_dist ) > 1e-6 || 1 != inside) {
+    std::cerr << "ERROR: the variant did not move the volume" << std::endl;
+    dagmc.delete_variant( variant );
+    return MB_FAILURE;
+  }
+
+  // while the base is unchanged
+  rval = dagmc.point_in_volume( vols.front(), moved_origin, inside );
+  if (MB_SUCCESS == rval)
+    rval = dagmc.delete_variant( variant );
+  CHKERR;
+  if (0 != inside) {
+    std::cerr << "ERROR: the variant moved the volume in the base" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_volume_motion( DagMC& dagmc )
+{
+  const double origin[] = { 0.0, 0.0, -0.5 };
+  const double direction[] = { 0.0, 0.0, -1.0 };
+
+  // the volume moves 10 along x over the times 0 to 1; the motion is only
+  // taken up by the scenes built after it is set
+  dagmc.set_volume_motion( 1, CartVect( 10.0, 0.0, 0.0 ) );
+  ErrorCode rval = reload_geometry( dagmc, write_geometry );
+  dagmc.set_volume_motion( 1, CartVect( 0.0, 0.0, 0.0 ) );
+  CHKERR;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+
+  EntityHandle start_surf, surf;
+  double start_dist, dist;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, start_surf, start_dist );
+  CHKERR;
+
+  // the same point moving with the volume is inside at every time, and the
+  // ray from it hits the same surface
+  const double times[] = { 0.0, 0.5, 1.0 };
+  for (int i = 0; i < 3; ++i) {
+    const double point[] = { origin[0] + 10.0*times[i], origin[1], origin[2] };
+    int inside;
+    rval = dagmc.point_in_volume( vols.front(), point, inside, NULL, NULL, times[i] );
+    CHKERR;
+    rval = dagmc.ray_fire( vols.front(), point, direction, surf, dist, NULL, 0, 1, NULL, times[i] );
+    CHKERR;
+    if (1 != inside || surf != start_surf || fabs( dist - start_dist ) > 1e-5) {
+      std::cerr << "ERROR: the volume is not where it moved to at time " << times[i] << std::endl;
+      return MB_FAILURE;
+    }
+  }
+
+  // and the volume has left its starting place by the end
+  int inside;
+  rval = dagmc.point_in_volume( vols.front(), origin, inside, NULL, NULL, 1.0 );
+  CHKERR;
+  if (0 != inside) {
+    std::cerr << "ERROR: the volume did not move" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // find_volume follows it by time, and the safety distance from a point it
+  // has moved to does not exceed the true one (0.5 to the -Z surface)
+  const double moved[] = { origin[0] + 10.0, origin[1], origin[2] };
+  EntityHandle found;
+  double safety;
+  rval = dagmc.find_volume( moved, found, NULL, 1.0 );
+  CHKERR;
+  rval = dagmc.safety_distance( vols.front(), moved, safety );
+  CHKERR;
+  if (found != vols.front() || safety > 0.5 + 1e-6) {
+    std::cerr << "ERROR: find_volume or safety_distance ignored the motion" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_numa_replication( DagMC& dagmc )
+{
+  const double origin[] = { 0.0, 0.0, -0.5 };
+  const double direction[] = { 0.0, 0.0, -1.0 };
+
+  ErrorCode rval;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+
+  EntityHandle base_surf, surf;
+  double base_dist, dist;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, base_surf, base_dist );
+  CHKERR;
+
+  // the copy on this thread's node answers as the single copy did; it is
+  // forced so that a machine with a single node has one too
+  rval = dagmc.set_numa_replication( true, true );
+  CHKERR;
+  const bool replica = dagmc.using_numa_replica();
+  int inside;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, surf, dist );
+  if (MB_SUCCESS == rval)
+    rval = dagmc.point_in_volume( vols.front(), origin, inside );
+  dagmc.set_numa_replication( false );
+  CHKERR;
+  // the copy is chosen by the node the thread runs on, if that is known
+  if (!replica && dagmc.numa_topology().current_node() >= 0) {
+    std::cerr << "ERROR: the queries did not use the NUMA copy of the scenes" << std::endl;
+    return MB_FAILURE;
+  }
+  if (dagmc.using_numa_replica()) {
+    std::cerr << "ERROR: the NUMA copies of the scenes were not freed" << std::endl;
+    return MB_FAILURE;
+  }
+  if (surf != base_surf || fabs( dist - base_dist ) > 1e-6 || 1 != inside) {
+    std::cerr << "ERROR: the NUMA copy of the scenes differs" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_release_mesh( DagMC& dagmc )
+{
+  const double origin[] = { 0.0, 0.0, -0.5 };
+  const double direction[] = { 0.0, 0.0, -1.0 };
+
+  // a fresh load, so that the scene of every surface is not built yet
+  ErrorCode rval = reload_geometry( dagmc, write_geometry );
+  CHKERR;
+  Interface& moab = *dagmc.moab_instance();
+
+  Tag dim_tag = dagmc.geom_tag();
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+
+  double vol_before, dist_before;
+  EntityHandle surf_before;
+  rval = dagmc.measure_volume( vols.front(), vol_before );
+  CHKERR;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, surf_before, dist_before );
+  CHKERR;
+
+  unsigned long long reclaimed = 0;
+  rval = dagmc.release_mesh( &reclaimed );
+  CHKERR;
+  Range tris;
+  rval = moab.get_entities_by_type( 0, MBTRI, tris );
+  CHKERR;
+  if (!dagmc.mesh_released() || !tris.empty() || 0 == reclaimed) {
+    std::cerr << "ERROR: " << tris.size() << " triangles left after releasing the mesh, "
+              << reclaimed << " bytes reclaimed" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // the Embree based queries and the kept measures still answer
+  double vol_after, dist_after;
+  EntityHandle surf_after;
+  int inside;
+  rval = dagmc.measure_volume( vols.front(), vol_after );
+  CHKERR;
+  rval = dagmc.ray_fire( vols.front(), origin, direction, surf_after, dist_after );
+  CHKERR;
+  rval = dagmc.point_in_volume( vols.front(), origin, inside );
+  CHKERR;
+  if (vol_after != vol_before || surf_after != surf_before || dist_after != dist_before || 1 != inside) {
+    std::cerr << "ERROR: queries changed after releasing the mesh" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // and the ones needing the triangles fail
+  double result;
+  if (MB_SUCCESS == dagmc.closest_to_location( vols.front(), origin, result )) {
+    std::cerr << "ERROR: closest_to_location succeeded without the mesh" << std::endl;
+    return MB_FAILURE;
+  }
+  std::vector<double> dists;
+  std::vector<EntityHandle> surfs;
+  if (MB_SUCCESS == dagmc.ray_intersections( 0, origin, direction, dists, surfs )) {
+    std::cerr << "ERROR: ray_intersections built the global scene without the mesh" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_instancing( DagMC& dagmc )
+{
+  // the ray crosses the +X face of volume 2 away from the triangles' edges
+  const double origin[] = { 4.0, 0.3, 0.5 };
+  const double direction[] = { 1.0, 0.0, 0.0 };
+
+  ErrorCode rval = reload_geometry( dagmc, instance_write_geometry );
+  CHKERR;
+
+  EntityHandle vol1 = dagmc.entity_by_id( 3, 1 ), vol2 = dagmc.entity_by_id( 3, 2 );
+  if (dagmc.em_prototypes[vol2 - dagmc.em_scene_arr_offset] != vol1 ||
+      dagmc.em_prototypes[vol1 - dagmc.em_scene_arr_offset] != 0) {
+    std::cerr << "ERROR: volume 2 is not an instance of volume 1" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // the instance answers at its own place, with its own surfaces
+  EntityHandle surf;
+  double dist;
+  rval = dagmc.ray_fire( vol2, origin, direction, surf, dist );
+  CHKERR;
+  if (surf != dagmc.entity_by_id( 2, 8 ) || fabs( dist - 1.0 ) > 1e-6) {
+    std::cerr << "ERROR: ray_fire in the instance hit surface " << dagmc.get_entity_id( surf )
+              << " at " << dist << ", expected surface 8 at 1" << std::endl;
+    return MB_FAILURE;
+  }
 
+  int inside, outside;
+  rval = dagmc.point_in_volume( vol2, origin, inside );
+  CHKERR;
+  const double origin1[] = { 0.0, 0.3, 0.5 };
+  rval = dagmc.point_in_volume( vol2, origin1, outside );
+  CHKERR;
+  if (1 != inside || 0 != outside) {
+    std::cerr << "ERROR: point_in_volume is wrong in the instance" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // the history holds the instance's facet, which the overlap-tolerant
+  // ray_fire skips when the ray is fired again
+  dagmc.set_overlap_thickness( 0.1 );
+  DagMC::RayHistory history;
+  EntityHandle first, again;
+  rval = dagmc.ray_fire( vol2, origin, direction, first, dist, &history );
+  if (MB_SUCCESS == rval)
+    rval = dagmc.ray_fire( vol2, origin, direction, again, dist, &history );
+  dagmc.set_overlap_thickness( 0 );
+  CHKERR;
+  if (first != dagmc.entity_by_id( 2, 8 ) || 0 != again) {
+    std::cerr << "ERROR: the history did not skip the crossed facet of the instance" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // without instancing, the copy has a scene of its own and the same answer
+  dagmc.set_instancing( false );
+  rval = reload_geometry( dagmc, instance_write_geometry );
+  dagmc.set_instancing( true );
+  CHKERR;
+  vol2 = dagmc.entity_by_id( 3, 2 );
+  if (dagmc.em_prototypes[vol2 - dagmc.em_scene_arr_offset] != 0) {
+    std::cerr << "ERROR: volume 2 is an instance with instancing off" << std::endl;
+    return MB_FAILURE;
+  }
+  rval = dagmc.ray_fire( vol2, origin, direction, surf, dist );
+  CHKERR;
+  if (surf != dagmc.entity_by_id( 2, 8 ) || fabs( dist - 1.0 ) > 1e-6) {
+    std::cerr << "ERROR: ray_fire without instancing hit surface " << dagmc.get_entity_id( surf )
+              << " at " << dist << ", expected surface 8 at 1" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+// fires rays in turn in volume 1, its instance volume 2 and the implicit
+// complement of the geometry of instance_write_geometry, recording the IDs
+// of the surfaces hit and the distances
+static ErrorCode fire_scene_cache_rays( DagMC& dagmc, std::vector<int>& ids,
+                                        std::vector<double>& dists )
+{
+  const unsigned num_rays = 30;
+  EntityHandle vols[] = { dagmc.entity_by_id( 3, 1 ), dagmc.entity_by_id( 3, 2 ), 0 };
+  for (int i = 1; i <= dagmc.num_entities( 3 ); ++i)
+    if (dagmc.is_implicit_complement( dagmc.entity_by_index( 3, i ) ))
+      vols[2] = dagmc.entity_by_index( 3, i );
+  const double centers[] = { 0.0, 4.0, 2.0 };
+
+  ids.clear();
+  dists.clear();
+  for (unsigned i = 0; i < num_rays; ++i) {
+    double theta = 2.0*M_PI*i/num_rays, w = 1.0 - 2.0*(i+0.5)/num_rays;
+    const double start[] = { centers[i%3] + 0.1*cos(theta), 0.1*sin(theta), 0.2 };
+    double dir[] = { sqrt(1.0-w*w)*cos(3.0*theta), sqrt(1.0-w*w)*sin(3.0*theta), w };
+    // the rays in the implicit complement head for one of the cubes
+    if (2 == i%3) {
+      dir[0] = (0 == i%2 ? 1.0 : -1.0) * (2.0 + fabs( dir[0] ));
+      const double len = sqrt( dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2] );
+      for (int j = 0; j < 3; ++j)
+        dir[j] /= len;
+    }
+    EntityHandle surf;
+    double dist;
+    ErrorCode rval = dagmc.ray_fire( vols[i%3], start, dir, surf, dist );
+    CHKERR;
+    ids.push_back( surf ? dagmc.get_entity_id( surf ) : 0 );
+    dists.push_back( dist );
+  }
+  return MB_SUCCESS;
+}
+
+ErrorCode test_scene_cache( DagMC& dagmc )
+{
+  std::vector<int> ids, cached_ids;
+  std::vector<double> dists, cached_dists;
+
+  ErrorCode rval = reload_geometry( dagmc, instance_write_geometry );
+  CHKERR;
+  rval = fire_scene_cache_rays( dagmc, ids, dists );
+  CHKERR;
+
+  // a budget of one byte evicts every scene not in use, so that each query
+  // rebuilds its scene from the Morton-ordered triangles kept for it, and
+  // volume 2 its instance of volume 1
+  dagmc.RTC->scene_budget = 1;
+  dagmc.RTC->spatial_order = true;
+  rval = reload_geometry( dagmc, instance_write_geometry );
+  if (MB_SUCCESS == rval)
+    rval = fire_scene_cache_rays( dagmc, cached_ids, cached_dists );
+  SceneCacheStats stats = dagmc.RTC->scene_cache_stats();
+  dagmc.RTC->scene_budget = 0;
+  dagmc.RTC->spatial_order = false;
+  CHKERR;
+
+  if (dagmc.em_prototypes[dagmc.entity_by_id( 3, 2 ) - dagmc.em_scene_arr_offset] == 0) {
+    std::cerr << "ERROR: volume 2 is not an instance with the scene cache" << std::endl;
+    return MB_FAILURE;
+  }
+  if (0 == stats.evictions || 0 == stats.rebuilds) {
+    std::cerr << "ERROR: the scene cache made " << stats.evictions << " evictions and "
+              << stats.rebuilds << " rebuilds" << std::endl;
+    return MB_FAILURE;
+  }
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (0 == ids[i] || ids[i] != cached_ids[i] || fabs( dists[i] - cached_dists[i] ) > 1e-6) {
+      std::cerr << "ERROR: ray " << i << " hit surface " << cached_ids[i] << " at "
+                << cached_dists[i] << " with the scene cache, expected surface "
+                << ids[i] << " at " << dists[i] << std::endl;
+      return MB_FAILURE;
+    }
+  }
+
+  return MB_SUCCESS;
+}
+
+// adds to a file a group with the GLOBAL_ID id that holds the volume of that
+// ID, which a partial read of the volume picks up too
+static ErrorCode add_id_group( const char* filename, int id )
+{
+  Core moab_instance;
+  Interface& moab = moab_instance;
+  ErrorCode rval = moab.load_file( filename );
+  CHKERR;
+
+  Tag dim_tag, id_tag, category_tag;
+  rval = moab.tag_get_handle( GEOM_DIMENSION_TAG_NAME, 1, MB_TYPE_INTEGER, dim_tag );
+  CHKERR;
+  rval = moab.tag_get_handle( GLOBAL_ID_TAG_NAME, 1, MB_TYPE_INTEGER, id_tag );
+  CHKERR;
+  rval = moab.tag_get_handle( CATEGORY_TAG_NAME, CATEGORY_TAG_SIZE, MB_TYPE_OPAQUE,
+                              category_tag, MB_TAG_SPARSE|MB_TAG_CREAT );
+  CHKERR;
+
+  Range vols;
+  const int three = 3;
+  const void* ptr = &three;
+  rval = moab.get_entities_by_type_and_tag( 0, MBENTITYSET, &dim_tag, &ptr, 1, vols );
+  CHKERR;
+  EntityHandle vol = 0;
+  for (Range::iterator v = vols.begin(); v != vols.end(); ++v) {
+    int vol_id;
+    rval = moab.tag_get_data( id_tag, &*v, 1, &vol_id );
+    CHKERR;
+    if (id == vol_id)
+      vol = *v;
+  }
+  if (0 == vol)
+    return MB_ENTITY_NOT_FOUND;
+
+  EntityHandle group;
+  rval = moab.create_meshset( MESHSET_SET, group );
+  CHKERR;
+  rval = moab.add_entities( group, &vol, 1 );
+  CHKERR;
+  rval = moab.tag_set_data( id_tag, &group, 1, &id );
+  CHKERR;
+  char category[CATEGORY_TAG_SIZE] = { 0 };
+  strcpy( category, "Group" );
+  rval = moab.tag_set_data( category_tag, &group, 1, category );
+  CHKERR;
+
+  return moab.write_mesh( filename );
+}
+
+ErrorCode test_load_volumes( DagMC& dagmc )
+{
+  const char* filename = "test_geom_volumes.h5m";
+  ErrorCode rval = dagmc.moab_instance()->delete_mesh();
+  CHKERR;
+  rval = instance_write_geometry( filename );
+  // the group is pruned, but not the requested volume it holds
+  if (MB_SUCCESS == rval)
+    rval = add_id_group( filename, 2 );
+  if (MB_SUCCESS == rval) {
+    std::vector<int> vol_ids( 1, 2 );
+    rval = dagmc.load_volumes( filename, vol_ids, 0 );
+  }
+  remove( filename );
+  CHKERR;
+  rval = dagmc.init_OBBTree();
+  CHKERR;
+
+  // the read also picks up surface 2 of volume 1, which must be pruned
+  // with its triangles and vertices
+  if (0 == dagmc.entity_by_id( 3, 2 ) || 0 != dagmc.entity_by_id( 3, 1 )) {
+    std::cerr << "ERROR: volume 2 alone was not loaded" << std::endl;
+    return MB_FAILURE;
+  }
+  if (6 != dagmc.num_entities( 2 ) || 0 != dagmc.entity_by_id( 2, 2 )) {
+    std::cerr << "ERROR: " << dagmc.num_entities( 2 ) << " surfaces loaded,"
+              << " expected the 6 surfaces of volume 2" << std::endl;
+    return MB_FAILURE;
+  }
+  for (int id = 7; id <= 12; ++id) {
+    if (0 == dagmc.entity_by_id( 2, id )) {
+      std::cerr << "ERROR: surface " << id << " of volume 2 was not loaded" << std::endl;
+      return MB_FAILURE;
+    }
+  }
+  Range tris, verts;
+  rval = dagmc.moab_instance()->get_entities_by_type( 0, MBTRI, tris );
+  CHKERR;
+  rval = dagmc.moab_instance()->get_entities_by_type( 0, MBVERTEX, verts );
+  CHKERR;
+  if (12 != tris.size() || 8 != verts.size()) {
+    std::cerr << "ERROR: " << tris.size() << " triangles and " << verts.size()
+              << " vertices loaded, expected 12 and 8" << std::endl;
+    return MB_FAILURE;
+  }
+
+  const double origin[] = { 4.0, 0.3, 0.5 };
+  const double direction[] = { 1.0, 0.0, 0.0 };
+  EntityHandle surf;
+  double dist;
+  rval = dagmc.ray_fire( dagmc.entity_by_id( 3, 2 ), origin, direction, surf, dist );
+  CHKERR;
+  if (surf != dagmc.entity_by_id( 2, 8 ) || fabs( dist - 1.0 ) > 1e-6) {
+    std::cerr << "ERROR: ray_fire in the loaded volume hit surface "
+              << dagmc.get_entity_id( surf ) << " at " << dist
+              << ", expected surface 8 at 1" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_property_tables( DagMC& dagmc )
+{
+  ErrorCode rval = load_property_geometry( dagmc );
+  CHKERR;
+
+  // volume 1 has the group's values, volume 2 the defaults
+  int vol1 = dagmc.index_by_handle( dagmc.entity_by_id( 3, 1 ) );
+  int vol2 = dagmc.index_by_handle( dagmc.entity_by_id( 3, 2 ) );
+  if (5 != dagmc.mat_id( vol1 ) || fabs( dagmc.density( vol1 ) - 2.7 ) > 1e-12 ||
+      2.0 != dagmc.importance( vol1 ) || 0 != dagmc.prop_flags( 3, vol1 )) {
+    std::cerr << "ERROR: wrong properties of volume 1: mat " << dagmc.mat_id( vol1 )
+              << ", rho " << dagmc.density( vol1 ) << ", imp " << dagmc.importance( vol1 )
+              << std::endl;
+    return MB_FAILURE;
+  }
+  if (0 != dagmc.mat_id( vol2 ) || 0.0 != dagmc.density( vol2 ) ||
+      1.0 != dagmc.importance( vol2 ) || 0 != dagmc.prop_flags( 3, vol2 )) {
+    std::cerr << "ERROR: volume 2 has properties it is not given" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // only surface 1 is a tally
+  int surf1 = dagmc.index_by_handle( dagmc.entity_by_id( 2, 1 ) );
+  int surf2 = dagmc.index_by_handle( dagmc.entity_by_id( 2, 2 ) );
+  if (DAGMC_TALLY != dagmc.prop_flags( 2, surf1 ) || 0 != dagmc.prop_flags( 2, surf2 )) {
+    std::cerr << "ERROR: wrong surface flags" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // releasing the mesh keeps the sets and their properties
+  rval = dagmc.release_mesh();
+  CHKERR;
+  if (5 != dagmc.mat_id( vol1 ) || DAGMC_TALLY != dagmc.prop_flags( 2, surf1 )) {
+    std::cerr << "ERROR: the properties were lost with the mesh" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // a new mesh whose groups are not parsed has none of the earlier values
+  rval = reload_geometry( dagmc, instance_write_geometry );
+  CHKERR;
+  vol1 = dagmc.index_by_handle( dagmc.entity_by_id( 3, 1 ) );
+  surf1 = dagmc.index_by_handle( dagmc.entity_by_id( 2, 1 ) );
+  if (0 != dagmc.mat_id( vol1 ) || 1.0 != dagmc.importance( vol1 ) ||
+      0 != dagmc.prop_flags( 2, surf1 )) {
+    std::cerr << "ERROR: the properties of the earlier mesh were kept" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
+
+ErrorCode test_property_index( DagMC& dagmc )
+{
+  ErrorCode rval = load_property_geometry( dagmc );
+  CHKERR;
+
+  const EntityHandle vol1 = dagmc.entity_by_id( 3, 1 );
+  const EntityHandle surf1 = dagmc.entity_by_id( 2, 1 );
+  const std::vector<EntityHandle> only_vol1( 1, vol1 ), only_surf1( 1, surf1 ), none;
+
+  // each view, by any dimension, by dimension and by value; volume 2 and the
+  // other surfaces have no properties and appear in none of them
+  const std::string five = "5", seven = "7", four = "4";
+  const struct {
+    const char* prop;
+    int dimension;
+    const std::string* value;
+    const std::vector<EntityHandle>* expected;
+  } views[] = {
+    { "mat",   0, NULL,   &only_vol1  },
+    { "mat",   3, NULL,   &only_vol1  },
+    { "mat",   2, NULL,   &none       },
+    { "mat",   3, &five,  &only_vol1  },
+    { "mat",   3, &seven, &none       },
+    { "rho",   0, NULL,   &only_vol1  },
+    { "imp",   3, NULL,   &only_vol1  },
+    { "tally", 0, NULL,   &only_surf1 },
+    { "tally", 2, &four,  &only_surf1 },
+    { "tally", 3, NULL,   &none       } };
+  for (unsigned i = 0; i < sizeof(views)/sizeof(views[0]); ++i) {
+    const std::vector<EntityHandle>* list;
+    rval = dagmc.entities_by_property( views[i].prop, list, views[i].dimension, views[i].value );
+    CHKERR;
+    std::vector<EntityHandle> copy;
+    rval = dagmc.entities_by_property( views[i].prop, copy, views[i].dimension, views[i].value );
+    CHKERR;
+    if (*list != *views[i].expected || copy != *views[i].expected) {
+      std::cerr << "ERROR: wrong entities with property " << views[i].prop << " in dimension "
+                << views[i].dimension << ( views[i].value ? " and value " + *views[i].value : "" )
+                << std::endl;
+      return MB_FAILURE;
+    }
+  }
+
+  const std::vector<std::string>* values;
+  rval = dagmc.get_all_prop_values( "rho", values );
+  CHKERR;
+  if (1 != values->size() || "2.7" != values->front()) {
+    std::cerr << "ERROR: wrong values of property rho" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // releasing the mesh keeps the indexed sets
+  rval = dagmc.release_mesh();
+  CHKERR;
+  const std::vector<EntityHandle>* list;
+  rval = dagmc.entities_by_property( "mat", list, 3 );
+  CHKERR;
+  if (*list != only_vol1) {
+    std::cerr << "ERROR: the property index changed with the mesh released" << std::endl;
+    return MB_FAILURE;
+  }
+
+  // a new mesh whose groups are not parsed has none of the earlier handles
+  rval = reload_geometry( dagmc, instance_write_geometry );
+  CHKERR;
+  rval = dagmc.entities_by_property( "mat", list, 0 );
+  CHKERR;
+  rval = dagmc.get_all_prop_values( "rho", values );
+  CHKERR;
+  if (!list->empty() || !values->empty()) {
+    std::cerr << "ERROR: the property index of the earlier mesh was kept" << std::endl;
+    return MB_FAILURE;
+  }
+
+  return MB_SUCCESS;
+}
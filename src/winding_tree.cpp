@@ -0,0 +1,214 @@
+#include "winding_tree.hpp"
+
+#include <algorithm>
+#include <thread>
+#include <math.h>
+
+// the most triangles in a leaf
+static const unsigned leaf_size = 8;
+
+// orders triangles by one coordinate of their centroids
+struct CentroidLess {
+  const std::vector<double> &centroids;
+  int axis;
+  CentroidLess( const std::vector<double> &c, int a ) : centroids(c), axis(a) {}
+  bool operator()( unsigned a, unsigned b ) const
+  { return centroids[3*a+axis] < centroids[3*b+axis]; }
+};
+
+WindingTree::WindingTree(const std::vector<double> &tris, double beta) : beta(beta)
+{
+  unsigned num_tris = tris.size()/9;
+  if ( 0 == num_tris )
+    return;
+
+  std::vector<double> centroids(3*num_tris);
+  std::vector<unsigned> order(num_tris);
+  for ( unsigned i = 0; i < num_tris; i++ )
+    {
+      order[i] = i;
+      for ( unsigned j = 0; j < 3; j++ )
+	centroids[3*i+j] = ( tris[9*i+j] + tris[9*i+3+j] + tris[9*i+6+j] ) / 3.0;
+    }
+
+  nodes.reserve(2*num_tris/leaf_size + 1);
+  build(0, num_tris, order, tris, centroids);
+
+  // store the vertices in tree order so that the triangles of a leaf are
+  // contiguous and its exact sum is a straight loop over the arrays
+  std::vector<double>* coords[9] = { &x0, &y0, &z0, &x1, &y1, &z1, &x2, &y2, &z2 };
+  for ( unsigned j = 0; j < 9; j++ )
+    {
+      coords[j]->resize(num_tris);
+      for ( unsigned i = 0; i < num_tris; i++ )
+	(*coords[j])[i] = tris[9*order[i]+j];
+    }
+}
+
+int WindingTree::build(unsigned first, unsigned count, std::vector<unsigned> &order,
+                       const std::vector<double> &tris, const std::vector<double> &centroids)
+{
+  int idx = nodes.size();
+  nodes.push_back(Node());
+
+  // dipole expansion of the node's triangles
+  double area_sum = 0.0, center[3] = { 0.0, 0.0, 0.0 }, dipole[3] = { 0.0, 0.0, 0.0 };
+  for ( unsigned i = first; i < first+count; i++ )
+    {
+      const double *v = &tris[9*order[i]];
+      double e1[3] = { v[3]-v[0], v[4]-v[1], v[5]-v[2] };
+      double e2[3] = { v[6]-v[0], v[7]-v[1], v[8]-v[2] };
+      double n[3] = { 0.5*(e1[1]*e2[2] - e1[2]*e2[1]),
+		      0.5*(e1[2]*e2[0] - e1[0]*e2[2]),
+		      0.5*(e1[0]*e2[1] - e1[1]*e2[0]) };
+      double area = sqrt( n[0]*n[0] + n[1]*n[1] + n[2]*n[2] );
+      area_sum += area;
+      for ( unsigned j = 0; j < 3; j++ )
+	{
+	  dipole[j] += n[j];
+	  center[j] += area*centroids[3*order[i]+j];
+	}
+    }
+  for ( unsigned j = 0; j < 3; j++ )
+    center[j] = ( area_sum > 0.0 ) ? center[j]/area_sum : centroids[3*order[first]+j];
+
+  double radius2 = 0.0;
+  for ( unsigned i = first; i < first+count; i++ )
+    {
+      const double *v = &tris[9*order[i]];
+      for ( unsigned k = 0; k < 3; k++ )
+	{
+	  double d[3] = { v[3*k]-center[0], v[3*k+1]-center[1], v[3*k+2]-center[2] };
+	  radius2 = std::max( radius2, d[0]*d[0] + d[1]*d[1] + d[2]*d[2] );
+	}
+    }
+
+  Node &node = nodes[idx];
+  std::copy( center, center+3, node.centroid );
+  std::copy( dipole, dipole+3, node.dipole );
+  node.radius = sqrt(radius2);
+  node.first = first;
+  node.count = count;
+  node.left = node.right = -1;
+
+  if ( count <= leaf_size )
+    return idx;
+
+  // split at the median centroid along the widest axis of the centroids
+  double lo[3], hi[3];
+  for ( unsigned j = 0; j < 3; j++ )
+    lo[j] = hi[j] = centroids[3*order[first]+j];
+  for ( unsigned i = first+1; i < first+count; i++ )
+    for ( unsigned j = 0; j < 3; j++ )
+      {
+	lo[j] = std::min( lo[j], centroids[3*order[i]+j] );
+	hi[j] = std::max( hi[j], centroids[3*order[i]+j] );
+      }
+  int axis = 0;
+  for ( int j = 1; j < 3; j++ )
+    if ( hi[j]-lo[j] > hi[axis]-lo[axis] )
+      axis = j;
+
+  unsigned mid = first + count/2;
+  std::nth_element( order.begin()+first, order.begin()+mid, order.begin()+first+count,
+		    CentroidLess(centroids, axis) );
+
+  // the node vector may grow while the children are built
+  int left = build(first, mid-first, order, tris, centroids);
+  int right = build(mid, first+count-mid, order, tris, centroids);
+  nodes[idx].left = left;
+  nodes[idx].right = right;
+
+  return idx;
+}
+
+/* exact solid angle of a leaf's triangles (Van Oosterom and Strackee) */
+double WindingTree::leaf_solid_angle(const Node &node, const double pt[3]) const
+{
+  double omega = 0.0;
+  const unsigned end = node.first + node.count;
+  for ( unsigned i = node.first; i < end; i++ )
+    {
+      double ax = x0[i]-pt[0], ay = y0[i]-pt[1], az = z0[i]-pt[2];
+      double bx = x1[i]-pt[0], by = y1[i]-pt[1], bz = z1[i]-pt[2];
+      double cx = x2[i]-pt[0], cy = y2[i]-pt[1], cz = z2[i]-pt[2];
+      double la = sqrt( ax*ax + ay*ay + az*az );
+      double lb = sqrt( bx*bx + by*by + bz*bz );
+      double lc = sqrt( cx*cx + cy*cy + cz*cz );
+      double det = ax*(by*cz - bz*cy) - ay*(bx*cz - bz*cx) + az*(bx*cy - by*cx);
+      double denom = la*lb*lc + (ax*bx + ay*by + az*bz)*lc
+	+ (bx*cx + by*cy + bz*cz)*la + (cx*ax + cy*ay + cz*az)*lb;
+      omega += 2.0*atan2( det, denom );
+    }
+
+  return omega;
+}
+
+double WindingTree::winding_number(const double pt[3]) const
+{
+  if ( nodes.empty() )
+    return 0.0;
+
+  const double beta2 = beta*beta;
+  double omega = 0.0;
+
+  // both children are pushed at each level, so the stack never holds more
+  // than the tree depth + 1 nodes
+  int stack[128];
+  int top = 0;
+  stack[top++] = 0;
+  while ( top )
+    {
+      const Node &node = nodes[stack[--top]];
+      double r[3] = { node.centroid[0]-pt[0], node.centroid[1]-pt[1], node.centroid[2]-pt[2] };
+      double dist2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+
+      // far from the node, use its dipole expansion
+      if ( dist2 > beta2*node.radius*node.radius )
+	{
+	  omega += ( r[0]*node.dipole[0] + r[1]*node.dipole[1] + r[2]*node.dipole[2] ) / ( dist2*sqrt(dist2) );
+	  continue;
+	}
+
+      if ( -1 == node.left )
+	{
+	  omega += leaf_solid_angle( node, pt );
+	  continue;
+	}
+
+      stack[top++] = node.left;
+      stack[top++] = node.right;
+    }
+
+  return omega / (4.0*M_PI);
+}
+
+static void winding_range(const WindingTree *tree, const double *pts,
+                          unsigned begin, unsigned end, double *out)
+{
+  for ( unsigned i = begin; i < end; i++ )
+    out[i] = tree->winding_number( pts + 3*i );
+}
+
+void WindingTree::winding_numbers(const double *pts, unsigned num_pts, double *out,
+                                  unsigned num_threads) const
+{
+  if ( 0 == num_threads )
+    num_threads = std::thread::hardware_concurrency();
+  if ( num_threads > num_pts )
+    num_threads = num_pts;
+  if ( num_threads <= 1 )
+    {
+      winding_range( this, pts, 0, num_pts, out );
+      return;
+    }
+
+  // the tree is only read, so the threads need no synchronization
+  std::vector<std::thread> threads;
+  unsigned chunk = ( num_pts + num_threads - 1 ) / num_threads;
+  for ( unsigned begin = 0; begin < num_pts; begin += chunk )
+    threads.push_back( std::thread( winding_range, this, pts, begin,
+				    std::min( begin+chunk, num_pts ), out ) );
+  for ( unsigned i = 0; i < threads.size(); i++ )
+    threads[i].join();
+}
@@ -0,0 +1,51 @@
+#ifndef WINDING_TREE_HPP
+#define WINDING_TREE_HPP
+
+#include <vector>
+
+/* Fast generalized winding number of a triangulated surface.
+
+   The triangles are held in a bounding volume hierarchy. Each node keeps the
+   first order (dipole) expansion of the solid angle its triangles subtend:
+   their total area vector placed at their area weighted centroid. A node far
+   enough from the query point (distance > beta * node radius) is evaluated
+   from its expansion, nearby leaves are summed exactly, so a query costs
+   O(log N) rather than O(N). The winding number is ~1 inside a closed surface
+   whose normals point outward, ~0 outside, and degrades gracefully (rather
+   than failing) for surfaces with small gaps or overlaps. */
+class WindingTree {
+  public:
+  // tris holds 9 coordinates (v0, v1, v2) per triangle, each wound so that its
+  // normal points out of the volume
+  WindingTree(const std::vector<double> &tris, double beta = 2.0);
+
+  // winding number of the surface about the point
+  double winding_number(const double pt[3]) const;
+
+  // winding numbers of num_pts points (3 coordinates each), split between
+  // num_threads threads (0 for one per hardware thread)
+  void winding_numbers(const double *pts, unsigned num_pts, double *out,
+                       unsigned num_threads = 0) const;
+
+  unsigned num_triangles() const { return x0.size(); }
+
+  private:
+  struct Node {
+    double centroid[3]; // area weighted centroid, the expansion center
+    double dipole[3];   // sum of the triangle area vectors
+    double radius;      // distance from centroid to the furthest vertex
+    unsigned first, count; // triangles of the node
+    int left, right;    // child nodes, -1 for a leaf
+  };
+
+  // triangle vertices in SoA layout, ordered so that each node is contiguous
+  std::vector<double> x0, y0, z0, x1, y1, z1, x2, y2, z2;
+  std::vector<Node> nodes;
+  double beta;
+
+  int build(unsigned first, unsigned count, std::vector<unsigned> &order,
+            const std::vector<double> &tris, const std::vector<double> &centroids);
+  double leaf_solid_angle(const Node &node, const double pt[3]) const;
+};
+
+#endif